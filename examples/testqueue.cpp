@@ -1,86 +1,170 @@
 /**
- * DEMO of AtomQueue.
+ * Stress test of AtomQueue in each mode.
+ * Producers push tagged elements by push and push_bulk, consumers take them by
+ * get, get_wait and get_batch. Every element must be got exactly once, and each
+ * consumer must see the elements of one producer in the pushed order.
  */
 
 #include <iostream>
+#include <atomic>
+#include <vector>
 #include <pthread.h>
-#include <map>
-#include <set>
-#include <unistd.h> 
-#include "atomqueue.hpp"
+#include "wtatomqueue.hpp"
 
 using std::cout;
 
-wtatom::AtomQueue<int> q(2);
+static const uint64_t per_producer = 200000;
+static const size_t bulk_size = 7;
+static const size_t batch_size = 16;
 
-void* push_to(void* args) {
-    int num = *(int*)args;
-    q.push(num);
+/**
+ * Shared by the threads of one run.
+ */
+template <typename Queue>
+struct TestCase {
+    Queue* q;
+    size_t producers;
+    bool check_order;                          // Locked mode get may move the top to the tail.
+    std::atomic<uint64_t> got;                 // Elements got by all consumers.
+    std::vector<std::atomic<uint8_t> >* seen;  // Times each element is got.
+    std::atomic<size_t> disorders;
+};
+
+template <typename Queue>
+struct ThreadArgs {
+    TestCase<Queue>* test;
+    size_t id;
+};
+
+template <typename Queue>
+void* produce(void* args) {
+    TestCase<Queue>* test = ((ThreadArgs<Queue>*)args)->test;
+    uint64_t id = ((ThreadArgs<Queue>*)args)->id;
+    uint64_t seq = 0;
+    uint64_t run[bulk_size];
+    while (seq < per_producer) {
+        // Alternate single pushes and runs of bulk_size.
+        if ((seq / bulk_size) % 2 == 0 || seq + bulk_size > per_producer) {
+            test->q->push((id << 32) | seq);
+            ++seq;
+            continue;
+        }
+        for (size_t i = 0; i < bulk_size; ++i) {
+            run[i] = (id << 32) | (seq + i);
+        }
+        test->q->push_bulk(run, run + bulk_size);
+        seq += bulk_size;
+    }
     return nullptr;
 }
 
-void* get_from(void* args) {
-    int* num = (int*)args;
-    int tmp;
-    if (q.get(tmp) == true) {
-        *num = tmp;
-        return nullptr;
+template <typename Queue>
+void* consume(void* args) {
+    TestCase<Queue>* test = ((ThreadArgs<Queue>*)args)->test;
+    uint64_t total = per_producer * test->producers;
+    std::vector<int64_t> last(test->producers, -1);
+    uint64_t out[batch_size];
+    size_t round = 0;
+    while (test->got.load() < total) {
+        size_t num = 0;
+        switch (round++ % 3) {
+        case 0:
+            num = test->q->get(&out[0]) == true ? 1 : 0;
+            break;
+        case 1:
+            num = test->q->get_wait(&out[0], 1000) == true ? 1 : 0;
+            break;
+        default:
+            num = test->q->get_batch_wait(out, batch_size, 1000);
+        }
+        for (size_t i = 0; i < num; ++i) {
+            uint64_t producer = out[i] >> 32;
+            int64_t seq = out[i] & 0xffffffff;
+            if (producer >= test->producers || seq >= (int64_t)per_producer) {
+                ++test->disorders;
+                continue;
+            }
+            (*test->seen)[producer * per_producer + seq].fetch_add(1);
+            if (test->check_order == true && seq <= last[producer]) {
+                ++test->disorders;
+            }
+            last[producer] = seq;
+        }
+        test->got.fetch_add(num);
     }
     return nullptr;
 }
 
-pthread_t get_t[3000];
-pthread_t push_t[1000];
+/**
+ * Run producers and consumers on the queue, then check the elements got.
+ * @return false: Lost, duplicated or disordered elements.
+ */
+template <typename Queue>
+bool run_case(const char* name, Queue* q, size_t producers, size_t consumers, bool check_order) {
+    std::vector<std::atomic<uint8_t> > seen(producers * per_producer);
+    for (size_t i = 0; i < seen.size(); ++i) {
+        seen[i].store(0);
+    }
+    TestCase<Queue> test;
+    test.q = q;
+    test.producers = producers;
+    test.check_order = check_order;
+    test.got.store(0);
+    test.seen = &seen;
+    test.disorders.store(0);
 
-int s[3000];
+    std::vector<pthread_t> threads(producers + consumers);
+    std::vector<ThreadArgs<Queue> > args(producers + consumers);
+    for (size_t i = 0; i < producers + consumers; ++i) {
+        args[i].test = &test;
+        args[i].id = i;
+        pthread_create(&threads[i], nullptr, i < producers ? produce<Queue> : consume<Queue>, &args[i]);
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        pthread_join(threads[i], nullptr);
+    }
+
+    size_t lost = 0;
+    size_t duplicated = 0;
+    for (size_t i = 0; i < seen.size(); ++i) {
+        if (seen[i].load() == 0) {
+            ++lost;
+        } else if (seen[i].load() > 1) {
+            ++duplicated;
+        }
+    }
+    bool res = (lost == 0 && duplicated == 0 && test.disorders.load() == 0 && q->size() == 0);
+    cout << name << ": " << producers << " producers, " << consumers << " consumers, lost " << lost
+        << ", duplicated " << duplicated << ", disordered " << test.disorders.load()
+        << (res == true ? ". OK\n" : ". FAILED\n");
+    return res;
+}
 
 int main() {
-    
-    for (size_t i = 0; i < 1000; ++i) {
-        s[i] = -1;
+    bool res = true;
+    {
+        wtatom::AtomQueue<uint64_t> q(2, wtatom::QueueMode::locked);
+        res = run_case("locked", &q, 4, 4, false) && res;
     }
-    
-    std::set<int> sst;
-    
-    for (size_t i = 0; i < 3000; ++i) {
-        bool* res;
-        int ret = 0;
-        if (i < 1000)
-        int ret = pthread_create(&push_t[i], NULL, push_to, new int(i));
-        if (ret != 0) {
-            cout << "dasdas\n";
-        }
-        
-        ret = pthread_create(&get_t[i], NULL, get_from, &s[i]);
-        if(ret !=0) {
-            cout << "dasdas\n";
-        }
+    {
+        wtatom::AtomQueue<uint64_t> q(64, wtatom::QueueMode::ring);
+        res = run_case("ring", &q, 4, 4, true) && res;
     }
-    
-    cout <<"wait\n";
-    for (size_t i = 0; i < 3000; ++i) {
-        int* k;
-        void** a = (void**)&k;
-        if (i < 1000) {
-            cout << "Wait P:" << i << "\n";
-            pthread_join(push_t[i], a);
-        }
-        cout << "Wait G:" << i << "\n";
-        pthread_join(get_t[i], a);
-       
+    {
+        wtatom::AtomQueue<uint64_t> q(64, wtatom::QueueMode::segment);
+        res = run_case("segment", &q, 4, 4, true) && res;
     }
-    
-    for (size_t i = 0; i < 3000; ++i) {
-        if (s[i] == -1) continue;
-        
-        sst.insert(s[i]);
+    {
+        wtatom::AtomQueue<uint64_t, wtatom::Producers::Multi, wtatom::Consumers::Single> q(64, wtatom::QueueMode::ring);
+        res = run_case("ring MPSC", &q, 4, 1, true) && res;
     }
-    
-    for (size_t i = 0; i < 1000; ++i) {
-        if (sst.find(i) == sst.end()) {
-            cout << "NO!!"<<i<<"\n";
-        }
+    {
+        wtatom::AtomQueue<uint64_t, wtatom::Producers::Single, wtatom::Consumers::Multi> q(64, wtatom::QueueMode::segment);
+        res = run_case("segment SPMC", &q, 1, 4, true) && res;
+    }
+    {
+        wtatom::AtomQueue<uint64_t, wtatom::Producers::Single, wtatom::Consumers::Single> q(64);
+        res = run_case("SPSC", &q, 1, 1, true) && res;
     }
-    
-    return 0;
+    return res == true ? 0 : 1;
 }
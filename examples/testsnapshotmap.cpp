@@ -0,0 +1,104 @@
+/**
+ * Stress test of SnapshotMap: writers insert and remove while readers iterate.
+ * Each value is derived from its key, so a freed or torn snapshot is detected.
+ * Build with -fsanitize=address to also catch use after free.
+ */
+
+#include <iostream>
+#include <atomic>
+#include <pthread.h>
+#include "wtsnapshotmap.h"
+
+using std::cout;
+
+static const size_t writer_num = 4;
+static const size_t reader_num = 8;
+static const size_t key_range = 64;
+static const size_t write_times = 20000;
+
+wtatom::SnapshotMap<size_t, size_t> m;
+std::atomic<bool> writing(true);
+std::atomic<size_t> errors(0);
+std::atomic<size_t> reads(0);
+
+size_t val_of(size_t key) {
+    return key * 2654435761u + 1;
+}
+
+void* write_to(void* args) {
+    size_t id = *(size_t*)args;
+    for (size_t i = 0; i < write_times; ++i) {
+        size_t key = (i * writer_num + id) % key_range;
+        if (i % 3 == 2) {
+            size_t val = 0;
+            if (m.find_and_remove(key, &val) == true && val != val_of(key)) {
+                ++errors;
+            }
+        } else {
+            m.insert(std::make_pair(key, val_of(key)));
+        }
+    }
+    return nullptr;
+}
+
+void* read_from(void* args) {
+    (void)args;
+    while (writing.load() == true) {
+        auto guard = m.read();
+        size_t last = 0;
+        bool first = true;
+        for (auto it = guard->begin(); it != guard->end(); ++it) {
+            if (it->second != val_of(it->first) || (first == false && it->first <= last)) {
+                ++errors;
+            }
+            last = it->first;
+            first = false;
+        }
+        // Writing while holding the guard, as the server does, must not block.
+        if (reads.fetch_add(1) % 97 == 0) {
+            m.insert(std::make_pair(last, val_of(last)));
+        }
+        size_t val = 0;
+        if (m.find(last, &val) == true && val != val_of(last)) {
+            ++errors;
+        }
+    }
+    return nullptr;
+}
+
+int main() {
+    pthread_t write_t[writer_num];
+    pthread_t read_t[reader_num];
+    size_t ids[writer_num];
+    for (size_t i = 0; i < reader_num; ++i) {
+        pthread_create(&read_t[i], nullptr, read_from, nullptr);
+    }
+    for (size_t i = 0; i < writer_num; ++i) {
+        ids[i] = i;
+        pthread_create(&write_t[i], nullptr, write_to, &ids[i]);
+    }
+    for (size_t i = 0; i < writer_num; ++i) {
+        pthread_join(write_t[i], nullptr);
+    }
+    writing.store(false);
+    for (size_t i = 0; i < reader_num; ++i) {
+        pthread_join(read_t[i], nullptr);
+    }
+
+    // Every key left must be readable with its value.
+    std::vector<size_t> keys;
+    std::vector<size_t> vals;
+    m.get_all(&keys, &vals);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (vals[i] != val_of(keys[i])) {
+            ++errors;
+        }
+    }
+    cout << "Reads: " << reads.load() << ", size: " << m.size() << ", errors: " << errors.load() << "\n";
+    if (errors.load() != 0) {
+        cout << "FAILED\n";
+        return 1;
+    }
+    cout << "OK\n";
+    return 0;
+}
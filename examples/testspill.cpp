@@ -0,0 +1,251 @@
+/**
+ * Test of the spill file: the link to the server is cut and restored while
+ * logging. The link is slower than the logging, so the spill file fills up
+ * while older logs in it are replayed.
+ * Every log must land exactly once and none may be dropped.
+ * The server, the lander and a proxy which cuts the link run in this process.
+ */
+
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <pthread.h>
+#include <poll.h>
+#include "wtlogserver.h"
+#include "wtloglander.h"
+#include "wtlogclient.h"
+
+using std::cout;
+
+short server_port = 0;
+short proxy_port = 0;
+static const size_t thread_num = 4;
+static const size_t offline_logs = 55000; // Of each thread, spilled while the link is down.
+static const size_t online_logs = 100000; // Of each thread, after the link is restored.
+static const size_t per_thread = offline_logs + online_logs;
+
+std::atomic<bool> link_up(true);
+std::atomic<bool> proxy_running(true);
+std::atomic<size_t> accepted(0); // Connections forwarded.
+
+int listen_on(short port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    // A small window, so the client can't hide the slow link in its socket buffer.
+    int buf_size = 16384;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Forward one connection of the client to the server, about 2MB per second.
+ * While the link is down, the connection is closed and new ones are closed when accepted.
+ */
+void* run_proxy(void* args) {
+    int listen_fd = *(int*)args;
+    int fds[2] = {-1, -1}; // Client side, server side.
+    char buffer[2048];
+    while (proxy_running.load() == true) {
+        if (link_up.load() == false && fds[0] >= 0) {
+            close(fds[0]);
+            close(fds[1]);
+            fds[0] = fds[1] = -1;
+        }
+        pollfd pfds[3] = {{listen_fd, POLLIN, 0}, {fds[0], POLLIN, 0}, {fds[1], POLLIN, 0}};
+        if (poll(pfds, 3, 10) <= 0) {
+            continue;
+        }
+        if ((pfds[0].revents & POLLIN) != 0) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd >= 0 && link_up.load() == false) {
+                close(fd);
+            } else if (fd >= 0) {
+                if (fds[0] >= 0) {
+                    close(fds[0]);
+                    close(fds[1]);
+                }
+                sockaddr_in addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                addr.sin_port = htons(server_port);
+                fds[0] = fd;
+                fds[1] = socket(AF_INET, SOCK_STREAM, 0);
+                if (connect(fds[1], (sockaddr*)&addr, sizeof(addr)) != 0) {
+                    toscreen << "The proxy cannot connect the server.\n";
+                }
+                ++accepted;
+            }
+        }
+        for (size_t i = 0; i < 2; ++i) {
+            if (fds[i] < 0 || pfds[i + 1].revents == 0) {
+                continue;
+            }
+            ssize_t ret = recv(fds[i], buffer, sizeof(buffer), 0);
+            if (ret <= 0 || wttool::write_all(fds[1 - i], buffer, ret) != wttool::io_ok) {
+                close(fds[0]);
+                close(fds[1]);
+                fds[0] = fds[1] = -1;
+                break;
+            }
+            usleep(1000);
+        }
+    }
+    return nullptr;
+}
+
+struct LogArgs {
+    wtlog::WTLogClient* client;
+    size_t id;
+    size_t from;
+    size_t to;
+};
+
+void* write_logs(void* args) {
+    LogArgs* log_args = (LogArgs*)args;
+    for (size_t i = log_args->from; i < log_args->to; ++i) {
+        size_t num = log_args->id * per_thread + i;
+        log_args->client->tolog("spill log " + std::to_string(num) + ";", wtlog::LogLevel::info);
+    }
+    return nullptr;
+}
+
+/**
+ * Write logs [from, to) of each thread, return after all are written.
+ */
+void write_all_logs(wtlog::WTLogClient* client, size_t from, size_t to) {
+    pthread_t log_t[thread_num];
+    LogArgs args[thread_num];
+    for (size_t i = 0; i < thread_num; ++i) {
+        args[i].client = client;
+        args[i].id = i;
+        args[i].from = from;
+        args[i].to = to;
+        pthread_create(&log_t[i], nullptr, write_logs, &args[i]);
+    }
+    for (size_t i = 0; i < thread_num; ++i) {
+        pthread_join(log_t[i], nullptr);
+    }
+}
+
+int main() {
+    // Ports of the server stay bound for a while after exiting, use new ones each run.
+    server_port = 20000 + getpid() % 20000;
+    proxy_port = server_port + 1;
+    string dir = "/tmp/wtlog_testspill/";
+    system(("rm -rf " + dir + " && mkdir -p " + dir).c_str());
+
+    wtlog::WTLogServer server;
+    if (server.start(server_port) == false) {
+        cout << "Cannot start the server.\n";
+        return 1;
+    }
+    wtlog::WTLogLander lander(dir);
+    if (lander.connect("127.0.0.1", server_port) == false) {
+        cout << "Cannot connect the lander.\n";
+        return 1;
+    }
+    int listen_fd = listen_on(proxy_port);
+    pthread_t proxy_t;
+    pthread_create(&proxy_t, nullptr, run_proxy, &listen_fd);
+
+    wtlog::WTLogClient client;
+    // Room for the offline logs, about 34 bytes each, and a little more.
+    // It must be more than the socket buffers take at once when replaying.
+    client.set_spill(dir + "spill.bin", 8 << 20);
+    // Logs go through the shared queue with a limit, it is never reached here.
+    client.set_queue_limit(1 << 20, 0);
+    if (client.connect("127.0.0.1", proxy_port) == false) {
+        cout << "Cannot connect the client.\n";
+        return 1;
+    }
+
+    // Cut the link while idle, so no log is lost in flight. The offline logs are spilled,
+    // then replayed through the slow link while the online ones fill the spill file.
+    link_up.store(false);
+    usleep(50000);
+    write_all_logs(&client, 0, offline_logs);
+    size_t connections = accepted.load();
+    link_up.store(true);
+    while (accepted.load() == connections) {
+        usleep(1000);
+    }
+    write_all_logs(&client, offline_logs, per_thread);
+    client.disconnect();
+    uint64_t dropped = 0;
+    for (size_t i = 0; i < wtlog::log_level_num; ++i) {
+        dropped += client.dropped((wtlog::LogLevel)i);
+    }
+    // The proxy may still hold logs, wait until the day file stops growing.
+    string day_file = dir + wttool::cur_date();
+    long last_size = -1;
+    while (true) {
+        sleep(1);
+        FILE* file = fopen(day_file.c_str(), "rb");
+        long size = 0;
+        if (file != nullptr) {
+            fseek(file, 0, SEEK_END);
+            size = ftell(file);
+            fclose(file);
+        }
+        if (size == last_size) {
+            break;
+        }
+        last_size = size;
+    }
+    lander.disconnect();
+    proxy_running.store(false);
+    pthread_join(proxy_t, nullptr);
+
+    // Count each log in the day file.
+    std::vector<uint32_t> copies(thread_num * per_thread, 0);
+    FILE* in = fopen(day_file.c_str(), "rb");
+    if (in == nullptr) {
+        cout << "No log file.\n";
+        return 1;
+    }
+    std::vector<char> data;
+    char block[65536];
+    size_t read_size = 0;
+    while ((read_size = fread(block, 1, sizeof(block), in)) != 0) {
+        data.insert(data.end(), block, block + read_size);
+    }
+    fclose(in);
+    const string tag = "spill log ";
+    for (size_t pos = 0; pos + tag.size() < data.size(); ++pos) {
+        if (memcmp(&data[pos], tag.c_str(), tag.size()) != 0) {
+            continue;
+        }
+        size_t num = strtoul(&data[pos + tag.size()], nullptr, 10);
+        if (num < copies.size()) {
+            ++copies[num];
+        }
+    }
+    size_t lost = 0;
+    size_t duplicated = 0;
+    for (size_t i = 0; i < copies.size(); ++i) {
+        if (copies[i] == 0) {
+            ++lost;
+        } else if (copies[i] > 1) {
+            ++duplicated;
+        }
+    }
+    cout << "Logs: " << copies.size() << ", lost: " << lost << ", duplicated: " << duplicated
+        << ", dropped: " << dropped << "\n";
+    if (lost != 0 || duplicated != 0 || dropped != 0) {
+        cout << "FAILED\n";
+        return 1;
+    }
+    cout << "OK\n";
+    return 0;
+}
@@ -4,23 +4,44 @@
  * Date: 2019/7/16.
  *
  * From Client to Server:
- *     Send log: [head(16)][time(32)][level(16)][hash_id(32)][content_size(16)][content(variable_length)].
+ *     Send log: [head(16)][time(64)][level(16)][hash_id(32)][content_size(16)][content(variable_length)].
+ *         time is in nanosecond since epoch.
  *     Initialize conncetion shake hand: [head(16)].
  *     Disconnect: [head(16)].
+ *     Report dropped logs since last report: [head(16)][info(32)][debug(32)][warning(32)][error(32)].
+ *     Define a format: [head(16)][format_id(64)][format_size(16)][format(variable_length)].
+ *         Sent once per connection, before the first log using it.
+ *     Send compressed logs: [head(16)][codec(8)][flags(8)][format_num(16)][log_num(32)][raw_size(32)]
+ *         [packed_size(32)][format_id_1(64)]...[packed(packed_size)].
+ *         Unpacked, it is raw_size bytes of frames as they are sent alone: logs and format definitions.
+ *         format_ids are the formats used by the logs, in the byte order of the client.
+ *     Tell who the client is: [head(16)][session_id(64)]. Sent after the handshake, the same in each reconnection.
+ *     Number the following logs: [head(16)][seq(64)]. seq is the sequence number of the next log,
+ *         each log, alone or in a batch, takes the next one. Logs of the session seen before are discarded.
  *
  * From Server to Client:
- *     Reply log: Directly transmit the package from Lander.
+ *     Reply log: The package from Lander, with the hash_id given by the Client.
  *     Initialize conncetion shake hand reply: [head(16)].
  *     Disconnect reply: [head(16)].
+ *     Set the min level of logs to send: [head(16)][level(16)]. Sent with the handshake reply, and on changes.
  *
  * From Server to Lander:
- *     Send log: Directly transmit the package from Client.
+ *     Send log: The package from Client. If it needs reply, hash_id is replaced by a Server one.
+ *     Define a format: Same as the Client one. Sent once per connection, before the first log using it.
+ *     Send compressed logs: The package from Client, if it has batch_relay. Otherwise the logs are sent alone.
  *     Send search request: [head(16)][level(16)][hash_id(32)][start_time(32)]
  *         [end_time(32)][content_size(16)][content(variable_length)].
  *
  * From Lander to Server:
  *     Reply log: [head(16)][hash_id(32)][reply_message_size(16)][reply_message(variable_length)].
  *     Reply search request: [head(16)][hash_id(32)][message_number(16)][msg_1_size(16)][msg_1_content][msg_2_size(16)]...
+ *
+ * hash_id is a request id chosen by the sender from its pending slab, 0 if no reply is needed.
+ * Client and Server each map the id back to the request by an array index.
+ * If level has level_fmt_flag, the content is a format_id and raw arguments, see wtlogformat.h.
+ * If level has level_fields_flag, the content is a message and typed fields, see wtlogfields.h.
+ * If level has level_suppressed_flag, the content ends with the number of logs suppressed before it(32),
+ *     by the rate limits or sampling of the client, see wtlimit.h.
  */
 
 #ifndef _WTLOG_CLIENT_PROTOCOL_
@@ -42,11 +63,17 @@ const uint16_t h_authorize_info = 2560; // Tell server this client is ready.
 const uint16_t h_close_head = 2561; // Tell server this client won't send more logs.
 const uint16_t h_send_log = 2562; // Tell server this is a log.
 const uint16_t h_send_log_need_reply = 2563; // Tell server this is a log and need reply.
+const uint16_t h_drop_report = 2564; // Tell server how many logs are dropped by the client.
+const uint16_t h_format_def = 2565; // Tell server the format string of a format_id.
+const uint16_t h_send_batch = 2566; // Tell server this is a compressed batch of logs.
+const uint16_t h_client_id = 2567; // Tell server the session of this client, kept after reconnecting.
+const uint16_t h_seq_mark = 2568; // Tell server the sequence number of the next log.
 
 // Head from server to client.
 const uint16_t h_authorize_ret = 9766; // Tell client this server is ready to receive log.
 const uint16_t h_close_ret = 9767; // Tell client this server have known the client is closed.
 const uint16_t h_log_receive_success = 9768; // Tell client this is a reply to a log.
+const uint16_t h_set_level = 9769; // Tell client not to send logs below a level.
 
 // Head from lander to server.
 const uint16_t h_handshake_info = 1101; // Tell server this lander is ready to receive logs.
@@ -59,6 +86,8 @@ extern const uint16_t h_log_receive_success; // Tell client this is a reply to a
 const uint16_t h_handshake_ret = 8455; // Tell lander this server know the existing of the lander. Start to send log.
 extern const uint16_t h_send_log; // Tell lander this is a log.
 extern const uint16_t h_send_log_need_reply; // Tell lander this is a log. Need reply to server after finish printing.
+extern const uint16_t h_format_def; // Tell lander the format string of a format_id.
+extern const uint16_t h_send_batch; // Tell lander this is a compressed batch of logs without reply.
 const uint16_t h_search_request = 8457; // Tell lander this is a search request.
 const uint16_t h_stop_send_log_reply = 8458; // Tell lander this server won't send any log to the lander.
 const uint16_t h_close_with_lander_reply = 8459; // Tell lander this server won't receive any message from the lander.
@@ -66,6 +95,30 @@ const uint16_t h_close_with_lander_reply = 8459; // Tell lander this server won'
 // Other.
 const char log_disk_tail_tag = -1; // This byte indicate this may be the tail of one log in disk file (Not guarntee since log may be binary).
 const char log_disk_head_tag = 1; // This byte indicate this may be the head of one log in disk file (Not guarntee since log may be binary).
+const int64_t reply_timeout_us = 1e7; // Default max waitting time of a reply, in microsecond. Pending replies are forgotten after it.
+const size_t reply_slot_num = 1 << 16; // Max logs waitting for reply in a client, or in the server.
+const size_t key_limit_slots = 256; // Keys of WTLogClient::tolog_keyed share this many rate limiters.
+const int64_t io_timeout_us = 5e6; // Max waitting time of a handshake, a command reply, or the rest of a frame.
+const size_t staging_ring_size = 1 << 16; // Bytes of frames staged by each thread calling tolog of a client.
+const size_t max_log_size = 10000; // Max content size of a log. Longer logs are ignored by the client.
+const size_t log_time_pos = 0;   // Offset of time in a log, after the head.
+const size_t log_level_pos = 8;  // Offset of level in a log, after the head.
+const size_t log_hash_pos = 10;  // Offset of hash_id in a log, after the head.
+const size_t log_size_pos = 14;  // Offset of content_size in a log, after the head.
+const size_t log_meta_size = 16; // [time][level][hash_id][content_size] between the head and the content.
+const size_t log_head_size = 2 + log_meta_size; // Everything before the content of a log.
+const uint16_t level_fmt_flag = 0x8000; // Set in the level of a log whose content needs formatting.
+const uint16_t level_suppressed_flag = 0x4000; // Set in the level of a log whose content ends with a suppressed count.
+const uint16_t level_fields_flag = 0x2000; // Set in the level of a log whose content is a message and fields.
+const uint16_t level_flags = level_fmt_flag | level_suppressed_flag | level_fields_flag; // Bits of level which are not the LogLevel.
+const size_t batch_meta_size = 1 + 1 + 2 + 4 + 4 + 4; // [codec]...[packed_size] after the head of a batch.
+const uint8_t batch_relay = 1; // Flag of a batch only having logs without reply, the server relays it as is.
+const size_t compress_min_bytes = 512; // Smaller batches are sent uncompressed.
+const size_t max_batch_size = 1 << 24; // Max raw_size of a batch. Larger batches are sent uncompressed.
+const int64_t reconnect_min_us = 1e5; // First wait before reconnecting to the server, doubled after each failure.
+const int64_t reconnect_max_us = 1e7; // Max wait before reconnecting to the server.
+const int64_t reconnect_timeout_us = 1e6; // Max time of connecting and the handshake when reconnecting.
+const int64_t spill_drain_timeout_us = 3e7; // Max waitting time of disconnect for the spilled logs, without server.
 
 } // End anonoymous namespace.
 
@@ -76,6 +129,16 @@ enum LogLevel {
     error = 3
 };
 
+static const size_t log_level_num = 4;
+
+/**
+ * Order of levels by importance: debug < info < warning < error.
+ * A min level keeps the logs whose rank is not lower.
+ */
+constexpr uint16_t level_rank(LogLevel level) {
+    return level == LogLevel::debug ? 0 : (level == LogLevel::info ? 1 : (uint16_t)level);
+}
+
 enum CallBackStat {
     success = 0,
     failed = 1,
@@ -25,7 +25,7 @@ int main(int argc, char** argv) {
     }
     
     // Construct and start the lander.
-    wtlog::WTLogLander lad = wtlog::WTLogLander("./");
+    wtlog::WTLogLander lad("./");
     if (lad.connect(ip, port) == false) {
         cout << "Start lander failed, try again.\n";
         return 0;
@@ -33,15 +33,43 @@ int main(int argc, char** argv) {
     
     // Listen the command.
     char comm[32];
-    while (true) {
-        cin >> comm;
+    while (cin >> comm) {
         if (strcmp(comm, "stop") == 0) {
             lad.disconnect();
             continue;
-        } else if (strcmp(comm, "stat")) {
-            
+        } else if (strcmp(comm, "export") == 0) {
+            // export [date] [out_path]: Write the logs of the date as text.
+            string date, out_path;
+            cin >> date >> out_path;
+            cout << "Exported " << lad.export_text(date, out_path) << " logs to " << out_path << ".\n";
+            continue;
+        } else if (strcmp(comm, "filter") == 0) {
+            // filter [date] [out_path] [key] [op] [value]: Export the structured logs whose field passes. Any value for has.
+            string date, out_path, key, op, value;
+            cin >> date >> out_path >> key >> op >> value;
+            wtlog::FieldFilter filter;
+            if (wtlog::FieldFilter::parse(key, op, value, &filter) == false) {
+                cout << "Unknown op: " << op << ", use one of has, =, !=, <, <=, >, >=.\n";
+                continue;
+            }
+            cout << "Exported " << lad.export_text(date, out_path, std::vector<wtlog::FieldFilter>(1, filter)) 
+                << " logs to " << out_path << ".\n";
+            continue;
+        } else if (strcmp(comm, "stat") == 0) {
+            wtlog::LanderStatInfo stat_inf = lad.status();
+            stringstream ss;
+            ss << "Queues: \n";
+            for (size_t i = 0; i < stat_inf.queue_name.size(); ++i) {
+                ss << wttool::queue_stat2str(stat_inf.queue_name[i], stat_inf.queue_stat[i]) << "\n";
+            }
+            cout << ss.str() << "\n\n";
+            continue;
         }
     }
     
+    // The input is closed, keep working without commands.
+    while (true) {
+        pause();
+    }
     return 0;
 }
@@ -22,35 +22,66 @@ int main(int argc, char** argv) {
     }
     
     // Construct and start the server.
-    wtlog::WTLogServer svr = wtlog::WTLogServer();
-    if (svr.start() == false) {
+    wtlog::WTLogServer svr;
+    if (svr.start(port) == false) {
         cout << "Start server failed, try again.\n";
         return 0;
     }
     
     // Listen the command.
+    const char* level_name[wtlog::log_level_num] = {"info", "debug", "warning", "error"};
     char comm[32];
-    while (true) {
-        cin >> comm;
-        if (strcmp(comm, "stop")) {
+    while (cin >> comm) {
+        if (strcmp(comm, "stop") == 0) {
             svr.stop();
             continue;
-        } else if (strcmp(comm, "stat")) {
+        } else if (strcmp(comm, "stat") == 0) {
             wtlog::StatInfo stat_inf = svr.status();
             stringstream ss;
             ss << "Following is the connected opposite: \n";
             ss << "Clients: \n";
             for (size_t i = 0; i < stat_inf.client_socket.size(); ++i) {
-                ss << "i: " << stat_inf.client_socket[i] << ".\n";
+                const uint64_t* dropped = stat_inf.client_dropped[i].count;
+                ss << "i: " << stat_inf.client_socket[i] 
+                    << "[Socket: " << stat_inf.client_fd[i] 
+                    << "][Min level: " << level_name[stat_inf.client_level[i]] 
+                    << "][Dropped info: " << dropped[wtlog::LogLevel::info] 
+                    << ", debug: " << dropped[wtlog::LogLevel::debug] 
+                    << ", warning: " << dropped[wtlog::LogLevel::warning] 
+                    << ", error: " << dropped[wtlog::LogLevel::error] << "].\n";
             }
             ss << "Landers: \n";
             for (size_t i = 0; i < stat_inf.lander_socket.size(); ++i) {
                 ss << "i: " << stat_inf.lander_socket[i] << ".\n";
             }
+            ss << "Queues: \n";
+            for (size_t i = 0; i < stat_inf.queue_name.size(); ++i) {
+                ss << wttool::queue_stat2str(stat_inf.queue_name[i], stat_inf.queue_stat[i]) << "\n";
+            }
             cout << ss.str() << "\n\n";
             continue;
+        } else if (strcmp(comm, "level") == 0) {
+            // level <info|debug|warning|error> [socket]: Min level of the client, or all clients.
+            string name;
+            int socket = -1;
+            cin >> name;
+            if (cin.peek() == ' ') {
+                cin >> socket;
+            }
+            size_t level = 0;
+            while (level < wtlog::log_level_num && name != level_name[level]) {
+                ++level;
+            }
+            if (level == wtlog::log_level_num || svr.set_client_level((wtlog::LogLevel)level, socket) == false) {
+                cout << "Usage: level <info|debug|warning|error> [socket]. Socket is shown by stat.\n";
+            }
+            continue;
         }
     }
     
+    // The input is closed, keep working without commands.
+    while (true) {
+        pause();
+    }
     return 0;
 }
@@ -11,9 +11,23 @@
 
 #include <pthread.h>
 #include <iostream>
+#include <atomic>
+#include <cstdint>
+#include <utility>
 
 #define toscreen std::cout<<__FILE__<<", "<<__LINE__<<": "
 
+/**
+ * Compile with -DWTATOM_QUEUE_STAT to record statistics. It changes the layout 
+ * of the queue, so all files of a program must agree on it.
+ * Without it, the statistics code is not compiled and stat() only returns the depth.
+ */
+#ifdef WTATOM_QUEUE_STAT
+#define _WTATOM_STAT(expr) expr
+#else
+#define _WTATOM_STAT(expr)
+#endif
+
 using std::string;
 
 namespace wtatom {
@@ -28,7 +42,72 @@ private:
     string _info;
 };
 
-template <typename T>
+/**
+ * Storage mode of the queue. It is decided when constructing.
+ */
+enum QueueMode {
+    locked = 0, // Each slot has a mutex. Expand the space twice when it is full.
+    ring = 1,   // Lock-free bounded ring. Never expand, push waits when it is full.
+    segment = 2 // Lock-free unbounded queue. Grow and shrink by fixed-size segments.
+};
+
+/**
+ * How many threads push or get at the same time. It is decided at compile time.
+ * If both sides are Single, the queue is a wait-free ring whatever the mode is.
+ * If only one side is Single, that side skips the CAS in ring and segment mode.
+ */
+struct Producers {
+    enum Type { Single = 0, Multi = 1 };
+};
+struct Consumers {
+    enum Type { Single = 0, Multi = 1 };
+};
+
+static const size_t cache_line_size = 64;
+static const size_t segment_dir_size = 4096; // Max alive segments of a queue in segment mode.
+static const size_t stat_bucket_num = 24;    // Buckets of the queued time histogram.
+
+/**
+ * Statistics of a queue, got by AtomQueue::stat().
+ */
+struct QueueStat {
+    QueueStat() : enabled(false), depth(0), high_watermark(0), push_num(0), get_num(0), 
+        expansion_num(0), retry_num(0), elapsed_us(0) {
+        for (size_t i = 0; i < stat_bucket_num; ++i) {
+            queued_us[i] = 0;
+        }
+    }
+    
+    bool enabled;           // False if compiled without WTATOM_QUEUE_STAT.
+    size_t depth;           // Elements in the queue now.
+    size_t high_watermark;  // Max depth ever seen after a push.
+    uint64_t push_num;      // Elements pushed.
+    uint64_t get_num;       // Elements got.
+    uint64_t expansion_num; // Times of expansion in locked mode.
+    uint64_t retry_num;     // Failed CAS, or waits for a busy slot, a full ring or a lock.
+    uint64_t elapsed_us;    // Time since the queue is constructed, used to compute the rates.
+    
+    // Histogram of the time from push to get. 
+    // queued_us[0] counts [0, 1) microsecond, queued_us[i] counts [2^(i-1), 2^i), 
+    // the last one also counts all longer ones.
+    uint64_t queued_us[stat_bucket_num];
+};
+
+/**
+ * How a consumer waits in get_wait.
+ * It checks the queue again and again, then yields the CPU,
+ * at last it sleeps until a producer wakes it up.
+ */
+struct WaitStrategy {
+    WaitStrategy(size_t s_in = 128, size_t y_in = 16, bool p_in = true) : 
+        spin_times(s_in), yield_times(y_in), park(p_in) {}
+    
+    size_t spin_times;  // Times of checking the queue by busy loop.
+    size_t yield_times; // Times of checking the queue after sched_yield.
+    bool park;          // If false, keep yielding until timeout instead of sleeping.
+};
+
+template <typename T, Producers::Type P = Producers::Multi, Consumers::Type C = Consumers::Multi>
 class AtomQueue {
 private:
     template <typename TE>
@@ -44,14 +123,88 @@ private:
                 throw AtomQueueException("Initialize local lock Failed.");
             }
         }
-        DataElement<TE>& operator=(const DataElement<TE>& rhs) {
-            _data = rhs._data;
+        DataElement<TE>& operator=(DataElement<TE>&& rhs) {
+            _data = std::move(rhs._data);
             _valid = rhs._valid;
+            _WTATOM_STAT(_stamp = rhs._stamp);
+            return *this;
         }
         TE _data;
         pthread_mutex_t _lock;
         bool _valid; // If false, this element is waitting for being pushed.
+#ifdef WTATOM_QUEUE_STAT
+        uint64_t _stamp; // Time of push, in nanosecond.
+#endif
+    };
+    
+    template <typename TE>
+    class RingElement {
+    public:
+        RingElement() : _turn(0) {}
+        std::atomic<size_t> _turn; // Equals to the position when empty, position + 1 when filled.
+        TE _data;
+#ifdef WTATOM_QUEUE_STAT
+        uint64_t _stamp; // Time of push, in nanosecond.
+#endif
+    };
+    
+    /**
+     * Fixed-size piece of the queue in segment mode.
+     * A segment is never deleted until the queue is destroyed, it is
+     * recycled through the free list after all its elements are got.
+     */
+    template <typename TE>
+    class Segment {
+    public:
+        Segment(size_t size, uint32_t index) : 
+            _id(0), _consumed(0), _free_next(0), _index(index) {
+            _elements = new RingElement<TE>[size];
+        }
+        ~Segment() {
+            delete[] _elements;
+        }
+        std::atomic<uint64_t> _id;        // Position of the first element / segment size.
+        std::atomic<size_t> _consumed;    // Number of elements already got.
+        std::atomic<uint32_t> _free_next; // Next segment in the free list, index + 1. 0 means none.
+        uint32_t _index;                  // Index in the segment pool.
+        RingElement<TE>* _elements;       // Turn is 1 when filled, 0 when empty.
+    };
+    
+    /**
+     * Index of the ring, owns a whole cache line.
+     * _cache is the last seen value of the other index, used by the 
+     * owner side of a single producer single consumer queue only.
+     */
+    struct PaddedIndex {
+        PaddedIndex() : _val(0), _cache(0) {}
+        std::atomic<size_t> _val;
+        size_t _cache;
+        char _pad[cache_line_size - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+    };
+    
+    static const bool _spsc = (P == Producers::Single && C == Consumers::Single);
+    
+#ifdef WTATOM_QUEUE_STAT
+    /**
+     * Counters behind QueueStat, own cache lines apart from the indexes.
+     */
+    struct StatCounter {
+        StatCounter() : _high_watermark(0), _push_num(0), _get_num(0), 
+            _expansion_num(0), _retry_num(0), _start(0) {
+            for (size_t i = 0; i < stat_bucket_num; ++i) {
+                _queued_us[i].store(0, std::memory_order_relaxed);
+            }
+        }
+        char _pad[cache_line_size];
+        std::atomic<size_t> _high_watermark;
+        std::atomic<uint64_t> _push_num;
+        std::atomic<uint64_t> _get_num;
+        std::atomic<uint64_t> _expansion_num;
+        std::atomic<uint64_t> _retry_num;
+        std::atomic<uint64_t> _queued_us[stat_bucket_num];
+        uint64_t _start; // Time of construction, in nanosecond.
     };
+#endif
     
 public:
     /**
@@ -59,17 +212,47 @@ public:
      * You need avoid queue expansion as much as possible.
      * The overhead of queue expansion is large.
      * Pre-allocate a maximum space based on usage context.
+     * @param mode: QueueMode::ring uses no lock, the capacity is rounded up
+     *      to a power of two and will never grow.
+     *      QueueMode::segment uses no lock and never gets full, the capacity
+     *      is rounded up to a power of two and used as the segment size.
+     *      Ignored if both P and C are Single, the queue works as a ring.
      */
-    AtomQueue(size_t reserve_capacity = 2048);
+    AtomQueue(size_t reserve_capacity = 2048, QueueMode mode = QueueMode::locked);
     virtual ~AtomQueue();
     
     /**
      * Push an element to the tail.
+     * The rvalue version moves the element into the queue.
      */
     void push(const T& in);
+    void push(T&& in);
+    
+    /**
+     * Construct an element by args, then move it to the tail.
+     */
+    template <typename... Args>
+    void emplace(Args&&... args);
+    
+    /**
+     * Push an element to the tail if there is space.
+     * @return false: Ring mode and the queue is full. Nothing is pushed.
+     */
+    bool try_push(const T& in);
+    bool try_push(T&& in);
+    
+    /**
+     * Push elements in [first, last) to the tail in order.
+     * Use std::make_move_iterator to move the elements.
+     * The positions of the run are occupied at once instead of one by one, in
+     * locked mode with one acquisition of the lock, expanding the space as needed.
+     */
+    template <typename ForwardIt>
+    void push_bulk(ForwardIt first, ForwardIt last);
     
     /**
      * Get the element at the top. Then remove the top element from the queue.
+     * The element is moved to out.
      * If you want to delet the top element, you can set out as NULL. 
      * @return true: Success.
      * @return false: Failed. Variable "out" would not be modified. 
@@ -79,6 +262,30 @@ public:
     bool get(T* out); // Recommended.
     bool get(T& out); // Not recommended.
     
+    /**
+     * Get the element at the top, wait if the queue is empty.
+     * @param timeout_us: Max waitting time in microsecond. Negative means wait forever.
+     * @return false: Still empty after timeout. Variable "out" would not be modified.
+     */
+    bool get_wait(T* out, int64_t timeout_us = -1);
+    
+    /**
+     * Get at most max elements from the top, with one position reservation.
+     * @param out: Array with at least max elements.
+     * @return The number of elements written to out. 0 means empty.
+     */
+    size_t get_batch(T* out, size_t max);
+    
+    /**
+     * Same as get_batch, but wait like get_wait if the queue is empty.
+     */
+    size_t get_batch_wait(T* out, size_t max, int64_t timeout_us = -1);
+    
+    /**
+     * Set how get_wait waits. Call it before the queue is used.
+     */
+    void set_wait_strategy(const WaitStrategy& strategy);
+    
     /**
      * Get the size of the queue.
      */
@@ -88,10 +295,22 @@ public:
      * Clear.
      * It should only be called when all push and get operations are finished.
      * If some operations haven't finished, it may cause data incorrect.
+     * If C is Single, only the consumer thread can call it.
      */
     void clear();
     
+    /**
+     * Get the mode of the queue.
+     */
+    QueueMode mode() const;
+    
+    /**
+     * Get the statistics. Only recorded if WTATOM_QUEUE_STAT is defined.
+     */
+    QueueStat stat();
+    
 private:
+    QueueMode _mode;
     DataElement<T>* _data;
     size_t _head;
     size_t _tail;
@@ -99,6 +318,34 @@ private:
     pthread_mutex_t _find_space_lock; // Used when finding space.
     pthread_rwlock_t _global_lock; // Used when expanding.
     
+    // Used by ring mode only.
+    RingElement<T>* _ring;
+    T* _spsc_ring; // Used instead of _ring if both P and C are Single.
+    size_t _ring_mask; // Also used as segment mask in segment mode.
+    
+    // Used by segment mode only.
+    size_t _seg_shift;                      // Position >> _seg_shift is the segment id.
+    std::atomic<Segment<T>*>* _seg_dir;     // Alive segments, segment id % segment_dir_size is the index.
+    std::atomic<Segment<T>*>* _seg_pool;    // All allocated segments.
+    std::atomic<uint32_t> _seg_pool_size;   // Number of allocated segments.
+    std::atomic<uint64_t> _seg_free;        // Free list head, (tag << 32) | (index + 1).
+    
+    // Used by ring mode and segment mode.
+    char _ring_pad[cache_line_size];
+    PaddedIndex _enq_pos; // Next position to be pushed.
+    PaddedIndex _deq_pos; // Next position to be got.
+    
+    // Used by get_wait.
+    WaitStrategy _wait;
+    std::atomic<int> _parked; // Number of consumers sleeping on _park_cond.
+    pthread_mutex_t _park_lock;
+    pthread_cond_t _park_cond;
+    
+#ifdef WTATOM_QUEUE_STAT
+    uint64_t* _spsc_stamp; // Time of push of each slot in _spsc_ring.
+    StatCounter _stat;
+#endif
+    
 private:
     /**
      * Allocate a space for new element. This space will be ready for push.
@@ -111,6 +358,20 @@ private:
      */
     size_t _occupy_next_empty_space_and_global_lock();
     
+    /**
+     * Same as _occupy_next_empty_space_and_global_lock, but allocate num spaces.
+     * The spaces start from the returned absolute position.
+     */
+    size_t _occupy_empty_spaces_and_global_lock(size_t num);
+    
+    /**
+     * Implementation of push and try_push, U is T or const T&.
+     */
+    template <typename U>
+    void _push(U&& in);
+    template <typename U>
+    bool _try_push(U&& in);
+    
     /**
      * Set the top absolute position to &pos. This space will be ready for get.
      * This space will be locked.
@@ -121,6 +382,13 @@ private:
      * @return false: Empty queue. Global_lock won't be locked.
      */
     bool _pop_top_space_and_global_lock(size_t& pos);
+    
+    /**
+     * Same as _pop_top_space_and_global_lock, but pop at most max spaces.
+     * The popped spaces start from &pos.
+     * @return The number of popped spaces. If 0, global_lock won't be locked.
+     */
+    size_t _pop_top_spaces_and_global_lock(size_t max, size_t& pos);
   
     /**
      * Convert the logic position to absolute position.
@@ -133,12 +401,102 @@ private:
     size_t _abso2logic(size_t abso_pos);
     
     /**
-     * Expansion the space twice.
+     * Expansion the space twice, elements are moved to the new space.
      * Used when the capacity is not enough.
      * High cost. Return true means success.
      */
     bool _expansion();
     
+    /**
+     * Push or get in ring mode. Never block.
+     * @return false: Full when pushing, empty when getting.
+     */
+    template <typename U>
+    bool _ring_push(U&& in);
+    bool _ring_get(T* out);
+    
+    /**
+     * Occupy or take at most max continuous positions in ring mode. Never block.
+     * The positions start from &pos.
+     * @return The number of positions. 0 means full when pushing, empty when getting.
+     */
+    size_t _ring_reserve_push(size_t max, size_t& pos);
+    size_t _ring_reserve_get(size_t max, size_t& pos);
+    
+    /**
+     * Push or get in single producer single consumer ring. Never block.
+     * The owner side only reads the other index when its cache is used up.
+     * @return false: Full when pushing, empty when getting.
+     */
+    template <typename U>
+    bool _spsc_push(U&& in);
+    bool _spsc_get(T* out);
+    
+    /**
+     * Same as _ring_reserve_push and _ring_reserve_get, 
+     * for single producer single consumer ring.
+     */
+    size_t _spsc_reserve_push(size_t max, size_t& pos);
+    size_t _spsc_reserve_get(size_t max, size_t& pos);
+    
+    /**
+     * Push or get in segment mode. Push never fails.
+     * @return false: Empty when getting.
+     */
+    template <typename U>
+    void _segment_push(U&& in);
+    bool _segment_get(T* out);
+    
+    /**
+     * Take at most max positions in segment mode. Never block.
+     * @return The number of positions. 0 means empty.
+     */
+    size_t _segment_reserve_get(size_t max, size_t& pos);
+    
+    /**
+     * Find the segment of the position.
+     * Producer installs a new segment if it doesn't exist.
+     * Consumer waits until the producer installs it.
+     */
+    Segment<T>* _segment_for_push(size_t pos);
+    Segment<T>* _segment_for_get(size_t pos);
+    
+    /**
+     * Move the element at the position out, wait if the producer hasn't finished.
+     * Retire the segment if it is the last element of the segment.
+     */
+    void _segment_take(size_t pos, T* out);
+    
+    /**
+     * Get a segment from free list, or allocate a new one.
+     * @return nullptr: The pool is full.
+     */
+    Segment<T>* _segment_alloc();
+    
+    /**
+     * Put a segment back to free list.
+     */
+    void _segment_free(Segment<T>* seg);
+    
+    /**
+     * Called after pushing. Wake up a parked consumer if there is one.
+     * @param all: Wake up all parked consumers. Used when pushed several elements.
+     */
+    void _wake_parked(bool all = false);
+    
+    /**
+     * Record statistics. Not compiled without WTATOM_QUEUE_STAT.
+     * _stat_pushed is called after pushing num elements.
+     * _stat_got is called for each got element with its push time.
+     * _stat_retry is called when an operation has to try again.
+     */
+#ifdef WTATOM_QUEUE_STAT
+    static uint64_t _now_ns();
+    void _stat_pushed(size_t num);
+    void _stat_got(uint64_t stamp);
+    void _stat_retry();
+#endif
+    
     /**
      * Lock or unlock safely.
      */
@@ -10,16 +10,103 @@
 #define _ATOM_QUEUE_HPP_
 
 #include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <iterator>
 #include "wtatomqueue.h"
 
 namespace wtatom {
 
-template <typename T>  
-AtomQueue<T>::AtomQueue(size_t c_in) : 
-    _capacity(c_in), _head(0), _tail(0) {
-    _data = new(std::nothrow) DataElement<T>[_capacity];
-    if (_data == nullptr) {
-        throw AtomQueueException("Malloc memory for queue failed.");
+/**
+ * Tell the CPU this is a busy loop.
+ */
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+/**
+ * Wait a little in a retry loop. Spin at first, then yield the CPU.
+ */
+static inline void backoff(size_t& wait_times) {
+    if (wait_times < 64) {
+        ++wait_times;
+        cpu_relax();
+    } else {
+        sched_yield();
+    }
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+AtomQueue<T, P, C>::AtomQueue(size_t c_in, QueueMode m_in) : 
+    _mode(m_in), _data(nullptr), _head(0), _tail(0), _capacity(c_in), 
+    _ring(nullptr), _spsc_ring(nullptr), _ring_mask(0), _seg_shift(0), _seg_dir(nullptr), _seg_pool(nullptr), 
+    _seg_pool_size(0), _seg_free(0), _parked(0) {
+#ifdef WTATOM_QUEUE_STAT
+    _spsc_stamp = nullptr;
+    _stat._start = _now_ns();
+#endif
+    if (_spsc) {
+        // Round up the capacity to a power of two, the slots need no turn.
+        size_t ring_size = 2;
+        while (ring_size < _capacity) {
+            ring_size <<= 1;
+        }
+        _mode = QueueMode::ring;
+        _capacity = ring_size;
+        _ring_mask = ring_size - 1;
+        _spsc_ring = new(std::nothrow) T[_capacity];
+        if (_spsc_ring == nullptr) {
+            throw AtomQueueException("Malloc memory for ring failed.");
+        }
+#ifdef WTATOM_QUEUE_STAT
+        _spsc_stamp = new uint64_t[_capacity];
+#endif
+    } else if (_mode == QueueMode::segment) {
+        // Round up the segment size to a power of two.
+        _seg_shift = 1;
+        while (((size_t)1 << _seg_shift) < _capacity) {
+            ++_seg_shift;
+        }
+        _capacity = (size_t)1 << _seg_shift;
+        _ring_mask = _capacity - 1;
+        
+        // Allow twice of the directory, so the free list can keep a full directory of segments.
+        _seg_dir = new(std::nothrow) std::atomic<Segment<T>*>[segment_dir_size];
+        _seg_pool = new(std::nothrow) std::atomic<Segment<T>*>[segment_dir_size * 2];
+        if (_seg_dir == nullptr || _seg_pool == nullptr) {
+            throw AtomQueueException("Malloc memory for segment directory failed.");
+        }
+        for (size_t i = 0; i < segment_dir_size; ++i) {
+            _seg_dir[i].store(nullptr, std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < segment_dir_size * 2; ++i) {
+            _seg_pool[i].store(nullptr, std::memory_order_relaxed);
+        }
+    } else if (_mode == QueueMode::ring) {
+        // Round up the capacity to a power of two, then position & mask is the index.
+        size_t ring_size = 2;
+        while (ring_size < _capacity) {
+            ring_size <<= 1;
+        }
+        _capacity = ring_size;
+        _ring_mask = ring_size - 1;
+        _ring = new(std::nothrow) RingElement<T>[_capacity];
+        if (_ring == nullptr) {
+            throw AtomQueueException("Malloc memory for ring failed.");
+        }
+        for (size_t i = 0; i < _capacity; ++i) {
+            _ring[i]._turn.store(i, std::memory_order_relaxed);
+        }
+    } else {
+        _data = new(std::nothrow) DataElement<T>[_capacity];
+        if (_data == nullptr) {
+            throw AtomQueueException("Malloc memory for queue failed.");
+        }
     }
     if (pthread_mutex_init(&_find_space_lock, nullptr) != 0) {
         throw AtomQueueException("Initialize space lock Failed.");
@@ -27,17 +114,90 @@ AtomQueue<T>::AtomQueue(size_t c_in) :
     if (pthread_rwlock_init(&_global_lock, nullptr) != 0) {
         throw AtomQueueException("Initialize global lock failed.");
     }
+    if (pthread_mutex_init(&_park_lock, nullptr) != 0) {
+        throw AtomQueueException("Initialize park lock failed.");
+    }
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&_park_cond, &cond_attr) != 0) {
+        pthread_condattr_destroy(&cond_attr);
+        throw AtomQueueException("Initialize park condition failed.");
+    }
+    pthread_condattr_destroy(&cond_attr);
 }
 
-template <typename T>  
-AtomQueue<T>::~AtomQueue() {
+template <typename T, Producers::Type P, Consumers::Type C>
+AtomQueue<T, P, C>::~AtomQueue() {
     if (_data != nullptr) {
         delete[] _data;
     }
+    if (_ring != nullptr) {
+        delete[] _ring;
+    }
+    if (_spsc_ring != nullptr) {
+        delete[] _spsc_ring;
+    }
+#ifdef WTATOM_QUEUE_STAT
+    delete[] _spsc_stamp;
+#endif
+    if (_seg_pool != nullptr) {
+        for (size_t i = 0; i < segment_dir_size * 2; ++i) {
+            delete _seg_pool[i].load(std::memory_order_relaxed);
+        }
+        delete[] _seg_pool;
+        delete[] _seg_dir;
+    }
 }
 
-template <typename T>  
-void AtomQueue<T>::push(const T& in) {
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::push(const T& in) {
+    _push(in);
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::push(T&& in) {
+    _push(std::move(in));
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+template <typename... Args>
+void AtomQueue<T, P, C>::emplace(Args&&... args) {
+    _push(T(std::forward<Args>(args)...));
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+template <typename U>
+void AtomQueue<T, P, C>::_push(U&& in) {
+    if (_spsc) {
+        // Full ring, wait for the consumer.
+        size_t wait_times = 0;
+        while (_spsc_push(std::forward<U>(in)) == false) {
+            _WTATOM_STAT(_stat_retry());
+            backoff(wait_times);
+        }
+        _WTATOM_STAT(_stat_pushed(1));
+        _wake_parked();
+        return;
+    }
+    if (_mode == QueueMode::ring) {
+        // Full ring, wait for the consumers.
+        size_t wait_times = 0;
+        while (_ring_push(std::forward<U>(in)) == false) {
+            _WTATOM_STAT(_stat_retry());
+            backoff(wait_times);
+        }
+        _WTATOM_STAT(_stat_pushed(1));
+        _wake_parked();
+        return;
+    }
+    if (_mode == QueueMode::segment) {
+        _segment_push(std::forward<U>(in));
+        _WTATOM_STAT(_stat_pushed(1));
+        _wake_parked();
+        return;
+    }
+    
     // Get the logic position of next empty space.
     size_t next_pos = _occupy_next_empty_space_and_global_lock();
 
@@ -53,13 +213,15 @@ void AtomQueue<T>::push(const T& in) {
         } else {
             // This space is still invalid until the former get finished.
             _unlock(&_data[next_pos]._lock);
+            _WTATOM_STAT(_stat_retry());
             continue;
         }
     }
     
     // Nobody is using this position, start to push data here.
-    _data[next_pos]._data = in;
+    _data[next_pos]._data = std::forward<U>(in);
     _data[next_pos]._valid = true;
+    _WTATOM_STAT(_data[next_pos]._stamp = _now_ns());
     
     // Release the space for other operation.
     _unlock(&_data[next_pos]._lock);
@@ -67,16 +229,159 @@ void AtomQueue<T>::push(const T& in) {
     // Release the read_lock of global_lock.
     _unlock(&_global_lock);
     
+    _WTATOM_STAT(_stat_pushed(1));
+    _wake_parked();
     return;
 }
 
-template <typename T>
-bool AtomQueue<T>::get(T& out) {
+template <typename T, Producers::Type P, Consumers::Type C>
+bool AtomQueue<T, P, C>::try_push(const T& in) {
+    return _try_push(in);
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+bool AtomQueue<T, P, C>::try_push(T&& in) {
+    return _try_push(std::move(in));
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+template <typename U>
+bool AtomQueue<T, P, C>::_try_push(U&& in) {
+    if (_mode == QueueMode::ring) {
+        bool ret = _spsc ? _spsc_push(std::forward<U>(in)) : _ring_push(std::forward<U>(in));
+        if (ret == false) {
+            return false;
+        }
+        _WTATOM_STAT(_stat_pushed(1));
+        _wake_parked();
+        return true;
+    }
+    _push(std::forward<U>(in));
+    return true;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+template <typename ForwardIt>
+void AtomQueue<T, P, C>::push_bulk(ForwardIt first, ForwardIt last) {
+    if (_spsc) {
+        size_t wait_times = 0;
+        size_t remain = std::distance(first, last);
+        while (remain != 0) {
+            size_t pos = 0;
+            size_t num = _spsc_reserve_push(remain, pos);
+            if (num == 0) {
+                // Full ring, wait for the consumer.
+                _WTATOM_STAT(_stat_retry());
+                backoff(wait_times);
+                continue;
+            }
+            for (size_t i = 0; i < num; ++i, ++first) {
+                _spsc_ring[(pos + i) & _ring_mask] = *first;
+                _WTATOM_STAT(_spsc_stamp[(pos + i) & _ring_mask] = _now_ns());
+            }
+            _enq_pos._val.store(pos + num, std::memory_order_release);
+            remain -= num;
+            _WTATOM_STAT(_stat_pushed(num));
+            _wake_parked(true);
+        }
+        return;
+    }
+    if (_mode == QueueMode::segment) {
+        // Occupy all positions at once, then fill them segment by segment.
+        size_t num = std::distance(first, last);
+        if (num == 0) {
+            return;
+        }
+        size_t pos = 0;
+        if (P == Producers::Single) {
+            pos = _enq_pos._val.load(std::memory_order_relaxed);
+            _enq_pos._val.store(pos + num, std::memory_order_release);
+        } else {
+            pos = _enq_pos._val.fetch_add(num, std::memory_order_acq_rel);
+        }
+        Segment<T>* seg = nullptr;
+        for (size_t i = 0; i < num; ++i, ++first) {
+            if (seg == nullptr || ((pos + i) & _ring_mask) == 0) {
+                seg = _segment_for_push(pos + i);
+            }
+            RingElement<T>& slot = seg->_elements[(pos + i) & _ring_mask];
+            slot._data = *first;
+            _WTATOM_STAT(slot._stamp = _now_ns());
+            slot._turn.store(1, std::memory_order_release);
+        }
+        _WTATOM_STAT(_stat_pushed(num));
+        _wake_parked(true);
+        return;
+    }
+    if (_mode != QueueMode::ring) {
+        size_t num = std::distance(first, last);
+        if (num == 0) {
+            return;
+        }
+        size_t top_pos = _occupy_empty_spaces_and_global_lock(num);
+        for (size_t i = 0; i < num; ++i, ++first) {
+            size_t cur_pos = (top_pos + i) % _capacity;
+            
+            // Wait for the former get operation at this position.
+            while (true) {
+                _lock(&_data[cur_pos]._lock);
+                if (_data[cur_pos]._valid == false) {
+                    break;
+                }
+                _unlock(&_data[cur_pos]._lock);
+                _WTATOM_STAT(_stat_retry());
+            }
+            _data[cur_pos]._data = *first;
+            _data[cur_pos]._valid = true;
+            _WTATOM_STAT(_data[cur_pos]._stamp = _now_ns());
+            _unlock(&_data[cur_pos]._lock);
+        }
+        _unlock(&_global_lock);
+        _WTATOM_STAT(_stat_pushed(num));
+        _wake_parked(true);
+        return;
+    }
+    
+    size_t wait_times = 0;
+    size_t remain = std::distance(first, last);
+    while (remain != 0) {
+        size_t pos = 0;
+        size_t num = _ring_reserve_push(remain, pos);
+        if (num == 0) {
+            // Full ring, wait for the consumers.
+            _WTATOM_STAT(_stat_retry());
+            backoff(wait_times);
+            continue;
+        }
+        for (size_t i = 0; i < num; ++i, ++first) {
+            RingElement<T>& slot = _ring[(pos + i) & _ring_mask];
+            slot._data = *first;
+            _WTATOM_STAT(slot._stamp = _now_ns());
+            slot._turn.store(pos + i + 1, std::memory_order_release);
+        }
+        remain -= num;
+        _WTATOM_STAT(_stat_pushed(num));
+        _wake_parked(true);
+    }
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+bool AtomQueue<T, P, C>::get(T& out) {
     return get(&out);
 }
 
-template <typename T>
-bool AtomQueue<T>::get(T* out) {
+template <typename T, Producers::Type P, Consumers::Type C>
+bool AtomQueue<T, P, C>::get(T* out) {
+    if (_spsc) {
+        return _spsc_get(out);
+    }
+    if (_mode == QueueMode::ring) {
+        return _ring_get(out);
+    }
+    if (_mode == QueueMode::segment) {
+        return _segment_get(out);
+    }
+    
     // Get the top position.
     size_t top_pos = 0;
     if (_pop_top_space_and_global_lock(top_pos) == false) {
@@ -96,14 +401,16 @@ bool AtomQueue<T>::get(T* out) {
         } else {
             // This space is still invalid until the former push finished.
             _unlock(&_data[top_pos]._lock);
+            _WTATOM_STAT(_stat_retry());
             continue;
         }
     }
     
     // Nobody is using this position, start to get data here.
     if (out != nullptr) {
-        *out = _data[top_pos]._data;
+        *out = std::move(_data[top_pos]._data);
     }
+    _WTATOM_STAT(_stat_got(_data[top_pos]._stamp));
     _data[top_pos]._valid = false;
     
     // Release the space for other operation.
@@ -115,8 +422,173 @@ bool AtomQueue<T>::get(T* out) {
     return true;
 }
 
-template <typename T>
-void AtomQueue<T>::clear() {
+template <typename T, Producers::Type P, Consumers::Type C>
+size_t AtomQueue<T, P, C>::get_batch(T* out, size_t max) {
+    if (max == 0) {
+        return 0;
+    }
+    
+    if (_spsc) {
+        size_t pos = 0;
+        size_t num = _spsc_reserve_get(max, pos);
+        for (size_t i = 0; i < num; ++i) {
+            out[i] = std::move(_spsc_ring[(pos + i) & _ring_mask]);
+            _WTATOM_STAT(_stat_got(_spsc_stamp[(pos + i) & _ring_mask]));
+        }
+        if (num != 0) {
+            _deq_pos._val.store(pos + num, std::memory_order_release);
+        }
+        return num;
+    }
+    
+    if (_mode == QueueMode::segment) {
+        size_t pos = 0;
+        size_t num = _segment_reserve_get(max, pos);
+        for (size_t i = 0; i < num; ++i) {
+            _segment_take(pos + i, &out[i]);
+        }
+        return num;
+    }
+    
+    if (_mode == QueueMode::ring) {
+        size_t pos = 0;
+        size_t num = _ring_reserve_get(max, pos);
+        for (size_t i = 0; i < num; ++i) {
+            RingElement<T>& slot = _ring[(pos + i) & _ring_mask];
+            out[i] = std::move(slot._data);
+            _WTATOM_STAT(_stat_got(slot._stamp));
+            slot._turn.store(pos + i + _ring_mask + 1, std::memory_order_release);
+        }
+        return num;
+    }
+    
+    size_t top_pos = 0;
+    size_t num = _pop_top_spaces_and_global_lock(max, top_pos);
+    for (size_t i = 0; i < num; ++i) {
+        size_t cur_pos = (top_pos + i) % _capacity;
+        
+        // Wait for the former push operation at this position.
+        while (true) {
+            _lock(&_data[cur_pos]._lock);
+            if (_data[cur_pos]._valid == true) {
+                break;
+            }
+            _unlock(&_data[cur_pos]._lock);
+            _WTATOM_STAT(_stat_retry());
+        }
+        out[i] = std::move(_data[cur_pos]._data);
+        _WTATOM_STAT(_stat_got(_data[cur_pos]._stamp));
+        _data[cur_pos]._valid = false;
+        _unlock(&_data[cur_pos]._lock);
+    }
+    if (num != 0) {
+        _unlock(&_global_lock);
+    }
+    return num;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+size_t AtomQueue<T, P, C>::get_batch_wait(T* out, size_t max, int64_t timeout_us) {
+    if (max == 0 || get_wait(out, timeout_us) == false) {
+        return 0;
+    }
+    return 1 + get_batch(out + 1, max - 1);
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+bool AtomQueue<T, P, C>::get_wait(T* out, int64_t timeout_us) {
+    if (get(out) == true) {
+        return true;
+    }
+    
+    // Spin.
+    for (size_t i = 0; i < _wait.spin_times; ++i) {
+        cpu_relax();
+        if (get(out) == true) {
+            return true;
+        }
+    }
+    
+    // Compute the deadline.
+    timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if (timeout_us >= 0) {
+        int64_t nsec = deadline.tv_nsec + (timeout_us % 1000000) * 1000;
+        deadline.tv_sec += timeout_us / 1000000 + nsec / 1000000000;
+        deadline.tv_nsec = nsec % 1000000000;
+    }
+    
+    // Yield.
+    timespec now;
+    for (size_t i = 0; i < _wait.yield_times || _wait.park == false; ++i) {
+        sched_yield();
+        if (get(out) == true) {
+            return true;
+        }
+        if (timeout_us >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec > deadline.tv_sec || 
+                (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+                return false;
+            }
+        }
+    }
+    
+    // Park. Register as parked before the last check, so a producer 
+    // pushing after the check will find this consumer and wake it up.
+    bool res = false;
+    _lock(&_park_lock);
+    _parked.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (true) {
+        if (get(out) == true) {
+            res = true;
+            break;
+        }
+        int ret = 0;
+        if (timeout_us >= 0) {
+            ret = pthread_cond_timedwait(&_park_cond, &_park_lock, &deadline);
+        } else {
+            ret = pthread_cond_wait(&_park_cond, &_park_lock);
+        }
+        if (ret == ETIMEDOUT) {
+            res = get(out);
+            break;
+        }
+    }
+    _parked.fetch_sub(1, std::memory_order_relaxed);
+    _unlock(&_park_lock);
+    return res;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::set_wait_strategy(const WaitStrategy& strategy) {
+    _wait = strategy;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::_wake_parked(bool all) {
+    // Pairs with the fence in get_wait, one of them must see the other.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_parked.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    _lock(&_park_lock);
+    if (all == true) {
+        pthread_cond_broadcast(&_park_cond);
+    } else {
+        pthread_cond_signal(&_park_cond);
+    }
+    _unlock(&_park_lock);
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::clear() {
+    if (_mode == QueueMode::ring || _mode == QueueMode::segment) {
+        while (get(nullptr) == true) {}
+        return;
+    }
+    
     _lock(&_find_space_lock);
     
     _head = 0;
@@ -125,8 +597,8 @@ void AtomQueue<T>::clear() {
     _unlock(&_find_space_lock);
 }
 
-template <typename T>  
-size_t AtomQueue<T>::_occupy_next_empty_space_and_global_lock() {
+template <typename T, Producers::Type P, Consumers::Type C>
+size_t AtomQueue<T, P, C>::_occupy_next_empty_space_and_global_lock() {
     _lock(&_find_space_lock);
     
     // Check the capacity.
@@ -154,8 +626,32 @@ size_t AtomQueue<T>::_occupy_next_empty_space_and_global_lock() {
     return next_space;
 }
 
-template <typename T>  
-bool AtomQueue<T>::_pop_top_space_and_global_lock(size_t& pos) {
+template <typename T, Producers::Type P, Consumers::Type C>
+size_t AtomQueue<T, P, C>::_occupy_empty_spaces_and_global_lock(size_t num) {
+    _lock(&_find_space_lock);
+    
+    // Check the capacity, one space is always left empty.
+    while (_abso2logic(_tail) + num >= _capacity) {
+        if (_expansion() == false) {
+            toscreen << "Expansion failed, wait 1 sec.\n";
+            sleep(1);
+        }
+    }
+    
+    // Occupy the spaces from _tail.
+    size_t next_space = _tail;
+    _tail = (_tail + num) % _capacity;
+    
+    // LockR the global_lock.
+    _lockr(&_global_lock);
+    
+    // Finish.
+    _unlock(&_find_space_lock);
+    return next_space;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+bool AtomQueue<T, P, C>::_pop_top_space_and_global_lock(size_t& pos) {
     _lock(&_find_space_lock);
     
     // Check if the queue is empty.
@@ -176,21 +672,47 @@ bool AtomQueue<T>::_pop_top_space_and_global_lock(size_t& pos) {
     return true;
 }
 
-template <typename T>  
-size_t AtomQueue<T>::_abso2logic(size_t abso_pos) {
+template <typename T, Producers::Type P, Consumers::Type C>
+size_t AtomQueue<T, P, C>::_pop_top_spaces_and_global_lock(size_t max, size_t& pos) {
+    _lock(&_find_space_lock);
+    
+    // Count the existing elements.
+    size_t num = (_head <= _tail) ? (_tail - _head) : (_tail + _capacity - _head);
+    if (num > max) {
+        num = max;
+    }
+    if (num == 0) {
+        _unlock(&_find_space_lock);
+        return 0;
+    }
+    
+    // Set the pos.
+    pos = _head;
+    _head = (_head + num) % _capacity;
+    
+    // LockR the global_lock.
+    _lockr(&_global_lock);
+    
+    // Finish.
+    _unlock(&_find_space_lock);
+    return num;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+size_t AtomQueue<T, P, C>::_abso2logic(size_t abso_pos) {
     if (abso_pos >= _head) {
         return abso_pos - _head;
     }
     return _capacity - _head + abso_pos;
 }
 
-template <typename T>  
-size_t AtomQueue<T>::_logic2abso(size_t logic_pos) {
+template <typename T, Producers::Type P, Consumers::Type C>
+size_t AtomQueue<T, P, C>::_logic2abso(size_t logic_pos) {
     return (_head + logic_pos) % _capacity;
 }
 
-template <typename T>  
-bool AtomQueue<T>::_expansion() {
+template <typename T, Producers::Type P, Consumers::Type C>
+bool AtomQueue<T, P, C>::_expansion() {
     _lockw(&_global_lock);
     
     // Allocate new space.
@@ -200,26 +722,400 @@ bool AtomQueue<T>::_expansion() {
         return false;
     }
     
-    // Copy data to the new space.
+    // Move data to the new space.
+    size_t num = _abso2logic(_tail);
     for (size_t i = 0; i < _capacity; ++i) {
-        new_data[i] = _data[_logic2abso(i)];
+        new_data[i] = std::move(_data[_logic2abso(i)]);
     }
     
     // Set the index variables.
     _head = 0;
-    _tail = _capacity - 1;
+    _tail = num;
     _capacity = _capacity * 2;
     
     // Move the _data pointer.
     delete[] _data;
     _data = new_data;
+    _WTATOM_STAT(_stat._expansion_num.fetch_add(1, std::memory_order_relaxed));
     
     _unlock(&_global_lock);
     return true;
 }
 
-template <typename T>  
-void AtomQueue<T>::_lock(pthread_mutex_t* lock) {
+template <typename T, Producers::Type P, Consumers::Type C>
+template <typename U>
+bool AtomQueue<T, P, C>::_ring_push(U&& in) {
+    size_t pos = _enq_pos._val.load(std::memory_order_relaxed);
+    RingElement<T>* slot;
+    while (true) {
+        slot = &_ring[pos & _ring_mask];
+        size_t turn = slot->_turn.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)turn - (intptr_t)pos;
+        if (diff == 0) {
+            // The slot is empty in this round, try to occupy the position.
+            if (P == Producers::Single) {
+                _enq_pos._val.store(pos + 1, std::memory_order_relaxed);
+                break;
+            }
+            if (_enq_pos._val.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+            _WTATOM_STAT(_stat_retry());
+        } else if (diff < 0) {
+            // The slot still holds the element of last round. Full.
+            return false;
+        } else {
+            // Other producer has taken this position.
+            _WTATOM_STAT(_stat_retry());
+            pos = _enq_pos._val.load(std::memory_order_relaxed);
+        }
+    }
+    
+    // The slot is owned by this thread now.
+    slot->_data = std::forward<U>(in);
+    _WTATOM_STAT(slot->_stamp = _now_ns());
+    slot->_turn.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+bool AtomQueue<T, P, C>::_ring_get(T* out) {
+    size_t pos = _deq_pos._val.load(std::memory_order_relaxed);
+    RingElement<T>* slot;
+    while (true) {
+        slot = &_ring[pos & _ring_mask];
+        size_t turn = slot->_turn.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)turn - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            // The slot is filled, try to take the position.
+            if (C == Consumers::Single) {
+                _deq_pos._val.store(pos + 1, std::memory_order_relaxed);
+                break;
+            }
+            if (_deq_pos._val.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+            _WTATOM_STAT(_stat_retry());
+        } else if (diff < 0) {
+            // The producer of this position has not finished. Empty.
+            return false;
+        } else {
+            // Other consumer has taken this position.
+            _WTATOM_STAT(_stat_retry());
+            pos = _deq_pos._val.load(std::memory_order_relaxed);
+        }
+    }
+    
+    // The slot is owned by this thread now.
+    if (out != nullptr) {
+        *out = std::move(slot->_data);
+    }
+    _WTATOM_STAT(_stat_got(slot->_stamp));
+    slot->_turn.store(pos + _ring_mask + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+size_t AtomQueue<T, P, C>::_ring_reserve_push(size_t max, size_t& pos) {
+    pos = _enq_pos._val.load(std::memory_order_relaxed);
+    while (true) {
+        // Count the continuous empty slots from pos.
+        size_t num = 0;
+        while (num < max && num <= _ring_mask) {
+            size_t turn = _ring[(pos + num) & _ring_mask]._turn.load(std::memory_order_acquire);
+            if (turn != pos + num) {
+                break;
+            }
+            ++num;
+        }
+        if (num == 0) {
+            size_t turn = _ring[pos & _ring_mask]._turn.load(std::memory_order_acquire);
+            if ((intptr_t)turn - (intptr_t)pos < 0) {
+                // Full.
+                return 0;
+            }
+            // Other producer has taken this position.
+            _WTATOM_STAT(_stat_retry());
+            pos = _enq_pos._val.load(std::memory_order_relaxed);
+            continue;
+        }
+        if (P == Producers::Single) {
+            _enq_pos._val.store(pos + num, std::memory_order_relaxed);
+            return num;
+        }
+        if (_enq_pos._val.compare_exchange_weak(pos, pos + num, std::memory_order_relaxed)) {
+            return num;
+        }
+        _WTATOM_STAT(_stat_retry());
+    }
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+size_t AtomQueue<T, P, C>::_ring_reserve_get(size_t max, size_t& pos) {
+    pos = _deq_pos._val.load(std::memory_order_relaxed);
+    while (true) {
+        // Count the continuous filled slots from pos.
+        size_t num = 0;
+        while (num < max && num <= _ring_mask) {
+            size_t turn = _ring[(pos + num) & _ring_mask]._turn.load(std::memory_order_acquire);
+            if (turn != pos + num + 1) {
+                break;
+            }
+            ++num;
+        }
+        if (num == 0) {
+            size_t turn = _ring[pos & _ring_mask]._turn.load(std::memory_order_acquire);
+            if ((intptr_t)turn - (intptr_t)(pos + 1) < 0) {
+                // Empty.
+                return 0;
+            }
+            // Other consumer has taken this position.
+            _WTATOM_STAT(_stat_retry());
+            pos = _deq_pos._val.load(std::memory_order_relaxed);
+            continue;
+        }
+        if (C == Consumers::Single) {
+            _deq_pos._val.store(pos + num, std::memory_order_relaxed);
+            return num;
+        }
+        if (_deq_pos._val.compare_exchange_weak(pos, pos + num, std::memory_order_relaxed)) {
+            return num;
+        }
+        _WTATOM_STAT(_stat_retry());
+    }
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+template <typename U>
+bool AtomQueue<T, P, C>::_spsc_push(U&& in) {
+    size_t pos = _enq_pos._val.load(std::memory_order_relaxed);
+    if (pos - _enq_pos._cache > _ring_mask) {
+        // Full as far as known, load the get position again.
+        _enq_pos._cache = _deq_pos._val.load(std::memory_order_acquire);
+        if (pos - _enq_pos._cache > _ring_mask) {
+            return false;
+        }
+    }
+    _spsc_ring[pos & _ring_mask] = std::forward<U>(in);
+    _WTATOM_STAT(_spsc_stamp[pos & _ring_mask] = _now_ns());
+    _enq_pos._val.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+bool AtomQueue<T, P, C>::_spsc_get(T* out) {
+    size_t pos = _deq_pos._val.load(std::memory_order_relaxed);
+    if (pos == _deq_pos._cache) {
+        // Empty as far as known, load the push position again.
+        _deq_pos._cache = _enq_pos._val.load(std::memory_order_acquire);
+        if (pos == _deq_pos._cache) {
+            return false;
+        }
+    }
+    if (out != nullptr) {
+        *out = std::move(_spsc_ring[pos & _ring_mask]);
+    }
+    _WTATOM_STAT(_stat_got(_spsc_stamp[pos & _ring_mask]));
+    _deq_pos._val.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+size_t AtomQueue<T, P, C>::_spsc_reserve_push(size_t max, size_t& pos) {
+    pos = _enq_pos._val.load(std::memory_order_relaxed);
+    size_t num = _ring_mask + 1 - (pos - _enq_pos._cache);
+    if (num < max) {
+        _enq_pos._cache = _deq_pos._val.load(std::memory_order_acquire);
+        num = _ring_mask + 1 - (pos - _enq_pos._cache);
+    }
+    return num < max ? num : max;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+size_t AtomQueue<T, P, C>::_spsc_reserve_get(size_t max, size_t& pos) {
+    pos = _deq_pos._val.load(std::memory_order_relaxed);
+    size_t num = _deq_pos._cache - pos;
+    if (num < max) {
+        _deq_pos._cache = _enq_pos._val.load(std::memory_order_acquire);
+        num = _deq_pos._cache - pos;
+    }
+    return num < max ? num : max;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+template <typename U>
+void AtomQueue<T, P, C>::_segment_push(U&& in) {
+    size_t pos = 0;
+    if (P == Producers::Single) {
+        pos = _enq_pos._val.load(std::memory_order_relaxed);
+        _enq_pos._val.store(pos + 1, std::memory_order_release);
+    } else {
+        pos = _enq_pos._val.fetch_add(1, std::memory_order_acq_rel);
+    }
+    Segment<T>* seg = _segment_for_push(pos);
+    RingElement<T>& slot = seg->_elements[pos & _ring_mask];
+    slot._data = std::forward<U>(in);
+    _WTATOM_STAT(slot._stamp = _now_ns());
+    slot._turn.store(1, std::memory_order_release);
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+bool AtomQueue<T, P, C>::_segment_get(T* out) {
+    size_t pos = 0;
+    if (_segment_reserve_get(1, pos) == 0) {
+        return false;
+    }
+    _segment_take(pos, out);
+    return true;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+size_t AtomQueue<T, P, C>::_segment_reserve_get(size_t max, size_t& pos) {
+    pos = _deq_pos._val.load(std::memory_order_relaxed);
+    while (true) {
+        // Positions before the push position are occupied by producers, 
+        // the elements may not be written yet, _segment_take will wait for them.
+        size_t enq = _enq_pos._val.load(std::memory_order_acquire);
+        if (pos >= enq) {
+            return 0;
+        }
+        size_t num = enq - pos;
+        if (num > max) {
+            num = max;
+        }
+        if (C == Consumers::Single) {
+            _deq_pos._val.store(pos + num, std::memory_order_release);
+            return num;
+        }
+        if (_deq_pos._val.compare_exchange_weak(pos, pos + num, std::memory_order_acq_rel)) {
+            return num;
+        }
+        _WTATOM_STAT(_stat_retry());
+    }
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::_segment_take(size_t pos, T* out) {
+    Segment<T>* seg = _segment_for_get(pos);
+    RingElement<T>& slot = seg->_elements[pos & _ring_mask];
+    
+    // Wait for the producer of this position.
+    size_t wait_times = 0;
+    while (slot._turn.load(std::memory_order_acquire) != 1) {
+        _WTATOM_STAT(_stat_retry());
+        backoff(wait_times);
+    }
+    if (out != nullptr) {
+        *out = std::move(slot._data);
+    }
+    _WTATOM_STAT(_stat_got(slot._stamp));
+    slot._turn.store(0, std::memory_order_relaxed);
+    
+    // The last consumer of the segment retires it.
+    if (seg->_consumed.fetch_add(1, std::memory_order_acq_rel) == _ring_mask) {
+        size_t seg_id = pos >> _seg_shift;
+        _seg_dir[seg_id % segment_dir_size].store(nullptr, std::memory_order_release);
+        _segment_free(seg);
+    }
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+typename AtomQueue<T, P, C>::template Segment<T>* AtomQueue<T, P, C>::_segment_for_push(size_t pos) {
+    uint64_t seg_id = pos >> _seg_shift;
+    std::atomic<Segment<T>*>& entry = _seg_dir[seg_id % segment_dir_size];
+    size_t wait_times = 0;
+    while (true) {
+        Segment<T>* seg = entry.load(std::memory_order_acquire);
+        if (seg != nullptr) {
+            // Check the entry again, the segment may be recycled after loading.
+            if (seg->_id.load(std::memory_order_acquire) == seg_id && 
+                entry.load(std::memory_order_acquire) == seg) {
+                return seg;
+            }
+            // The entry is still used by a former segment. Too many alive segments.
+            _WTATOM_STAT(_stat_retry());
+            backoff(wait_times);
+            continue;
+        }
+        
+        // Install a new segment.
+        Segment<T>* fresh = _segment_alloc();
+        if (fresh == nullptr) {
+            backoff(wait_times);
+            continue;
+        }
+        fresh->_id.store(seg_id, std::memory_order_relaxed);
+        fresh->_consumed.store(0, std::memory_order_relaxed);
+        Segment<T>* expected = nullptr;
+        if (entry.compare_exchange_strong(expected, fresh, std::memory_order_acq_rel)) {
+            return fresh;
+        }
+        
+        // Other producer has installed it.
+        _segment_free(fresh);
+    }
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+typename AtomQueue<T, P, C>::template Segment<T>* AtomQueue<T, P, C>::_segment_for_get(size_t pos) {
+    uint64_t seg_id = pos >> _seg_shift;
+    std::atomic<Segment<T>*>& entry = _seg_dir[seg_id % segment_dir_size];
+    size_t wait_times = 0;
+    while (true) {
+        Segment<T>* seg = entry.load(std::memory_order_acquire);
+        if (seg != nullptr && 
+            seg->_id.load(std::memory_order_acquire) == seg_id && 
+            entry.load(std::memory_order_acquire) == seg) {
+            return seg;
+        }
+        // The producer hasn't installed the segment yet.
+        _WTATOM_STAT(_stat_retry());
+        backoff(wait_times);
+    }
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+typename AtomQueue<T, P, C>::template Segment<T>* AtomQueue<T, P, C>::_segment_alloc() {
+    // Pop from the free list. The tag prevents ABA.
+    uint64_t head = _seg_free.load(std::memory_order_acquire);
+    while ((uint32_t)head != 0) {
+        Segment<T>* seg = _seg_pool[(uint32_t)head - 1].load(std::memory_order_acquire);
+        uint64_t next = (((head >> 32) + 1) << 32) | seg->_free_next.load(std::memory_order_relaxed);
+        if (_seg_free.compare_exchange_weak(head, next, std::memory_order_acq_rel)) {
+            return seg;
+        }
+    }
+    
+    // Free list is empty, allocate a new one.
+    uint32_t index = _seg_pool_size.fetch_add(1, std::memory_order_relaxed);
+    if (index >= segment_dir_size * 2) {
+        _seg_pool_size.fetch_sub(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    Segment<T>* seg = new(std::nothrow) Segment<T>(_capacity, index);
+    if (seg == nullptr) {
+        // Leave the index unused.
+        toscreen << "Allocate segment failed.\n";
+        return nullptr;
+    }
+    _seg_pool[index].store(seg, std::memory_order_release);
+    return seg;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::_segment_free(Segment<T>* seg) {
+    uint64_t head = _seg_free.load(std::memory_order_acquire);
+    while (true) {
+        seg->_free_next.store((uint32_t)head, std::memory_order_relaxed);
+        uint64_t next = (((head >> 32) + 1) << 32) | (seg->_index + 1);
+        if (_seg_free.compare_exchange_weak(head, next, std::memory_order_acq_rel)) {
+            return;
+        }
+    }
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::_lock(pthread_mutex_t* lock) {
     int ret = pthread_mutex_lock(lock);
     if (ret != 0) {
         toscreen << "Lock mutux_lock failed, try again after 1 sec. "
@@ -230,8 +1126,8 @@ void AtomQueue<T>::_lock(pthread_mutex_t* lock) {
     return;
 }
 
-template <typename T>  
-void AtomQueue<T>::_lockr(pthread_rwlock_t* lock) {
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::_lockr(pthread_rwlock_t* lock) {
     int ret = pthread_rwlock_rdlock(lock);
     while (ret != 0) {
         toscreen << "Lock read_lock failed, try again after 1 sec. "
@@ -242,8 +1138,8 @@ void AtomQueue<T>::_lockr(pthread_rwlock_t* lock) {
     return;
 }
 
-template <typename T>  
-void AtomQueue<T>::_lockw(pthread_rwlock_t* lock) {
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::_lockw(pthread_rwlock_t* lock) {
     int ret = pthread_rwlock_wrlock(lock);
     while (ret != 0) {
         toscreen << "Lock write_lock failed, try again after 1 sec. "
@@ -254,8 +1150,8 @@ void AtomQueue<T>::_lockw(pthread_rwlock_t* lock) {
     return;
 }
 
-template <typename T>  
-void AtomQueue<T>::_unlock(pthread_mutex_t* lock) {
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::_unlock(pthread_mutex_t* lock) {
     int ret = pthread_mutex_unlock(lock);
     while (ret != 0) {
         toscreen << "Unlock mutux_lock failed, try again after 1 sec. "
@@ -266,8 +1162,8 @@ void AtomQueue<T>::_unlock(pthread_mutex_t* lock) {
     return;
 }
 
-template <typename T>  
-void AtomQueue<T>::_unlock(pthread_rwlock_t* lock) {
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::_unlock(pthread_rwlock_t* lock) {
     int ret = pthread_rwlock_unlock(lock);
     while (ret != 0) {
         toscreen << "Unlock rw_lock failed, try again after 1 sec. "
@@ -278,8 +1174,15 @@ void AtomQueue<T>::_unlock(pthread_rwlock_t* lock) {
     return;
 }
 
-template <typename T>  
-size_t AtomQueue<T>::size() {
+template <typename T, Producers::Type P, Consumers::Type C>
+size_t AtomQueue<T, P, C>::size() {
+    if (_mode == QueueMode::ring || _mode == QueueMode::segment) {
+        // Load the get position first, so it never exceeds the push position.
+        size_t deq = _deq_pos._val.load(std::memory_order_acquire);
+        size_t enq = _enq_pos._val.load(std::memory_order_acquire);
+        return enq - deq;
+    }
+    
     _lock(&_find_space_lock);
     if (_head <= _tail) {
         _unlock(&_find_space_lock);
@@ -289,6 +1192,65 @@ size_t AtomQueue<T>::size() {
     return _tail + _capacity - _head;
 }
 
+template <typename T, Producers::Type P, Consumers::Type C>
+QueueMode AtomQueue<T, P, C>::mode() const {
+    return _mode;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+QueueStat AtomQueue<T, P, C>::stat() {
+    QueueStat res;
+    res.depth = size();
+#ifdef WTATOM_QUEUE_STAT
+    res.enabled = true;
+    res.high_watermark = _stat._high_watermark.load(std::memory_order_relaxed);
+    res.push_num = _stat._push_num.load(std::memory_order_relaxed);
+    res.get_num = _stat._get_num.load(std::memory_order_relaxed);
+    res.expansion_num = _stat._expansion_num.load(std::memory_order_relaxed);
+    res.retry_num = _stat._retry_num.load(std::memory_order_relaxed);
+    res.elapsed_us = (_now_ns() - _stat._start) / 1000;
+    for (size_t i = 0; i < stat_bucket_num; ++i) {
+        res.queued_us[i] = _stat._queued_us[i].load(std::memory_order_relaxed);
+    }
+#endif
+    return res;
+}
+
+#ifdef WTATOM_QUEUE_STAT
+template <typename T, Producers::Type P, Consumers::Type C>
+uint64_t AtomQueue<T, P, C>::_now_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::_stat_pushed(size_t num) {
+    _stat._push_num.fetch_add(num, std::memory_order_relaxed);
+    size_t depth = size();
+    size_t mark = _stat._high_watermark.load(std::memory_order_relaxed);
+    while (depth > mark && 
+        _stat._high_watermark.compare_exchange_weak(mark, depth, std::memory_order_relaxed) == false) {}
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::_stat_got(uint64_t stamp) {
+    _stat._get_num.fetch_add(1, std::memory_order_relaxed);
+    uint64_t queued = (_now_ns() - stamp) / 1000;
+    size_t bucket = 0;
+    while (queued != 0 && bucket < stat_bucket_num - 1) {
+        queued >>= 1;
+        ++bucket;
+    }
+    _stat._queued_us[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+template <typename T, Producers::Type P, Consumers::Type C>
+void AtomQueue<T, P, C>::_stat_retry() {
+    _stat._retry_num.fetch_add(1, std::memory_order_relaxed);
+}
+#endif
+
 } // End namespace wtatom.
 
 #endif // End ifdef _ATOM_QUEUE_HPP_.
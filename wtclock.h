@@ -0,0 +1,123 @@
+/**
+ * Cheap timestamps of logs.
+ * The hot path only reads ticks, a TickClock converts them to wall time later.
+ * On x86 ticks are the TSC, a few cycles to read. Otherwise they are CLOCK_MONOTONIC in ns.
+ * Author: LiWentan.
+ * Date: 2019/7/20.
+ */
+
+#ifndef _WTLOG_CLOCK_H_
+#define _WTLOG_CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace wttool {
+
+/**
+ * Current ticks. Ticks of different cores are comparable on CPUs with invariant TSC.
+ */
+static inline uint64_t read_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+/**
+ * Monotonic time, in nanosecond.
+ */
+static uint64_t mono_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Wall time, in nanosecond since epoch.
+ */
+static uint64_t real_ns() {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Converts ticks to wall time in ns.
+ * The rate is measured by a short spin at construction, then refined by calibrate()
+ * over the time since construction. Not thread safe, each converting thread keeps its own.
+ */
+class TickClock {
+public:
+    TickClock() : _ns_per_tick(1.0) {
+        _sample(&_origin_ticks, &_origin_ns);
+        uint64_t ticks = 0;
+        uint64_t ns = 0;
+        do {
+            _sample(&ticks, &ns);
+        } while (ns - _origin_ns < spin_ns);
+        _anchor(ticks, ns);
+    }
+
+    /**
+     * Refine the rate and move the anchor to now, at most once per calibrate_ns.
+     * Call it periodically, it is a tick read otherwise.
+     */
+    void calibrate() {
+        if (read_ticks() - _anchor_ticks < _interval_ticks) {
+            return;
+        }
+        uint64_t ticks = 0;
+        uint64_t ns = 0;
+        _sample(&ticks, &ns);
+        _anchor(ticks, ns);
+    }
+
+    /**
+     * Wall time of the ticks, in nanosecond. Ticks before the anchor are fine.
+     */
+    uint64_t to_ns(uint64_t ticks) const {
+        return _anchor_ns + (int64_t)((double)(int64_t)(ticks - _anchor_ticks) * _ns_per_tick);
+    }
+
+private:
+    static const uint64_t spin_ns = 1000000;         // Spin of the first measure.
+    static const uint64_t calibrate_ns = 1000000000; // Interval of calibrate.
+
+    /**
+     * Read the wall time between two tick reads, take the middle ticks.
+     */
+    static void _sample(uint64_t* ticks, uint64_t* ns) {
+        uint64_t before = read_ticks();
+        *ns = real_ns();
+        uint64_t after = read_ticks();
+        *ticks = before + (after - before) / 2;
+    }
+
+    void _anchor(uint64_t ticks, uint64_t ns) {
+        if (ticks > _origin_ticks && ns > _origin_ns) {
+            // The wall time may be set backwards, keep the old rate then.
+            _ns_per_tick = (double)(ns - _origin_ns) / (double)(ticks - _origin_ticks);
+        }
+        _anchor_ticks = ticks;
+        _anchor_ns = ns;
+        _interval_ticks = (uint64_t)(calibrate_ns / _ns_per_tick);
+    }
+
+    uint64_t _origin_ticks;   // Sample at construction, the start of the rate measure.
+    uint64_t _origin_ns;
+    uint64_t _anchor_ticks;   // Last sample, conversions count from it.
+    uint64_t _anchor_ns;
+    uint64_t _interval_ticks; // calibrate_ns in ticks.
+    double   _ns_per_tick;
+};
+
+} // End namespace wttool.
+
+#endif // End ifdef _WTLOG_CLOCK_H_.
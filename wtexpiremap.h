@@ -0,0 +1,640 @@
+/**
+ * Thread safe containers whose elements expire.
+ * Deadlines are kept in a hierarchical timer wheel,
+ * adding, cancelling and expiring an element are all O(1).
+ * Author: LiWentan.
+ * Date: 2019/7/16.
+ */
+
+#ifndef _WTLOG_EXPIRE_MAP_H_
+#define _WTLOG_EXPIRE_MAP_H_
+
+#include <time.h>
+#include "wtlogtools.h"
+
+namespace wtatom {
+
+/**
+ * Element of the timer wheel. Embed it in the timed object.
+ */
+struct TimerNode {
+    TimerNode() : _prev(this), _next(this), _expire(0) {}
+    TimerNode* _prev;
+    TimerNode* _next;
+    uint64_t _expire; // Tick of the deadline.
+};
+
+/**
+ * Hierarchical timer wheel, not thread safe.
+ * Level 0 has a slot for each of the next wheel_slot_num ticks, each higher level
+ * has a slot for wheel_slot_num slots of the lower level. When level 0 goes
+ * around, a slot of the higher level is moved down.
+ */
+class TimerWheel {
+public:
+    static const size_t wheel_level_num = 4;
+    static const size_t wheel_slot_bits = 6;
+    static const size_t wheel_slot_num = 1 << wheel_slot_bits;
+
+    TimerWheel() : _cur(0), _size(0) {}
+
+    /**
+     * Set the current tick. Only call it before adding any node.
+     */
+    void reset(uint64_t tick) {
+        _cur = tick;
+    }
+
+    /**
+     * Add a node, it expires when the wheel reaches the tick.
+     * A tick not later than now expires at the next tick.
+     * A tick too far away is moved nearer to the farthest tick of the wheel.
+     */
+    void add(TimerNode* node, uint64_t tick) {
+        if (tick <= _cur) {
+            tick = _cur + 1;
+        }
+        uint64_t max_delta = ((uint64_t)1 << (wheel_slot_bits * wheel_level_num)) - 1;
+        if (tick - _cur > max_delta) {
+            tick = _cur + max_delta;
+        }
+        node->_expire = tick;
+        _link(node);
+        ++_size;
+    }
+
+    /**
+     * Remove a node added before.
+     */
+    void remove(TimerNode* node) {
+        _unlink(node);
+        --_size;
+    }
+
+    /**
+     * Move the wheel to the tick, call on_expire for each expired node.
+     * The node has been removed when on_expire is called.
+     */
+    template <typename F>
+    void advance(uint64_t tick, F on_expire) {
+        while (_cur < tick) {
+            if (_size == 0) {
+                // Nothing to expire, jump.
+                _cur = tick;
+                return;
+            }
+            ++_cur;
+
+            // Move the slots of higher levels down when lower levels go around.
+            for (size_t level = 1; level < wheel_level_num; ++level) {
+                if ((_cur & ((1 << (wheel_slot_bits * level)) - 1)) != 0) {
+                    break;
+                }
+                TimerNode* head = &_slots[level][(_cur >> (wheel_slot_bits * level)) & (wheel_slot_num - 1)];
+                while (head->_next != head) {
+                    TimerNode* node = head->_next;
+                    _unlink(node);
+                    _link(node);
+                }
+            }
+
+            TimerNode* head = &_slots[0][_cur & (wheel_slot_num - 1)];
+            while (head->_next != head) {
+                TimerNode* node = head->_next;
+                _unlink(node);
+                --_size;
+                on_expire(node);
+            }
+        }
+    }
+
+    /**
+     * Number of nodes in the wheel.
+     */
+    size_t size() const {
+        return _size;
+    }
+
+private:
+    TimerNode _slots[wheel_level_num][wheel_slot_num]; // Heads of the node lists.
+    uint64_t _cur;  // Current tick. Nodes of this tick have expired.
+    size_t _size;
+
+private:
+    /**
+     * Put the node to the slot matching its deadline.
+     */
+    void _link(TimerNode* node) {
+        uint64_t delta = node->_expire - _cur;
+        size_t level = 0;
+        while (level < wheel_level_num - 1 && (delta >> (wheel_slot_bits * (level + 1))) != 0) {
+            ++level;
+        }
+        TimerNode* head = &_slots[level][(node->_expire >> (wheel_slot_bits * level)) & (wheel_slot_num - 1)];
+        node->_prev = head->_prev;
+        node->_next = head;
+        head->_prev->_next = node;
+        head->_prev = node;
+    }
+
+    static void _unlink(TimerNode* node) {
+        node->_prev->_next = node->_next;
+        node->_next->_prev = node->_prev;
+        node->_prev = node;
+        node->_next = node;
+    }
+};
+
+/**
+ * Deadlines, size and waitting shared by the expiring containers.
+ */
+class ExpireBase {
+public:
+    /**
+     * Construtive function.
+     * @param timeout_us: Default life of an element, in microsecond.
+     * @param tick_us: Precision of the deadline, in microsecond.
+     */
+    ExpireBase(int64_t timeout_us, int64_t tick_us) :
+        _timeout_us(timeout_us), _tick_us(tick_us), _size(0), _last_tick(0), _empty_waiters(0) {
+        pthread_mutex_init(&_empty_lock, nullptr);
+        pthread_condattr_t cond_attr;
+        pthread_condattr_init(&cond_attr);
+        pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&_empty_cond, &cond_attr);
+        pthread_condattr_destroy(&cond_attr);
+    }
+
+    /**
+     * Distructive function.
+     */
+    virtual ~ExpireBase() {
+        pthread_mutex_destroy(&_empty_lock);
+        pthread_cond_destroy(&_empty_cond);
+    }
+
+    /**
+     * Wait until the container is empty.
+     * @param timeout_us: Max waitting time. Negative means wait forever.
+     * @return false: Still not empty after timeout.
+     */
+    bool wait_empty(int64_t timeout_us = -1) {
+        timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        if (timeout_us >= 0) {
+            int64_t nsec = deadline.tv_nsec + (timeout_us % 1000000) * 1000;
+            deadline.tv_sec += timeout_us / 1000000 + nsec / 1000000000;
+            deadline.tv_nsec = nsec % 1000000000;
+        }
+
+        // Register before checking, pairs with the fence in _removed.
+        lock(_empty_lock);
+        _empty_waiters.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool res = true;
+        while (_size.load(std::memory_order_relaxed) != 0) {
+            int ret = 0;
+            if (timeout_us >= 0) {
+                ret = pthread_cond_timedwait(&_empty_cond, &_empty_lock, &deadline);
+            } else {
+                ret = pthread_cond_wait(&_empty_cond, &_empty_lock);
+            }
+            if (ret == ETIMEDOUT) {
+                res = (_size.load(std::memory_order_relaxed) == 0);
+                break;
+            }
+        }
+        _empty_waiters.fetch_sub(1, std::memory_order_relaxed);
+        unlock(_empty_lock);
+        return res;
+    }
+
+    /**
+     * Get the size.
+     */
+    size_t size() {
+        return _size.load(std::memory_order_relaxed);
+    }
+
+protected:
+    int64_t _timeout_us;
+    int64_t _tick_us;
+    std::atomic<size_t> _size;
+    std::atomic<uint64_t> _last_tick; // Tick of the last expire.
+
+    // Used by wait_empty.
+    std::atomic<int> _empty_waiters;
+    pthread_mutex_t _empty_lock;
+    pthread_cond_t _empty_cond;
+
+protected:
+    uint64_t _now_tick() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return ((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000) / _tick_us;
+    }
+
+    /**
+     * The tick of the deadline of an element inserted now.
+     * @param timeout_us: Negative means the default one.
+     */
+    uint64_t _deadline(int64_t timeout_us) {
+        if (timeout_us < 0) {
+            timeout_us = _timeout_us;
+        }
+        return _now_tick() + (timeout_us + _tick_us - 1) / _tick_us;
+    }
+
+    /**
+     * Claim the expiring of this tick.
+     * @return false: Expired in this tick already, or other thread is expiring.
+     */
+    bool _begin_expire(uint64_t* now) {
+        *now = _now_tick();
+        uint64_t last = _last_tick.load(std::memory_order_relaxed);
+        return *now > last && _last_tick.compare_exchange_strong(last, *now) == true;
+    }
+
+    /**
+     * Called after removing num elements. Wake up wait_empty if empty.
+     */
+    void _removed(size_t num) {
+        if (_size.fetch_sub(num, std::memory_order_seq_cst) != num) {
+            return;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_empty_waiters.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+        lock(_empty_lock);
+        pthread_cond_broadcast(&_empty_cond);
+        unlock(_empty_lock);
+    }
+};
+
+/**
+ * Same usage as AtomMap, but each element has a deadline.
+ * Expired elements are removed by expire(), call it periodically.
+ * Elements are spread into StripeNum stripes, each stripe has its own lock and wheel.
+ */
+template <typename KeyType, typename ValType, size_t StripeNum = 8>
+class ExpireMap : public ExpireBase {
+private:
+    struct Node : public TimerNode {
+        Node(const KeyType& k_in, const ValType& v_in) : _key(k_in), _val(v_in) {}
+        KeyType _key;
+        ValType _val;
+    };
+
+    struct Stripe {
+        pthread_mutex_t _lock;
+        std::unordered_map<KeyType, Node*> _data;
+        TimerWheel _wheel;
+        char _pad[cache_line_size]; // Keep the lock away from the next stripe.
+    };
+
+public:
+    /**
+     * Construtive function.
+     * @param timeout_us: Default life of an element, in microsecond.
+     * @param tick_us: Precision of the deadline, in microsecond.
+     */
+    ExpireMap(int64_t timeout_us, int64_t tick_us = 1000) : ExpireBase(timeout_us, tick_us) {
+        uint64_t now = _now_tick();
+        for (size_t i = 0; i < StripeNum; ++i) {
+            pthread_mutex_init(&_stripe[i]._lock, nullptr);
+            _stripe[i]._wheel.reset(now);
+        }
+    }
+
+    /**
+     * Distructive function.
+     */
+    virtual ~ExpireMap() {
+        clear();
+        for (size_t i = 0; i < StripeNum; ++i) {
+            pthread_mutex_destroy(&_stripe[i]._lock);
+        }
+    }
+
+    /**
+     * Insert elements. The deadline is counted from now.
+     * @param timeout_us: Life of the element. Negative means the default one.
+     * @return true: Success.
+     * @return false: Already existing key. Overwrite the value and the deadline.
+     */
+    bool insert(const std::pair<KeyType, ValType>& content, int64_t timeout_us = -1) {
+        uint64_t deadline = _deadline(timeout_us);
+        Stripe& st = _stripe_of(content.first);
+        lock(st._lock);
+        auto res = st._data.insert(std::make_pair(content.first, (Node*)nullptr));
+        if (res.second == false) {
+            Node* node = res.first->second;
+            node->_val = content.second;
+            st._wheel.remove(node);
+            st._wheel.add(node, deadline);
+            unlock(st._lock);
+            return false;
+        }
+        Node* node = new Node(content.first, content.second);
+        res.first->second = node;
+        st._wheel.add(node, deadline);
+        _size.fetch_add(1, std::memory_order_relaxed);
+        unlock(st._lock);
+        return true;
+    }
+
+    /**
+     * Get the value.
+     * @return true: Found key, write the parameter val as the correspond one.
+     * @return false: Unexisting or expired key.
+     */
+    bool find(const KeyType& key, ValType* val = nullptr) {
+        Stripe& st = _stripe_of(key);
+        lock(st._lock);
+        auto it = st._data.find(key);
+        if (it == st._data.end()) {
+            unlock(st._lock);
+            return false;
+        }
+        if (val != nullptr) {
+            *val = it->second->_val;
+        }
+        unlock(st._lock);
+        return true;
+    }
+
+    /**
+     * Get the value, then remove the element and cancel its deadline.
+     * @return true: Success.
+     * @return false: Unexisting or expired key.
+     */
+    bool find_and_remove(const KeyType& key, ValType* val = nullptr) {
+        Stripe& st = _stripe_of(key);
+        lock(st._lock);
+        auto it = st._data.find(key);
+        if (it == st._data.end()) {
+            unlock(st._lock);
+            return false;
+        }
+        Node* node = it->second;
+        st._data.erase(it);
+        st._wheel.remove(node);
+        unlock(st._lock);
+        if (val != nullptr) {
+            *val = std::move(node->_val);
+        }
+        delete node;
+        _removed(1);
+        return true;
+    }
+
+    /**
+     * Remove the elements whose deadline has passed.
+     * Cheap if called again in the same tick.
+     * @param out: If not null, expired elements are appended to it.
+     * @return The number of expired elements.
+     */
+    size_t expire(std::vector<std::pair<KeyType, ValType> >* out = nullptr) {
+        uint64_t now = 0;
+        if (_begin_expire(&now) == false) {
+            return 0;
+        }
+
+        size_t num = 0;
+        std::vector<Node*> expired;
+        for (size_t i = 0; i < StripeNum; ++i) {
+            Stripe& st = _stripe[i];
+            lock(st._lock);
+            st._wheel.advance(now, [&](TimerNode* tn) {
+                Node* node = static_cast<Node*>(tn);
+                st._data.erase(node->_key);
+                expired.push_back(node);
+            });
+            unlock(st._lock);
+        }
+        for (size_t i = 0; i < expired.size(); ++i) {
+            if (out != nullptr) {
+                out->push_back(std::make_pair(expired[i]->_key, std::move(expired[i]->_val)));
+            }
+            delete expired[i];
+        }
+        num = expired.size();
+        if (num != 0) {
+            _removed(num);
+        }
+        return num;
+    }
+
+    /**
+     * Clear. Deadlines are cancelled.
+     */
+    void clear() {
+        size_t num = 0;
+        for (size_t i = 0; i < StripeNum; ++i) {
+            Stripe& st = _stripe[i];
+            lock(st._lock);
+            auto it = st._data.begin();
+            while (it != st._data.end()) {
+                st._wheel.remove(it->second);
+                delete it->second;
+                ++num;
+                ++it;
+            }
+            st._data.clear();
+            unlock(st._lock);
+        }
+        if (num != 0) {
+            _removed(num);
+        }
+    }
+
+private:
+    Stripe _stripe[StripeNum];
+
+private:
+    Stripe& _stripe_of(const KeyType& key) {
+        uint64_t h = std::hash<KeyType>()(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return _stripe[h % StripeNum];
+    }
+};
+
+/**
+ * Expiring container which chooses the keys itself.
+ * The key is a request id increasing by each insert, its low bits index a slot
+ * of a preallocated slab, so finding an element is an array index.
+ * A slot remembers the whole id, a stale id of the same slot, e.g. a late reply,
+ * is not found. Ids start from a random number, ids of different slabs rarely match.
+ * One lock is shared by all slots, suitable for a few inserting and finding threads.
+ */
+template <typename ValType>
+class ExpireSlab : public ExpireBase {
+private:
+    struct Slot : public TimerNode {
+        Slot() : _id(0), _used(false) {}
+        uint32_t _id;
+        bool _used;
+        ValType _val;
+    };
+
+public:
+    /**
+     * Construtive function.
+     * @param capacity: Max number of elements, rounded up to power of 2.
+     * @param timeout_us: Default life of an element, in microsecond.
+     * @param tick_us: Precision of the deadline, in microsecond.
+     */
+    ExpireSlab(size_t capacity, int64_t timeout_us, int64_t tick_us = 1000) : 
+        ExpireBase(timeout_us, tick_us), _capacity(1) {
+        while (_capacity < capacity) {
+            _capacity <<= 1;
+        }
+        _slot = new Slot[_capacity];
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        _next_id = (uint32_t)(now.tv_nsec ^ (now.tv_sec << 20) ^ ((uint64_t)this >> 4));
+        pthread_mutex_init(&_lock, nullptr);
+        _wheel.reset(_now_tick());
+    }
+
+    /**
+     * Distructive function.
+     */
+    virtual ~ExpireSlab() {
+        clear();
+        delete[] _slot;
+        pthread_mutex_destroy(&_lock);
+    }
+
+    /**
+     * Insert an element. The deadline is counted from now.
+     * @param id: Write the id of the element.
+     * @param timeout_us: Life of the element. Negative means the default one.
+     * @return false: The slab is full.
+     */
+    bool insert(const ValType& val, uint32_t* id, int64_t timeout_us = -1) {
+        uint64_t deadline = _deadline(timeout_us);
+        lock(_lock);
+        if (_size.load(std::memory_order_relaxed) == _capacity) {
+            unlock(_lock);
+            return false;
+        }
+        // Slots are mostly freed in order, the next one is usually free.
+        while (_slot[_next_id & (_capacity - 1)]._used == true) {
+            ++_next_id;
+        }
+        Slot& slot = _slot[_next_id & (_capacity - 1)];
+        slot._id = _next_id++;
+        slot._used = true;
+        slot._val = val;
+        _wheel.add(&slot, deadline);
+        _size.fetch_add(1, std::memory_order_relaxed);
+        *id = slot._id;
+        unlock(_lock);
+        return true;
+    }
+
+    /**
+     * Get the value.
+     * @return true: Found id, write the parameter val as the correspond one.
+     * @return false: Unexisting, stale or expired id.
+     */
+    bool find(uint32_t id, ValType* val = nullptr) {
+        Slot& slot = _slot[id & (_capacity - 1)];
+        lock(_lock);
+        if (slot._used == false || slot._id != id) {
+            unlock(_lock);
+            return false;
+        }
+        if (val != nullptr) {
+            *val = slot._val;
+        }
+        unlock(_lock);
+        return true;
+    }
+
+    /**
+     * Get the value, then remove the element and cancel its deadline.
+     * @return true: Success.
+     * @return false: Unexisting, stale or expired id.
+     */
+    bool find_and_remove(uint32_t id, ValType* val = nullptr) {
+        Slot& slot = _slot[id & (_capacity - 1)];
+        lock(_lock);
+        if (slot._used == false || slot._id != id) {
+            unlock(_lock);
+            return false;
+        }
+        _wheel.remove(&slot);
+        slot._used = false;
+        if (val != nullptr) {
+            *val = std::move(slot._val);
+        }
+        unlock(_lock);
+        _removed(1);
+        return true;
+    }
+
+    /**
+     * Remove the elements whose deadline has passed.
+     * Cheap if called again in the same tick.
+     * @param out: If not null, ids and values of expired elements are appended to it.
+     * @return The number of expired elements.
+     */
+    size_t expire(std::vector<std::pair<uint32_t, ValType> >* out = nullptr) {
+        uint64_t now = 0;
+        if (_begin_expire(&now) == false) {
+            return 0;
+        }
+
+        size_t num = 0;
+        lock(_lock);
+        _wheel.advance(now, [&](TimerNode* tn) {
+            Slot* slot = static_cast<Slot*>(tn);
+            slot->_used = false;
+            if (out != nullptr) {
+                out->push_back(std::make_pair(slot->_id, std::move(slot->_val)));
+            }
+            ++num;
+        });
+        unlock(_lock);
+        if (num != 0) {
+            _removed(num);
+        }
+        return num;
+    }
+
+    /**
+     * Clear. Deadlines are cancelled.
+     */
+    void clear() {
+        size_t num = 0;
+        lock(_lock);
+        for (size_t i = 0; i < _capacity; ++i) {
+            if (_slot[i]._used == true) {
+                _wheel.remove(&_slot[i]);
+                _slot[i]._used = false;
+                _slot[i]._val = ValType();
+                ++num;
+            }
+        }
+        unlock(_lock);
+        if (num != 0) {
+            _removed(num);
+        }
+    }
+
+private:
+    Slot* _slot;       // Slots are never moved, the wheel links them.
+    size_t _capacity;
+    uint32_t _next_id; // Id of the next element.
+    TimerWheel _wheel;
+    pthread_mutex_t _lock;
+};
+
+} // End namespace wtatom.
+
+#endif // End ifdef _WTLOG_EXPIRE_MAP_H_.
@@ -0,0 +1,181 @@
+/**
+ * Rate limiting and sampling of logs.
+ * A log suppressed by a limiter or sampler is counted in it,
+ * the count is taken by the next log it allows and sent with that log.
+ * Author: LiWentan.
+ * Date: 2019/7/22.
+ */
+
+#ifndef _WTLOG_LIMIT_H_
+#define _WTLOG_LIMIT_H_
+
+#include <stdint.h>
+#include <atomic>
+#include "wtclock.h"
+
+namespace wtlog {
+
+/**
+ * Token bucket, kept as the time the bucket is full again(GCRA).
+ * Admitting is one CAS, threads share it without lock.
+ */
+class RateLimiter {
+public:
+    /**
+     * @param logs_per_sec: Rate of tokens. 0 means unlimited.
+     * @param burst: Tokens of a full bucket, the logs allowed at once after being idle. At least 1.
+     */
+    RateLimiter(double logs_per_sec = 0, double burst = 1) : _interval_ns(0), _tolerance_ns(0), _tat(0), _suppressed(0) {
+        set(logs_per_sec, burst);
+    }
+    
+    /**
+     * Change the rate. Same parameters as the constructor.
+     */
+    void set(double logs_per_sec, double burst) {
+        if (logs_per_sec <= 0) {
+            _interval_ns.store(0, std::memory_order_relaxed);
+            return;
+        }
+        if (burst < 1) {
+            burst = 1;
+        }
+        int64_t interval = (int64_t)(1e9 / logs_per_sec);
+        if (interval < 1) {
+            interval = 1;
+        }
+        _tolerance_ns.store((int64_t)(interval * burst), std::memory_order_relaxed);
+        _interval_ns.store(interval, std::memory_order_relaxed);
+    }
+    
+    bool limited() const {
+        return _interval_ns.load(std::memory_order_relaxed) != 0;
+    }
+    
+    /**
+     * Take a token.
+     * @param suppressed: Set to the logs suppressed since the last allowed one, if allowed.
+     * @return false: No token, the log is counted as suppressed.
+     */
+    bool admit(uint32_t* suppressed) {
+        int64_t interval = _interval_ns.load(std::memory_order_relaxed);
+        if (interval != 0) {
+            int64_t tolerance = _tolerance_ns.load(std::memory_order_relaxed);
+            int64_t now = (int64_t)wttool::mono_ns();
+            int64_t tat = _tat.load(std::memory_order_relaxed);
+            while (true) {
+                int64_t next = (tat > now ? tat : now) + interval;
+                if (next - now > tolerance) {
+                    _suppressed.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                if (_tat.compare_exchange_weak(tat, next, std::memory_order_relaxed) == true) {
+                    break;
+                }
+            }
+        }
+        *suppressed = _take_suppressed();
+        return true;
+    }
+    
+    /**
+     * Count logs suppressed elsewhere, e.g. allowed by this one then suppressed by another.
+     */
+    void suppress(uint32_t num) {
+        if (num != 0) {
+            _suppressed.fetch_add(num, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    uint32_t _take_suppressed() {
+        // A plain load first, the exchange is only paid after suppressing.
+        if (_suppressed.load(std::memory_order_relaxed) == 0) {
+            return 0;
+        }
+        return _suppressed.exchange(0, std::memory_order_relaxed);
+    }
+    
+    std::atomic<int64_t>  _interval_ns;  // Time of a token. 0 means unlimited.
+    std::atomic<int64_t>  _tolerance_ns; // Time of a full bucket.
+    std::atomic<int64_t>  _tat;          // When the bucket is full again, in mono_ns.
+    std::atomic<uint32_t> _suppressed;   // Logs suppressed since the last allowed one.
+};
+
+/**
+ * Keeps one log of every one_in_n.
+ */
+class Sampler {
+public:
+    Sampler() : _one_in_n(1), _random(false), _seen(0), _suppressed(0) {}
+    
+    /**
+     * @param one_in_n: 1 or 0 keeps all logs.
+     * @param random: If true, each log is kept with probability 1 / one_in_n, 
+     *      otherwise exactly every one_in_n-th log is kept.
+     */
+    void set(uint32_t one_in_n, bool random) {
+        _random.store(random, std::memory_order_relaxed);
+        _one_in_n.store(one_in_n == 0 ? 1 : one_in_n, std::memory_order_relaxed);
+    }
+    
+    bool sampling() const {
+        return _one_in_n.load(std::memory_order_relaxed) > 1;
+    }
+    
+    /**
+     * Same as RateLimiter::admit.
+     */
+    bool admit(uint32_t* suppressed) {
+        uint32_t n = _one_in_n.load(std::memory_order_relaxed);
+        if (n > 1) {
+            bool keep = false;
+            if (_random.load(std::memory_order_relaxed) == true) {
+                keep = _next_random() % n == 0;
+            } else {
+                keep = _seen.fetch_add(1, std::memory_order_relaxed) % n == 0;
+            }
+            if (keep == false) {
+                _suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        *suppressed = _suppressed.load(std::memory_order_relaxed) == 0 ? 
+            0 : _suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+    
+    /**
+     * Same as RateLimiter::suppress.
+     */
+    void suppress(uint32_t num) {
+        if (num != 0) {
+            _suppressed.fetch_add(num, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    /**
+     * xorshift64 of the calling thread, seeded by its stack address and the time.
+     */
+    static uint64_t _next_random() {
+        static thread_local uint64_t state = 0;
+        if (state == 0) {
+            state = ((uint64_t)(uintptr_t)&state * 0x9e3779b97f4a7c15ULL) ^ wttool::mono_ns();
+            state |= 1;
+        }
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+    
+    std::atomic<uint32_t> _one_in_n;
+    std::atomic<bool>     _random;
+    std::atomic<uint64_t> _seen;        // Logs seen, for keeping every one_in_n-th.
+    std::atomic<uint32_t> _suppressed;  // Logs suppressed since the last kept one.
+};
+
+} // End namespace wtlog.
+
+#endif // End ifdef _WTLOG_LIMIT_H_.
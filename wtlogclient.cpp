@@ -9,7 +9,45 @@
 
 namespace wtlog {
 
-WTLogClient::WTLogClient() : _connected(false) {}
+std::atomic<uint64_t> WTLogClient::_client_num(0);
+pthread_mutex_t WTLogClient::_format_lock = PTHREAD_MUTEX_INITIALIZER;
+std::unordered_map<uint64_t, const char*> WTLogClient::_formats;
+
+WTLogClient::WTLogClient() : _connected(false), _socket(-1), _online(false), _link_lost(false), 
+    _retry_us(0), _backoff_us(reconnect_min_us), _next_seq(0), _spill_logs(0), 
+    _id(_client_num.fetch_add(1)), _print_queue(1024, wtatom::QueueMode::segment), 
+    _ring_num(0), _sender_parked(false), _wakeup(64, wtatom::QueueMode::ring), 
+    _callback_fun(reply_slot_num, reply_timeout_us), _reply_timeout_us(reply_timeout_us), 
+    _completions_lost(0), _callback_tasks(1024, wtatom::QueueMode::segment), 
+    _callback_thread_num(0), _callbacks_async(false), 
+    _max_logs(0), _max_bytes(0), _policy(OverloadPolicy::block), 
+    _block_timeout_us(1e5), _queued_bytes(0), _admit_waiters(0), _min_rank(0), _throttling(false), _codec(default_codec()), 
+    _batch_bytes(1 << 16), _linger_us(1000), 
+    _shared_pushed(0), _retired_pushed(0), _done(0) {
+    for (size_t i = 0; i < log_level_num; ++i) {
+        _dropped[i].store(0);
+        _unreported[i].store(0);
+        _suppressed[i].store(0);
+    }
+    
+    // The session only needs to differ among clients of a server, mix what differs.
+    uint64_t seed = wttool::real_ns() ^ ((uint64_t)getpid() << 40) ^ (_id << 24) ^ (uint64_t)(uintptr_t)this;
+    seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+    _session = seed ^ (seed >> 31);
+    
+    pthread_mutex_init(&_admit_lock, nullptr);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_admit_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+}
+
+WTLogClient::~WTLogClient() {
+    pthread_cond_destroy(&_admit_cond);
+    pthread_mutex_destroy(&_admit_lock);
+}
 
 bool WTLogClient::connect(const string& ip, short port) {
     // Initialize the _svr_addr.
@@ -19,43 +57,30 @@ bool WTLogClient::connect(const string& ip, short port) {
     _svr_addr.sin_addr.s_addr = inet_addr(ip.c_str());
     
     // Construct the connection.
-    _socket = socket(PF_INET, SOCK_STREAM, 0);
-    if (_socket < 0) {
-        toscreen << "Initialize the socket failed. Connect failed.\n";
-        return false;
-    }
-    int ret = ::connect(_socket, (sockaddr*)&_svr_addr, sizeof(sockaddr));
-    if (ret < 0) {
+    if (_open_link(io_timeout_us) == false) {
         toscreen << "Cannot connect to IP: " << ip << ", Port: " << port << ".\n";
         return false;
     }
+    _sent_formats.clear();
+    _link_lost = false;
+    _online = true;
+    _connected = true;
     
-    // Handshake with the server, check whether remote server is correct type.
-    uint16_t authorize_info_buffer = htons(h_authorize_info);
-    ret = write(_socket, &authorize_info_buffer, sizeof(uint16_t));
-    if (ret != sizeof(uint16_t)) {
-        toscreen << "Write authorize_info to server error. Try to connect again.\n";
-        _send_command(Command::disconnect);
-        close(_socket);
-        return false;
-    }
-    uint16_t authorize_ret_buffer;
-    ret = read(_socket, &authorize_ret_buffer, sizeof(uint16_t));
-    authorize_ret_buffer = ntohs(authorize_ret_buffer);
-    if (ret != sizeof(uint16_t) || authorize_ret_buffer != h_authorize_ret) {
-        toscreen << "Remote server may not a correct wtlogserver. Try again.\n";
+    // Create threads to run callbacks.
+    if (_start_callbacks() == false) {
         _send_command(Command::disconnect);
+        _connected = false;
         close(_socket);
         return false;
     }
-    _connected = true;
     
     // Create thread to handle the _print_queue.
-    ret = pthread_create(&_hpq_t, nullptr, _handle_print_queue, this);
+    int ret = pthread_create(&_hpq_t, nullptr, _handle_print_queue, this);
     if (ret != 0) {
         toscreen << "Create thread for handling _print_queue failed. Code: " << ret << ".\n";
         _send_command(Command::disconnect);
         _connected = false;
+        _stop_callbacks();
         close(_socket);
         return false;
     }
@@ -66,6 +91,7 @@ bool WTLogClient::connect(const string& ip, short port) {
         toscreen << "Create thread for monitoring return failed. Code: " << ret << ".\n";
         _send_command(Command::disconnect);
         _connected = false;
+        _stop_callbacks();
         close(_socket);
         return false;
     }
@@ -75,14 +101,104 @@ bool WTLogClient::connect(const string& ip, short port) {
     return true;
 }
 
+bool WTLogClient::_open_link(int64_t timeout_us) {
+    int sock = socket(PF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        toscreen << "Initialize the socket failed.\n";
+        return false;
+    }
+    if (wttool::connect_within(sock, (sockaddr*)&_svr_addr, sizeof(sockaddr), timeout_us) != wttool::io_ok) {
+        close(sock);
+        return false;
+    }
+    
+    // Handshake with the server, check whether remote server is correct type.
+    uint16_t authorize_info_buffer = htons(h_authorize_info);
+    if (wttool::write_all(sock, &authorize_info_buffer, sizeof(uint16_t), timeout_us) != wttool::io_ok) {
+        toscreen << "Write authorize_info to server error. Try to connect again.\n";
+        close(sock);
+        return false;
+    }
+    uint16_t authorize_ret_buffer = 0;
+    wttool::IoStat st = wttool::read_all(sock, &authorize_ret_buffer, sizeof(uint16_t), timeout_us);
+    authorize_ret_buffer = ntohs(authorize_ret_buffer);
+    if (st != wttool::io_ok || authorize_ret_buffer != h_authorize_ret) {
+        toscreen << "Remote server may not a correct wtlogserver. Try again.\n";
+        close(sock);
+        return false;
+    }
+    
+    // [head(16)][session_id(64)]. The same in each connection of this client.
+    char id_frame[2 + sizeof(uint64_t)];
+    uint16_t id_head = htons(h_client_id);
+    memcpy(id_frame, &id_head, sizeof(uint16_t));
+    uint64_t session_sent = htobe64(_session);
+    memcpy(id_frame + 2, &session_sent, sizeof(uint64_t));
+    if (wttool::write_all(sock, id_frame, sizeof(id_frame), timeout_us) != wttool::io_ok) {
+        toscreen << "Write client id to server error. Try to connect again.\n";
+        close(sock);
+        return false;
+    }
+    _socket = sock;
+    return true;
+}
+
+void WTLogClient::_link_down() {
+    _online = false;
+    shutdown(_socket, SHUT_RDWR); // Wakes up _monitor_return, closed by _close_link after it exits.
+    _backoff_us = reconnect_min_us;
+    _retry_us = wttool::mono_us() + _backoff_us;
+    toscreen << "Lost the log server, reconnecting. Logs are " 
+        << (_spill.is_open() ? "spilled to the local file" : "dropped") << " meanwhile.\n";
+}
+
+void WTLogClient::_close_link() {
+    if (_socket < 0) {
+        return;
+    }
+    shutdown(_socket, SHUT_RDWR);
+    pthread_join(_mr_t, nullptr);
+    close(_socket);
+    _socket = -1;
+}
+
+void WTLogClient::_reconnect() {
+    _close_link();
+    if (_open_link(reconnect_timeout_us) == true) {
+        _link_lost = false;
+        int ret = pthread_create(&_mr_t, nullptr, _monitor_return, this);
+        if (ret == 0) {
+            // The server may be a new one, send the formats again.
+            _sent_formats.clear();
+            _online = true;
+            toscreen << "Reconnected to the log server. " << _spill_logs.load() << " logs to be replayed.\n";
+            return;
+        }
+        toscreen << "Create thread for monitoring return failed. Code: " << ret << ".\n";
+        close(_socket);
+        _socket = -1;
+    }
+    _backoff_us = std::min(_backoff_us * 2, reconnect_max_us);
+    _retry_us = wttool::mono_us() + _backoff_us;
+}
+
 void WTLogClient::disconnect() {
     if (_connected == false) {
         return;
     }
     
-    // Wait until all works have been done.
+    // Wait until all works have been done. Spilled logs wait for the server to come back.
     int loop_time = 0;
-    while (_print_queue.size() != 0) {
+    int64_t offline_since = -1;
+    while (_pending() != 0 || _spill_logs.load() != 0) {
+        if (_online == true) {
+            offline_since = -1;
+        } else if (offline_since < 0) {
+            offline_since = wttool::mono_us();
+        } else if (wttool::mono_us() - offline_since > spill_drain_timeout_us) {
+            toscreen << "Log server is unreachable, " << _pending() + _spill_logs.load() << " logs are dropped.\n";
+            break;
+        }
         if (loop_time > 30) {
             toscreen << "Still waitting for print_queue.\n";
             loop_time = 0;
@@ -90,44 +206,792 @@ void WTLogClient::disconnect() {
         ++loop_time;
         usleep(4e5);
     }
-    loop_time = 0;
-    while (_callback_fun.size() != 0) {
-        toscreen << "Still waitting for callback_fun.\n";
-        ++loop_time;
-        if (loop_time > 15) {
-            toscreen << "Some request is still waitting for callback, mandatory close.\n";
-            break;
-        }
-        usleep(4e5);
+    
+    // Callbacks either get the reply or time out, _handle_print_queue expires them.
+    if (_online == true && _callback_fun.wait_empty(_reply_timeout_us + 1e6) == false) {
+        toscreen << "Some request is still waitting for callback, mandatory close.\n";
+    }
+    
+    // Stop _handle_print_queue first, it may be reconnecting. It drops the logs left if offline.
+    _connected = false;
+    _wake_sender();
+    _wake_admitted();
+    pthread_join(_hpq_t, nullptr);
+    _stop_callbacks();
+    if (_online == false) {
+        return;
     }
     
-    // Tell the log server that this client is going to close.
+    // Tell the log server about the last dropped logs and that this client is going to close.
+    _report_drops();
     _send_command(Command::disconnect);
     
     // Close local connection.
     close(_socket);
-    _connected = false;
 }
 
 void WTLogClient::tolog(const string& content, 
     LogLevel level, 
     void (*callback)(const CallBackInfo&)) {
+    _log_bytes(content.data(), content.size(), level, callback);
+}
+
+void WTLogClient::tolog(string&& content, 
+    LogLevel level, 
+    void (*callback)(const CallBackInfo&)) {
+    if (_max_logs == 0 && _max_bytes == 0) {
+        // The ring keeps a copy anyway.
+        _log_bytes(content.data(), content.size(), level, callback);
+        return;
+    }
     if (_connected == false) {
         // Discard the log.
         return;
     }
-    uint32_t utc_time = time(nullptr);
-    PrintRequest req = PrintRequest(content, utc_time, level, callback);
-    _print_queue.push(req);
+    if (_filtered(level, callback)) {
+        return;
+    }
+    uint32_t count = 0;
+    if (_throttled(level, callback, &count)) {
+        return;
+    }
+    if (count != 0) {
+        uint32_t count_sent = htonl(count);
+        content.append((const char*)&count_sent, sizeof(uint32_t));
+    }
+    if (_admit(level, content.size()) == false) {
+        _drop(level, callback);
+        return;
+    }
+    _push_shared(PrintRequest(std::move(content), wttool::read_ticks(), level, callback, 
+        count != 0 ? level_suppressed_flag : 0));
+}
+
+void WTLogClient::tolog(const char* content, 
+    LogLevel level, 
+    void (*callback)(const CallBackInfo&)) {
+    _log_bytes(content, strlen(content), level, callback);
+}
+
+#if __cplusplus >= 201703L
+void WTLogClient::tolog(std::string_view content, 
+    LogLevel level, 
+    void (*callback)(const CallBackInfo&)) {
+    _log_bytes(content.data(), content.size(), level, callback);
+}
+#endif
+
+WTLogClient::LogSpan WTLogClient::reserve(size_t size, 
+    LogLevel level, 
+    void (*callback)(const CallBackInfo&)) {
+    return _reserve(size, level, callback);
+}
+
+void WTLogClient::commit(LogSpan& span) {
+    _commit(span, true);
+}
+
+void WTLogClient::tolog_keyed(uint64_t key, const string& content, 
+    LogLevel level, 
+    void (*callback)(const CallBackInfo&)) {
+    if (_connected == false || _filtered(level, callback)) {
+        return;
+    }
+    uint32_t suppressed = 0;
+    if (_key_limits[((key * 0x9e3779b97f4a7c15ULL) >> 32) % key_limit_slots].admit(&suppressed) == false) {
+        _suppress(level, callback);
+        return;
+    }
+    _log_bytes(content.data(), content.size(), level, callback, suppressed);
+}
+
+void WTLogClient::tolog_after_suppressed(uint32_t suppressed, const string& content, 
+    LogLevel level, 
+    void (*callback)(const CallBackInfo&)) {
+    _log_bytes(content.data(), content.size(), level, callback, suppressed);
+}
+
+LogFuture WTLogClient::tolog_async(const string& content, LogLevel level) {
+    LogFuture future;
+    _log_bytes(content.data(), content.size(), level, LogNotify::make_future(&future));
+    return future;
+}
+
+void WTLogClient::tolog_tagged(uint64_t tag, const string& content, LogLevel level) {
+    _log_bytes(content.data(), content.size(), level, LogNotify::make_tagged(tag));
+}
+
+void WTLogClient::_log_bytes(const char* content, size_t size, 
+    LogLevel level, const LogNotify& callback, uint32_t suppressed) {
+    LogSpan span = _reserve(size, level, callback, 0, suppressed);
+    if (span.data == nullptr) {
+        return;
+    }
+    memcpy(span.data, content, size);
+    _commit(span, true);
+}
+
+void WTLogClient::tolog_fields(LogLevel level, const char* msg, std::initializer_list<LogField> fields, 
+    void (*callback)(const CallBackInfo&)) {
+    _log_fields(level, msg, strlen(msg), fields, callback);
+}
+
+void WTLogClient::tolog_fields(LogLevel level, const string& msg, std::initializer_list<LogField> fields, 
+    void (*callback)(const CallBackInfo&)) {
+    _log_fields(level, msg.data(), msg.size(), fields, callback);
+}
+
+void WTLogClient::_log_fields(LogLevel level, const char* msg, size_t msg_size, 
+    std::initializer_list<LogField> fields, const LogNotify& callback) {
+    LogSpan span = _reserve(fields_size(msg_size, fields), level, callback, level_fields_flag);
+    if (span.data == nullptr) {
+        return;
+    }
+    fields_put(span.data, msg, msg_size, fields);
+    _commit(span, true);
+}
+
+WTLogClient::LogSpan WTLogClient::_reserve(size_t size, 
+    LogLevel level, const LogNotify& callback, uint16_t flags, uint32_t suppressed) {
+    LogSpan span;
+    if (_connected == false) {
+        // Discard the log.
+        return span;
+    }
+    if (_filtered(level, callback)) {
+        return span;
+    }
+    uint32_t count = suppressed;
+    if (_throttled(level, callback, &count)) {
+        return span;
+    }
+    
+    // The count of suppressed logs follows the content.
+    size_t tail = (count != 0) ? sizeof(uint32_t) : 0;
+    uint32_t count_sent = htonl(count);
+    flags |= (count != 0) ? level_suppressed_flag : 0;
+    if (size + tail > max_log_size) {
+        // Unsupported length.
+        toscreen << "A log is too long. Ignore this log.\n";
+        return span;
+    }
+    uint64_t ticks = wttool::read_ticks();
+    
+    if (_max_logs != 0 || _max_bytes != 0) {
+        // Limited logs go through _print_queue.
+        if (_admit(level, size) == false) {
+            _drop(level, callback);
+            return span;
+        }
+        span._request = new PrintRequest(string(size + tail, '\0'), ticks, level, callback, flags);
+        memcpy(&span._request->content[size], &count_sent, tail);
+        span.data = &span._request->content[0];
+        span.size = size;
+        return span;
+    }
+    
+    // Take a request id for the reply, it indexes the callback slot.
+    uint32_t hash_id = 0;
+    bool reply = (callback.empty() == false);
+    if (reply == true && 
+        _callback_fun.insert(callback, &hash_id, _reply_timeout_us) == false) {
+        CallBackInfo cbinfo;
+        cbinfo.status = CallBackStat::failed;
+        cbinfo.message = "Too many logs waitting for reply.";
+        _notify(callback, cbinfo);
+        reply = false;
+    }
+    
+    StagingRing* ring = _thread_ring();
+    char* frame = nullptr;
+    size_t wait_times = 0;
+    while ((frame = ring->reserve(log_head_size + size + tail)) == nullptr) {
+        // Full. Frames not published can't be sent, publish them before waitting.
+        if (ring->unpublished != 0) {
+            _publish(ring);
+        }
+        wtatom::backoff(wait_times);
+    }
+    _encode_head(frame, (reply == false) ? h_send_log : h_send_log_need_reply, 
+        ticks, level | flags, hash_id, size + tail);
+    memcpy(frame + log_head_size + size, &count_sent, tail);
+    span.data = frame + log_head_size;
+    span.size = size;
+    span._ring = ring;
+    return span;
+}
+
+void WTLogClient::_commit(LogSpan& span, bool publish) {
+    if (span._ring != nullptr) {
+        StagingRing* ring = span._ring;
+        ring->committed = ring->reserved;
+        ++ring->unpublished;
+        if (publish == true) {
+            _publish(ring);
+        }
+    } else if (span._request != nullptr) {
+        _push_shared(std::move(*span._request));
+        delete span._request;
+    }
+    span = LogSpan();
+}
+
+void WTLogClient::_publish(StagingRing* ring) {
+    // Count them before publishing, so _pending never misses them. Only this thread writes them.
+    ring->pushed.store(ring->pushed.load(std::memory_order_relaxed) + ring->unpublished, 
+        std::memory_order_release);
+    ring->tail.store(ring->committed, std::memory_order_release);
+    ring->unpublished = 0;
+    _wake_sender();
+}
+
+void WTLogClient::_push_shared(PrintRequest&& pr) {
+    _queued_bytes.fetch_add(pr.content.size(), std::memory_order_relaxed);
+    _shared_pushed.fetch_add(1, std::memory_order_relaxed);
+    _print_queue.push(std::move(pr));
+    _wake_sender();
+}
+
+WTLogClient::StagingRing* WTLogClient::_thread_ring() {
+    static thread_local ThreadStaging staging;
+    for (size_t i = 0; i < staging.rings.size(); ++i) {
+        if (staging.rings[i].first == _id) {
+            return staging.rings[i].second.get();
+        }
+    }
+    
+    // First log of this thread, register a ring.
+    std::shared_ptr<StagingRing> fresh(new StagingRing(staging_ring_size));
+    staging.rings.push_back(std::make_pair(_id, fresh));
+    _staging.insert(std::make_pair(_ring_num.fetch_add(1), fresh));
+    return fresh.get();
+}
+
+WTLogClient::StagingRing::StagingRing(size_t capacity) : capacity(1), 
+    reserved(0), committed(0), unpublished(0), head_cache(0), 
+    tail(0), pushed(0), orphaned(false), read(0), in_batch(false), head(0) {
+    while (this->capacity < capacity) {
+        this->capacity <<= 1;
+    }
+    buf = new char[this->capacity];
+}
+
+WTLogClient::StagingRing::~StagingRing() {
+    delete[] buf;
+}
+
+char* WTLogClient::StagingRing::reserve(size_t frame_size) {
+    size_t pos = reserved & (capacity - 1);
+    size_t left = capacity - pos;
+    size_t need = (left < frame_size) ? left + frame_size : frame_size;
+    if (reserved + need - head_cache > capacity) {
+        head_cache = head.load(std::memory_order_acquire);
+        if (reserved + need - head_cache > capacity) {
+            return nullptr;
+        }
+    }
+    if (left < frame_size) {
+        // Start from the beginning, mark the space left.
+        if (left >= log_head_size) {
+            memset(buf + pos, 0, sizeof(uint16_t));
+        }
+        reserved += left;
+        pos = 0;
+    }
+    reserved += frame_size;
+    return buf + pos;
+}
+
+void WTLogClient::_wake_sender() {
+    // Pairs with the fence in _wait_logs, one of them must see the other.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_sender_parked.load(std::memory_order_relaxed) == true) {
+        _wakeup.try_push(0);
+    }
+}
+
+size_t WTLogClient::_take_frames(SendBatch& batch, uint64_t& next_ring) {
+    size_t num = 0;
+    auto rings = _staging.read();
+    
+    // Start from the first ring whose key is not less than next_ring.
+    size_t start = 0;
+    while (start < rings->size() && (*rings)[start].first < next_ring) {
+        ++start;
+    }
+    for (size_t i = 0; i < rings->size(); ++i) {
+        const std::pair<uint64_t, std::shared_ptr<StagingRing> >& entry = 
+            (*rings)[(start + i) % rings->size()];
+        StagingRing* ring = entry.second.get();
+        next_ring = entry.first + 1;
+        bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+        uint64_t tail = ring->tail.load(std::memory_order_acquire);
+        
+        size_t taken = 0;
+        bool full = false;
+        while (ring->read < tail) {
+            if (batch.bytes >= _batch_bytes) {
+                // Keep the batch within one frame the peer can read, resume this ring next time.
+                full = true;
+                next_ring = entry.first;
+                break;
+            }
+            size_t pos = ring->read & (ring->capacity - 1);
+            size_t left = ring->capacity - pos;
+            char* frame = ring->buf + pos;
+            if (left < log_head_size || *(uint16_t*)frame == 0) {
+                // The frame starts from the beginning.
+                ring->read += left;
+                continue;
+            }
+            size_t frame_size = log_head_size + ntohs(*(uint16_t*)(frame + 2 + log_size_pos));
+            _stamp(frame);
+            if (*(uint16_t*)frame == htons(h_send_log_need_reply)) {
+                batch.relay = false;
+            }
+            if ((ntohs(*(uint16_t*)(frame + 2 + log_level_pos)) & level_fmt_flag) != 0) {
+                _define_format(batch, *(uint64_t*)(frame + log_head_size));
+            }
+            _add_piece(batch, SendBatch::in_ring, 0, frame_size, frame);
+            ring->read += frame_size;
+            ++taken;
+        }
+        if (taken != 0) {
+            if (ring->in_batch == false) {
+                ring->in_batch = true;
+                batch.rings.push_back(entry.second);
+            }
+            if (batch.logs == 0) {
+                batch.first_us = wttool::mono_us();
+            }
+            batch.logs += taken;
+            num += taken;
+        }
+        if ((ring->read - ring->head.load(std::memory_order_relaxed)) * 2 >= ring->capacity) {
+            // The owner may wait for space soon.
+            batch.ring_full = true;
+        }
+        
+        if (orphaned == true && ring->in_batch == false && ring->read == tail) {
+            // The owner has exited and the ring is released. Count its logs before
+            // removing it, so _pending may count them twice but never misses them.
+            _retired_pushed.fetch_add(ring->pushed.load(std::memory_order_acquire), 
+                std::memory_order_seq_cst);
+            _staging.find_and_remove(entry.first);
+        }
+        if (full == true) {
+            break;
+        }
+    }
+    return num;
+}
+
+bool WTLogClient::_has_logs() {
+    if (_print_queue.size() != 0) {
+        return true;
+    }
+    auto rings = _staging.read();
+    for (auto it = rings->begin(); it != rings->end(); ++it) {
+        if (it->second->read != it->second->tail.load(std::memory_order_acquire)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void WTLogClient::_wait_logs(int64_t timeout_us) {
+    // Announce the waitting before the last check, so a log pushed after
+    // the check will find this thread and wake it up.
+    _sender_parked.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_has_logs() == false) {
+        char signal = 0;
+        _wakeup.get_wait(&signal, timeout_us);
+    }
+    _sender_parked.store(false, std::memory_order_relaxed);
+    while (_wakeup.get(nullptr) == true) {}
+}
+
+uint64_t WTLogClient::_pending() {
+    // Read _done first and _retired_pushed last, both only increase,
+    // so the result is never less than the real number.
+    uint64_t done = _done.load(std::memory_order_seq_cst);
+    uint64_t pushed = _shared_pushed.load(std::memory_order_seq_cst);
+    {
+        auto rings = _staging.read();
+        for (auto it = rings->begin(); it != rings->end(); ++it) {
+            pushed += it->second->pushed.load(std::memory_order_acquire);
+        }
+    }
+    pushed += _retired_pushed.load(std::memory_order_seq_cst);
+    return pushed - done;
+}
+
+void WTLogClient::_discard_logs() {
+    SendBatch batch;
+    uint64_t next_ring = 0;
+    while (_take_frames(batch, next_ring) != 0 || batch.logs != 0) {
+        _done.fetch_add(batch.logs, std::memory_order_seq_cst);
+        _release(batch);
+    }
+    PrintRequest pr;
+    while (_print_queue.get(&pr) == true) {
+        _queued_bytes.fetch_sub(pr.content.size(), std::memory_order_relaxed);
+        _done.fetch_add(1, std::memory_order_seq_cst);
+    }
+    _wake_admitted();
+}
+
+void WTLogClient::set_queue_limit(size_t max_logs, size_t max_bytes, 
+    OverloadPolicy policy, int64_t block_timeout_us) {
+    _max_logs = max_logs;
+    _max_bytes = max_bytes;
+    _policy = policy;
+    _block_timeout_us = block_timeout_us;
+}
+
+uint64_t WTLogClient::dropped(LogLevel level) {
+    if ((size_t)level >= log_level_num) {
+        return 0;
+    }
+    return _dropped[level].load(std::memory_order_relaxed);
+}
+
+void WTLogClient::set_min_level(LogLevel min_level) {
+    _min_rank.store(level_rank(min_level), std::memory_order_relaxed);
+}
+
+bool WTLogClient::_filtered(LogLevel level, const LogNotify& callback) {
+    if (level_enabled(level) == true) {
+        return false;
+    }
+    if (callback.empty() == false) {
+        CallBackInfo cbinfo;
+        cbinfo.status = CallBackStat::failed;
+        cbinfo.message = "The level is disabled.";
+        _notify(callback, cbinfo);
+    }
+    return true;
+}
+
+void WTLogClient::set_rate_limit(LogLevel level, double logs_per_sec, double burst) {
+    if ((size_t)level >= log_level_num) {
+        return;
+    }
+    _level_limits[level].set(logs_per_sec, burst);
+    if (_level_limits[level].limited() == true) {
+        _throttling = true;
+    }
+}
+
+void WTLogClient::set_sampling(LogLevel level, uint32_t one_in_n, bool random) {
+    if ((size_t)level >= log_level_num) {
+        return;
+    }
+    _samplers[level].set(one_in_n, random);
+    if (_samplers[level].sampling() == true) {
+        _throttling = true;
+    }
+}
+
+void WTLogClient::set_key_rate_limit(double logs_per_sec, double burst) {
+    for (size_t i = 0; i < key_limit_slots; ++i) {
+        _key_limits[i].set(logs_per_sec, burst);
+    }
+}
+
+uint64_t WTLogClient::suppressed(LogLevel level) {
+    if ((size_t)level >= log_level_num) {
+        return 0;
+    }
+    return _suppressed[level].load(std::memory_order_relaxed);
+}
+
+bool WTLogClient::_throttled(LogLevel level, const LogNotify& callback, uint32_t* count) {
+    if (_throttling.load(std::memory_order_relaxed) == false || (size_t)level >= log_level_num) {
+        return false;
+    }
+    uint32_t sampled = 0;
+    if (_samplers[level].admit(&sampled) == false) {
+        // The count from elsewhere goes with the next log kept.
+        _samplers[level].suppress(*count);
+        _suppress(level, callback);
+        return true;
+    }
+    uint32_t limited = 0;
+    if (_level_limits[level].admit(&limited) == false) {
+        _level_limits[level].suppress(*count + sampled);
+        _suppress(level, callback);
+        return true;
+    }
+    *count += sampled + limited;
+    return false;
+}
+
+void WTLogClient::_suppress(LogLevel level, const LogNotify& callback) {
+    if ((size_t)level < log_level_num) {
+        _suppressed[level].fetch_add(1, std::memory_order_relaxed);
+    }
+    if (callback.empty() == false) {
+        CallBackInfo cbinfo;
+        cbinfo.status = CallBackStat::failed;
+        cbinfo.message = "Suppressed by the rate limit or sampling.";
+        _notify(callback, cbinfo);
+    }
+}
+
+bool WTLogClient::_over_limit(size_t bytes) {
+    if (_max_logs != 0 && _print_queue.size() >= _max_logs) {
+        return true;
+    }
+    if (_max_bytes != 0 && 
+        _queued_bytes.load(std::memory_order_relaxed) + bytes > _max_bytes) {
+        return true;
+    }
+    return false;
+}
+
+bool WTLogClient::_admit(LogLevel level, size_t bytes) {
+    if (_over_limit(bytes) == false) {
+        return true;
+    }
+    
+    if (_policy == OverloadPolicy::drop_newest) {
+        return false;
+    }
+    
+    if (_policy == OverloadPolicy::drop_oldest) {
+        // Drop logs from the top until the new one fits.
+        PrintRequest old;
+        while (_over_limit(bytes) == true && _print_queue.get(&old) == true) {
+            _queued_bytes.fetch_sub(old.content.size(), std::memory_order_relaxed);
+            _shared_pushed.fetch_sub(1, std::memory_order_relaxed);
+            _drop(old.level, old.callback);
+        }
+        // If the queue is empty but it still doesn't fit, the new log alone is too large.
+        return _over_limit(bytes) == false;
+    }
+    
+    if (_policy == OverloadPolicy::drop_by_level && 
+        (level == LogLevel::debug || level == LogLevel::info)) {
+        return false;
+    }
+    
+    // Block. Park until _handle_print_queue takes some logs. Register as waitting 
+    // before the last check, so the queue lowered after the check will wake this thread up.
+    // The condition uses CLOCK_MONOTONIC, the same clock as mono_us.
+    int64_t deadline_us = wttool::deadline_of(_block_timeout_us);
+    bool res = false;
+    pthread_mutex_lock(&_admit_lock);
+    _admit_waiters.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (true) {
+        if (_over_limit(bytes) == false) {
+            res = true;
+            break;
+        }
+        if (_connected == false) {
+            break;
+        }
+        if (deadline_us < 0) {
+            pthread_cond_wait(&_admit_cond, &_admit_lock);
+            continue;
+        }
+        if (wttool::mono_us() >= deadline_us) {
+            break;
+        }
+        timespec deadline;
+        deadline.tv_sec = deadline_us / 1000000;
+        deadline.tv_nsec = (deadline_us % 1000000) * 1000;
+        pthread_cond_timedwait(&_admit_cond, &_admit_lock, &deadline);
+    }
+    _admit_waiters.fetch_sub(1, std::memory_order_relaxed);
+    pthread_mutex_unlock(&_admit_lock);
+    return res;
+}
+
+void WTLogClient::_wake_admitted() {
+    // Pairs with the fence in _admit, one of them must see the other.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_admit_waiters.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    // Logs of different sizes may fit now, wake up all.
+    pthread_mutex_lock(&_admit_lock);
+    pthread_cond_broadcast(&_admit_cond);
+    pthread_mutex_unlock(&_admit_lock);
+}
+
+void WTLogClient::_drop(LogLevel level, const LogNotify& callback) {
+    if ((size_t)level < log_level_num) {
+        _dropped[level].fetch_add(1, std::memory_order_relaxed);
+        _unreported[level].fetch_add(1, std::memory_order_relaxed);
+    }
+    if (callback.empty() == false) {
+        CallBackInfo cbinfo;
+        cbinfo.status = CallBackStat::failed;
+        cbinfo.message = "Dropped by the queue limit.";
+        _notify(callback, cbinfo);
+    }
+}
+
+void WTLogClient::set_batch(size_t max_bytes, int64_t linger_us) {
+    _batch_bytes = max_bytes;
+    _linger_us = linger_us;
+}
+
+bool WTLogClient::set_compression(Codec codec) {
+    if (codec_supported(codec) == false) {
+        return false;
+    }
+    _codec = codec;
+    return true;
+}
+
+bool WTLogClient::set_spill(const string& path, size_t max_bytes) {
+    if (_spill.open(path, max_bytes) == false) {
+        toscreen << "Cannot create the spill file: " << path << ".\n";
+        return false;
+    }
+    return true;
+}
+
+void WTLogClient::set_reply_timeout(int64_t timeout_us) {
+    _reply_timeout_us = timeout_us;
+}
+
+void WTLogClient::set_completion_ring(size_t capacity) {
+    _completions.reset(new wtatom::AtomQueue<LogCompletion, wtatom::Producers::Multi, wtatom::Consumers::Single>(
+        capacity, wtatom::QueueMode::ring));
+}
+
+size_t WTLogClient::poll_completions(LogCompletion* out, size_t max, int64_t timeout_us) {
+    if (_completions == nullptr) {
+        return 0;
+    }
+    if (timeout_us == 0) {
+        return _completions->get_batch(out, max);
+    }
+    return _completions->get_batch_wait(out, max, timeout_us);
+}
+
+uint64_t WTLogClient::completions_lost() {
+    return _completions_lost.load(std::memory_order_relaxed);
+}
+
+void WTLogClient::set_callback_threads(size_t num) {
+    _callback_thread_num = num;
+}
+
+void WTLogClient::_notify(const LogNotify& notify, const CallBackInfo& cbinfo) {
+    if (notify.kind() == LogNotify::callback) {
+        if (_callbacks_async.load(std::memory_order_acquire) == true) {
+            _callback_tasks.push(CallbackTask(notify.fn(), cbinfo));
+            if (_callbacks_async.load(std::memory_order_seq_cst) == false) {
+                // The threads may have stopped before the push.
+                CallbackTask task;
+                while (_callback_tasks.get(&task) == true) {
+                    task.fn(task.info);
+                }
+            }
+        } else {
+            notify.fn()(cbinfo);
+        }
+    } else if (notify.kind() == LogNotify::future) {
+        notify.fulfill(cbinfo);
+    } else if (notify.kind() == LogNotify::tagged) {
+        if (_completions == nullptr || _completions->try_push(LogCompletion(notify.tag(), cbinfo)) == false) {
+            _completions_lost.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+bool WTLogClient::_start_callbacks() {
+    _callbacks_async = true;
+    for (size_t i = 0; i < _callback_thread_num; ++i) {
+        pthread_t tid;
+        int ret = pthread_create(&tid, nullptr, _run_callbacks, this);
+        if (ret != 0) {
+            toscreen << "Create thread for running callbacks failed. Code: " << ret << ".\n";
+            _stop_callbacks();
+            return false;
+        }
+        _callback_t.push_back(tid);
+    }
+    if (_callback_t.empty() == true) {
+        _callbacks_async = false;
+    }
+    return true;
+}
+
+void WTLogClient::_stop_callbacks() {
+    _callbacks_async = false;
+    for (size_t i = 0; i < _callback_t.size(); ++i) {
+        pthread_join(_callback_t[i], nullptr);
+    }
+    _callback_t.clear();
+    
+    // Pushed after the threads saw the queue empty.
+    CallbackTask task;
+    while (_callback_tasks.get(&task) == true) {
+        task.fn(task.info);
+    }
+}
+
+void* WTLogClient::_run_callbacks(void* args) {
+    WTLogClient* client = (WTLogClient*)args;
+    CallbackTask task;
+    while (client->_callbacks_async == true || client->_callback_tasks.size() != 0) {
+        if (client->_callback_tasks.get_wait(&task, 2e5) == false) {
+            continue;
+        }
+        task.fn(task.info);
+    }
+    pthread_exit(nullptr);
+}
+
+void WTLogClient::_expire_callbacks() {
+    std::vector<std::pair<uint32_t, LogNotify> > expired;
+    if (_callback_fun.expire(&expired) == 0) {
+        return;
+    }
+    CallBackInfo cbinfo;
+    cbinfo.status = CallBackStat::timeout;
+    cbinfo.message = "No reply before the deadline.";
+    for (size_t i = 0; i < expired.size(); ++i) {
+        _notify(expired[i].second, cbinfo);
+    }
+    if (debug_mode) {
+        toscreen << expired.size() << " callbacks timed out.\n";
+    }
+}
+
+bool WTLogClient::_report_drops() {
+    uint32_t delta[log_level_num];
+    bool changed = false;
+    for (size_t i = 0; i < log_level_num; ++i) {
+        uint32_t cur = _unreported[i].exchange(0, std::memory_order_relaxed);
+        delta[i] = htonl(cur);
+        if (cur != 0) {
+            changed = true;
+        }
+    }
+    if (changed == false) {
+        return true;
+    }
+    
+    char buffer[sizeof(uint16_t) + sizeof(delta)];
+    uint16_t head = htons(h_drop_report);
+    memcpy(buffer, &head, sizeof(uint16_t));
+    memcpy(buffer + sizeof(uint16_t), delta, sizeof(delta));
+    return wttool::write_all(_socket, buffer, sizeof(buffer), io_timeout_us) == wttool::io_ok;
 }
 
 void WTLogClient::_send_command(Command comm, const char* content) {
     if (comm == Command::disconnect) {
         uint16_t close_head_buffer = htons(h_close_head);
-        int ret = write(_socket, &close_head_buffer, sizeof(uint16_t));
-        if (ret != sizeof(uint16_t)) {
+        if (wttool::write_all(_socket, &close_head_buffer, sizeof(uint16_t), io_timeout_us) != wttool::io_ok) {
             toscreen << "Fatal error. Write function call failed.\n";
-            _print_queue.clear();
             _callback_fun.clear();
             _connected = false;
         }
@@ -138,104 +1002,488 @@ void WTLogClient::_send_command(Command comm, const char* content) {
 
 void* WTLogClient::_handle_print_queue(void* args) {
     WTLogClient* client = (WTLogClient*)args;
-    int empty_times = 0;
-    PrintRequest pr;
-    char buffer[10240];
-    while (client->_connected == true || client->_print_queue.size() != 0) {
-        if (empty_times >= 20) {
-            usleep(2e5);
+    std::vector<PrintRequest> prs(256);
+    SendBatch batch;
+    SendBatch replayed; // A record of the spill file being sent.
+    uint64_t next_ring = 0; // Rings are drained in turn from here.
+    while (client->_connected == true || batch.logs != 0 || client->_pending() != 0 || 
+        client->_spill.empty() == false) {
+        if (client->_connected == false && client->_online == false) {
+            // disconnect gave up waitting for the server.
+            break;
         }
+        client->_expire_callbacks();
+        client->_clock.calibrate();
         
-        if (client->_print_queue.get(pr) == false) {
-            // No log is waitting to be sent.
-            ++empty_times;
-            continue;
+        // Reconnect after losing the server, then send the spilled logs before new ones.
+        if (client->_online == true && client->_link_lost == true) {
+            client->_link_down();
         }
-        
-        if (debug_mode) {
-            toscreen << "Found a log, start to handle.\n";
+        int64_t now_us = wttool::mono_us();
+        if (client->_online == false && client->_connected == true && now_us >= client->_retry_us) {
+            client->_reconnect();
         }
-        
-        if (pr.content.size() > 10000) {
-            // Unsupported length.
-            toscreen << "A log is too long. Ignore this log.\n";
+        if (client->_online == true && client->_spill.empty() == false) {
+            client->_replay(replayed);
+        }
+        if (batch.sequenced == true) {
+            // The batch was kept for space in the spill file, take no more logs until it goes.
+            client->_flush(batch);
             continue;
         }
         
-        // Send the pr.
-        size_t next_addr = 0; // Offset address of empty space in buffer.
-        
-        // Set the head as "send_log".
-        uint16_t h_send_l = (pr.callback == nullptr) ? h_send_log : h_send_log_need_reply;
-        h_send_l = htons(h_send_l);
-        memcpy(buffer + next_addr, &h_send_l, sizeof(uint16_t));
-        next_addr += sizeof(uint16_t);
-        
-        // Set log time.
-        uint32_t p_time = htonl(pr.p_time);
-        memcpy(buffer + next_addr, &p_time, sizeof(uint32_t));
-        next_addr += sizeof(uint32_t);
-        
-        // Set log level.
-        uint16_t level = htons(static_cast<uint16_t>(pr.level));
-        memcpy(buffer + next_addr, &level, sizeof(uint16_t));
-        next_addr += sizeof(uint16_t);
-        
-        // Set hash id.
-        uint32_t hash_id = wttool::str2hash(pr.content, true);
-        uint32_t hash_id_sent = htonl(hash_id);
-        memcpy(buffer + next_addr, &hash_id_sent, sizeof(uint32_t));
-        next_addr += sizeof(uint32_t);
-        if (pr.callback != nullptr) {
-            client->_callback_fun[hash_id] = pr.callback;
+        // Send the batch if it is full or has waited enough.
+        int64_t wait_us = 2e5;
+        if (client->_online == false) {
+            wait_us = std::max<int64_t>(0, std::min<int64_t>(wait_us, client->_retry_us - now_us));
         }
-        
-        if (debug_mode) {
-            toscreen << "The hash_id: " << hash_id << ".\n";
+        if (batch.logs != 0) {
+            wait_us = batch.first_us + client->_linger_us - now_us;
+            if (batch.bytes >= client->_batch_bytes || batch.ring_full == true || wait_us <= 0) {
+                client->_flush(batch);
+                continue;
+            }
         }
         
-        // Set the string length.
-        uint16_t str_len = static_cast<uint16_t>(pr.content.size());
-        str_len = htons(str_len);
-        memcpy(buffer + next_addr, &str_len, sizeof(uint16_t));
-        next_addr += sizeof(uint16_t);
-        
-        if (debug_mode) {
-            toscreen << "The log length: " << ntohs(str_len) << ".\n";
+        size_t log_num = client->_take_frames(batch, next_ring);
+        size_t shared_num = client->_print_queue.get_batch(&prs[0], prs.size());
+        if (shared_num != 0) {
+            // Make room for the producers blocked by the queue limit before sending.
+            for (size_t i = 0; i < shared_num; ++i) {
+                client->_queued_bytes.fetch_sub(prs[i].content.size(), std::memory_order_relaxed);
+            }
+            client->_wake_admitted();
         }
-        
-        // Set the string content.
-        memcpy(buffer + next_addr, pr.content.c_str(), pr.content.size());
-        next_addr += pr.content.size();
-        
-        if(debug_mode) {
-            toscreen << "Start to write log to TCP buffer.\n";
+        log_num += shared_num;
+        if (log_num == 0) {
+            if (batch.logs != 0 && client->_linger_us == 0) {
+                // Nothing more to send, do not wait.
+                client->_flush(batch);
+                continue;
+            }
+            if (client->_online == true && client->_spill.empty() == false) {
+                // Keep replaying.
+                continue;
+            }
+            // No log is waitting to be sent. Still report the drops.
+            if (batch.logs == 0 && client->_online == true && client->_report_drops() == false) {
+                client->_link_down();
+            }
+            client->_wait_logs(wait_us);
+            continue;
         }
         
-        // Send message to log server.
-        int ret = write(client->_socket, buffer, next_addr);
-        if (ret != next_addr) {
-            toscreen << "Fatal error. Write function call failed.\n";
-            client->_print_queue.clear();
-            client->_callback_fun.clear();
-            client->disconnect();
-            pthread_exit(nullptr);
+        if (debug_mode) {
+            toscreen << "Found " << log_num << " logs, start to handle.\n";
         }
         
-        if(debug_mode) {
-            toscreen << "Write log to TCP buffer completely. Totally sent: " << next_addr << " bytes.\n";
+        for (size_t i = 0; i < shared_num; ++i) {
+            if (prs[i].content.size() > max_log_size) {
+                // Unsupported length.
+                toscreen << "A log is too long. Ignore this log.\n";
+                client->_done.fetch_add(1, std::memory_order_seq_cst);
+                continue;
+            }
+            client->_append_log(batch, prs[i]);
+            // A kept batch holds the rest of the logs taken, and is flushed again after replaying.
+            if (batch.bytes >= client->_batch_bytes && batch.sequenced == false) {
+                client->_flush(batch);
+            }
         }
     }
+    
+    if (client->_online == false) {
+        // Gave up, drop what is left.
+        client->_discard_logs();
+        SpillFile::Record rec;
+        while (client->_spill.front(&rec) == true) {
+            client->_drop_frames(rec.data, rec.size);
+            client->_spill_logs.fetch_sub(rec.log_num, std::memory_order_seq_cst);
+            client->_spill.pop();
+        }
+        client->_close_link();
+    }
     pthread_exit(nullptr);
 }
 
+void WTLogClient::_encode_head(char* frame, uint16_t head, uint64_t p_time, 
+    uint16_t level, uint32_t hash_id, size_t size) {
+    // [head(16)][time(64)][level(16)][hash_id(32)][content_size(16)].
+    uint16_t h_send_l = htons(head);
+    memcpy(frame, &h_send_l, sizeof(uint16_t));
+    memcpy(frame + 2 + log_time_pos, &p_time, sizeof(uint64_t));
+    uint16_t level_sent = htons(level);
+    memcpy(frame + 2 + log_level_pos, &level_sent, sizeof(uint16_t));
+    uint32_t hash_id_sent = htonl(hash_id);
+    memcpy(frame + 2 + log_hash_pos, &hash_id_sent, sizeof(uint32_t));
+    uint16_t str_len = htons(static_cast<uint16_t>(size));
+    memcpy(frame + 2 + log_size_pos, &str_len, sizeof(uint16_t));
+}
+
+void WTLogClient::_stamp(char* frame) {
+    uint64_t ticks = 0;
+    memcpy(&ticks, frame + 2 + log_time_pos, sizeof(uint64_t));
+    uint64_t ns_sent = htobe64(_clock.to_ns(ticks));
+    memcpy(frame + 2 + log_time_pos, &ns_sent, sizeof(uint64_t));
+}
+
+uint64_t WTLogClient::register_format(const char* fmt) {
+    uint64_t id = format_id(fmt);
+    wtatom::lock(_format_lock);
+    _formats.insert(std::make_pair(id, fmt));
+    wtatom::unlock(_format_lock);
+    return id;
+}
+
+uint64_t WTLogClient::_intern_format(const char* fmt) {
+    static thread_local std::unordered_map<const char*, uint64_t> known;
+    auto it = known.find(fmt);
+    if (it != known.end()) {
+        return it->second;
+    }
+    uint64_t id = register_format(fmt);
+    known.insert(std::make_pair(fmt, id));
+    return id;
+}
+
+void WTLogClient::_define_format(SendBatch& batch, uint64_t format_id) {
+    if (std::find(batch.formats.begin(), batch.formats.end(), format_id) == batch.formats.end()) {
+        batch.formats.push_back(format_id);
+    }
+    if (_sent_formats.find(format_id) != _sent_formats.end()) {
+        return;
+    }
+    const char* fmt = nullptr;
+    wtatom::lock(_format_lock);
+    auto it = _formats.find(format_id);
+    if (it != _formats.end()) {
+        fmt = it->second;
+    }
+    wtatom::unlock(_format_lock);
+    if (fmt == nullptr) {
+        toscreen << "Unknown format_id: " << format_id << ".\n";
+        return;
+    }
+    _sent_formats.insert(format_id);
+    
+    // [head(16)][format_id(64)][format_size(16)][format].
+    size_t fmt_size = std::min(strlen(fmt), max_log_size);
+    size_t offset = batch.buf.size();
+    batch.buf.resize(offset + 2 + 8 + 2 + fmt_size);
+    char* def = &batch.buf[offset];
+    uint16_t head = htons(h_format_def);
+    memcpy(def, &head, sizeof(uint16_t));
+    memcpy(def + 2, &format_id, sizeof(uint64_t));
+    uint16_t size_sent = htons((uint16_t)fmt_size);
+    memcpy(def + 2 + 8, &size_sent, sizeof(uint16_t));
+    memcpy(def + 2 + 8 + 2, fmt, fmt_size);
+    _add_piece(batch, SendBatch::in_buf, offset, batch.buf.size() - offset);
+    batch.relay = false; // The server keeps the formats.
+}
+
+void WTLogClient::_add_piece(SendBatch& batch, SendBatch::Source source, 
+    size_t index, size_t size, const char* data) {
+    if (batch.pieces.empty() == false) {
+        SendBatch::Piece& last = batch.pieces.back();
+        if (last.source == source && 
+            ((source == SendBatch::in_buf && last.index + last.size == index) || 
+            (source == SendBatch::in_ring && last.data + last.size == data))) {
+            last.size += size;
+            batch.bytes += size;
+            return;
+        }
+    }
+    SendBatch::Piece piece = {source, index, size, data};
+    batch.pieces.push_back(piece);
+    batch.bytes += size;
+}
+
+void WTLogClient::_append_log(SendBatch& batch, PrintRequest& pr) {
+    const size_t copy_max = 1024; // Larger contents are sent from where they are.
+    
+    // Take a request id for the reply, it indexes the callback slot.
+    uint32_t hash_id = 0;
+    bool reply = (pr.callback.empty() == false);
+    if (reply == true && 
+        _callback_fun.insert(pr.callback, &hash_id, _reply_timeout_us) == false) {
+        CallBackInfo cbinfo;
+        cbinfo.status = CallBackStat::failed;
+        cbinfo.message = "Too many logs waitting for reply.";
+        _notify(pr.callback, cbinfo);
+        reply = false;
+    }
+    pr.callback = LogNotify(); // The slot keeps it.
+    if (reply == true) {
+        batch.relay = false;
+    }
+    
+    if ((pr.flags & level_fmt_flag) != 0) {
+        _define_format(batch, *(const uint64_t*)pr.content.data());
+    }
+    
+    size_t offset = batch.buf.size();
+    batch.buf.resize(offset + log_head_size);
+    _encode_head(&batch.buf[offset], (reply == false) ? h_send_log : h_send_log_need_reply, 
+        pr.p_time, pr.level | pr.flags, 
+        hash_id, pr.content.size());
+    _stamp(&batch.buf[offset]);
+    
+    if (debug_mode) {
+        toscreen << "The hash_id: " << hash_id << ", the log length: " << pr.content.size() << ".\n";
+    }
+    
+    // Content.
+    if (pr.content.size() <= copy_max) {
+        batch.buf.insert(batch.buf.end(), pr.content.begin(), pr.content.end());
+        _add_piece(batch, SendBatch::in_buf, offset, batch.buf.size() - offset);
+    } else {
+        _add_piece(batch, SendBatch::in_buf, offset, log_head_size);
+        batch.held.push_back(std::move(pr.content));
+        _add_piece(batch, SendBatch::in_held, batch.held.size() - 1, batch.held.back().size());
+    }
+    
+    if (batch.logs++ == 0) {
+        batch.first_us = wttool::mono_us();
+    }
+}
+
+bool WTLogClient::_flush(SendBatch& batch) {
+    // Number the logs once, they keep the numbers in the spill file.
+    if (batch.sequenced == false) {
+        batch.first_seq = _next_seq;
+        batch.sequenced = true;
+    }
+    if (batch.replay == false) {
+        // A batch kept for space in the spill file may have grown since, number the new logs too.
+        // No other batch is numbered meanwhile, so the numbers stay contiguous.
+        _next_seq = batch.first_seq + batch.logs;
+    }
+    
+    // Tell the server about dropped logs before these logs.
+    if (_online == true && _report_drops() == false) {
+        _link_down();
+    }
+    if (_online == false || (batch.replay == false && _spill.empty() == false)) {
+        // New logs go after the spilled ones.
+        _keep(batch);
+        return false;
+    }
+    
+    // [h_seq_mark(16)][seq(64)], then the frames.
+    uint16_t mark_head = htons(h_seq_mark);
+    memcpy(batch.mark, &mark_head, sizeof(uint16_t));
+    uint64_t seq_sent = htobe64(batch.first_seq);
+    memcpy(batch.mark + 2, &seq_sent, sizeof(uint64_t));
+    batch.iov.resize(batch.pieces.size() + 1);
+    batch.iov[0].iov_base = batch.mark;
+    batch.iov[0].iov_len = sizeof(batch.mark);
+    for (size_t i = 0; i < batch.pieces.size(); ++i) {
+        batch.iov[i + 1].iov_base = const_cast<char*>(_piece_data(batch, batch.pieces[i]));
+        batch.iov[i + 1].iov_len = batch.pieces[i].size;
+    }
+    
+    if (debug_mode) {
+        toscreen << "Start to write " << batch.logs << " logs to TCP buffer.\n";
+    }
+    
+    // Compress the whole batch into one frame.
+    if (_codec != codec_raw && batch.bytes >= compress_min_bytes && batch.bytes <= max_batch_size) {
+        _pack(batch);
+    }
+    
+    wttool::IoStat st = wttool::writev_all(_socket, &batch.iov[0], batch.iov.size(), io_timeout_us);
+    if (st != wttool::io_ok) {
+        // Part of the batch may have been sent, the server discards it when replayed.
+        _link_down();
+        _keep(batch);
+        return false;
+    }
+    
+    if (debug_mode) {
+        toscreen << "Write logs to TCP buffer completely. Totally sent: " << batch.bytes << " bytes.\n";
+    }
+    
+    if (batch.replay == false) {
+        _done.fetch_add(batch.logs, std::memory_order_seq_cst);
+    }
+    _release(batch);
+    return true;
+}
+
+const char* WTLogClient::_piece_data(const SendBatch& batch, const SendBatch::Piece& piece) {
+    if (piece.source == SendBatch::in_held) {
+        return batch.held[piece.index].c_str();
+    } else if (piece.source == SendBatch::in_ring) {
+        return piece.data;
+    }
+    return &batch.buf[piece.index];
+}
+
+void WTLogClient::_gather(SendBatch& batch) {
+    batch.raw.resize(batch.bytes);
+    size_t offset = 0;
+    for (size_t i = 0; i < batch.pieces.size(); ++i) {
+        memcpy(&batch.raw[offset], _piece_data(batch, batch.pieces[i]), batch.pieces[i].size);
+        offset += batch.pieces[i].size;
+    }
+}
+
+void WTLogClient::_keep(SendBatch& batch) {
+    if (batch.replay == false) {
+        _gather(batch);
+        if (_spill.append(batch.first_seq, batch.logs, batch.raw.data(), batch.bytes) == true) {
+            _spill_logs.fetch_add(batch.logs, std::memory_order_seq_cst);
+        } else if (_online == true && _spill.empty() == false) {
+            // Full, wait for _replay to make space.
+            return;
+        } else {
+            _drop_frames(batch.raw.data(), batch.bytes);
+        }
+        _done.fetch_add(batch.logs, std::memory_order_seq_cst);
+    }
+    _release(batch);
+}
+
+void WTLogClient::_drop_frames(const char* frames, size_t size) {
+    size_t pos = 0;
+    while (pos + 2 <= size) {
+        uint16_t head = ntohs(*(const uint16_t*)(frames + pos));
+        if (head == h_format_def) {
+            // [head(16)][format_id(64)][format_size(16)][format].
+            pos += 2 + 8 + 2 + ntohs(*(const uint16_t*)(frames + pos + 2 + 8));
+            continue;
+        }
+        if (head != h_send_log && head != h_send_log_need_reply) {
+            break;
+        }
+        uint16_t level = ntohs(*(const uint16_t*)(frames + pos + 2 + log_level_pos)) & ~level_flags;
+        if (level < log_level_num) {
+            _dropped[level].fetch_add(1, std::memory_order_relaxed);
+            _unreported[level].fetch_add(1, std::memory_order_relaxed);
+        }
+        pos += log_head_size + ntohs(*(const uint16_t*)(frames + pos + 2 + log_size_pos));
+    }
+}
+
+bool WTLogClient::_replay(SendBatch& batch) {
+    SpillFile::Record rec;
+    if (_spill.front(&rec) == false) {
+        return true;
+    }
+    
+    // The server may be a new one, define the formats used again.
+    size_t pos = 0;
+    while (pos < rec.size) {
+        const char* frame = rec.data + pos;
+        uint16_t head = ntohs(*(const uint16_t*)frame);
+        if (head == h_format_def) {
+            pos += 2 + 8 + 2 + ntohs(*(const uint16_t*)(frame + 2 + 8));
+            batch.relay = false;
+            continue;
+        }
+        if (head == h_send_log_need_reply) {
+            batch.relay = false;
+        }
+        uint16_t level = ntohs(*(const uint16_t*)(frame + 2 + log_level_pos));
+        if ((level & level_fmt_flag) != 0) {
+            uint64_t format_id = 0;
+            memcpy(&format_id, frame + log_head_size, sizeof(uint64_t));
+            _define_format(batch, format_id);
+        }
+        pos += log_head_size + ntohs(*(const uint16_t*)(frame + 2 + log_size_pos));
+    }
+    
+    _add_piece(batch, SendBatch::in_ring, 0, rec.size, rec.data);
+    batch.logs = rec.log_num;
+    batch.first_us = wttool::mono_us();
+    batch.first_seq = rec.first_seq;
+    batch.sequenced = true;
+    batch.replay = true;
+    if (_flush(batch) == false) {
+        return false;
+    }
+    _spill_logs.fetch_sub(rec.log_num, std::memory_order_seq_cst);
+    _spill.pop();
+    return true;
+}
+
+bool WTLogClient::_pack(SendBatch& batch) {
+    if (batch.formats.size() > UINT16_MAX) {
+        return false;
+    }
+    _gather(batch);
+    
+    // [head(16)][codec(8)][flags(8)][format_num(16)][log_num(32)][raw_size(32)][packed_size(32)][format_ids][packed].
+    size_t front = 2 + batch_meta_size + batch.formats.size() * sizeof(uint64_t);
+    batch.packed.resize(front + compress_bound(_codec, batch.bytes));
+    size_t packed_size = compress_block(_codec, &batch.raw[0], batch.bytes, 
+        &batch.packed[front], batch.packed.size() - front);
+    if (packed_size == 0 || front + packed_size >= batch.bytes) {
+        return false;
+    }
+    char* frame = &batch.packed[0];
+    uint16_t head = htons(h_send_batch);
+    memcpy(frame, &head, sizeof(uint16_t));
+    frame[2] = (char)_codec;
+    frame[3] = (char)(batch.relay ? batch_relay : 0);
+    uint16_t format_num = htons((uint16_t)batch.formats.size());
+    memcpy(frame + 4, &format_num, sizeof(uint16_t));
+    uint32_t log_num = htonl((uint32_t)batch.logs);
+    memcpy(frame + 6, &log_num, sizeof(uint32_t));
+    uint32_t raw_size = htonl((uint32_t)batch.bytes);
+    memcpy(frame + 10, &raw_size, sizeof(uint32_t));
+    uint32_t packed_size_sent = htonl((uint32_t)packed_size);
+    memcpy(frame + 14, &packed_size_sent, sizeof(uint32_t));
+    if (batch.formats.empty() == false) {
+        memcpy(frame + 2 + batch_meta_size, &batch.formats[0], batch.formats.size() * sizeof(uint64_t));
+    }
+    
+    batch.iov.resize(2); // After the h_seq_mark.
+    batch.iov[1].iov_base = frame;
+    batch.iov[1].iov_len = front + packed_size;
+    
+    if (debug_mode) {
+        toscreen << "Compressed " << batch.logs << " logs from " << batch.bytes 
+            << " to " << front + packed_size << " bytes.\n";
+    }
+    return true;
+}
+
+void WTLogClient::_release(SendBatch& batch) {
+    for (size_t i = 0; i < batch.rings.size(); ++i) {
+        StagingRing* ring = batch.rings[i].get();
+        ring->head.store(ring->read, std::memory_order_release);
+        ring->in_batch = false;
+    }
+    batch.rings.clear();
+    batch.buf.clear();
+    batch.held.clear();
+    batch.pieces.clear();
+    batch.formats.clear();
+    batch.bytes = 0;
+    batch.logs = 0;
+    batch.ring_full = false;
+    batch.relay = true;
+    batch.sequenced = false;
+    batch.replay = false;
+}
+
 void* WTLogClient::_monitor_return(void* args) {
     WTLogClient* client = (WTLogClient*)args;
     char buffer[10240];
+    wttool::BufferedConn conn(client->_socket);
     while (client->_connected == true || client->_callback_fun.size() != 0) {
-        // Read the head.
+        // Read the head. Wake up sometimes to check whether to quit.
         uint16_t head;
-        wttool::safe_read(client->_socket, &head, sizeof(uint16_t));
+        wttool::IoStat st = conn.read(&head, sizeof(uint16_t), 2e5);
+        if (st == wttool::io_timeout) {
+            continue;
+        }
+        if (st != wttool::io_ok) {
+            // Closed by disconnect, or lost the server. Callbacks waitting will time out.
+            client->_link_lost = true;
+            break;
+        }
         head = ntohs(head);
         switch(head) {
             case h_close_ret : {
@@ -247,12 +1495,19 @@ void* WTLogClient::_monitor_return(void* args) {
                     toscreen << "Found a log reply.\n";
                 }
                 
-                // Read hash_id, find the callback function.
-                uint32_t hash_id;
-                wttool::safe_read(client->_socket, &hash_id, sizeof(uint32_t));
-                hash_id = ntohl(hash_id);
-                void (*back_fun)(const CallBackInfo&) = nullptr;
-                if (client->_callback_fun.find_and_remove(hash_id, &back_fun) == false) {
+                // Read the reply, find the callback function.
+                if (conn.peek(buffer, 4 + 2, io_timeout_us) != wttool::io_ok) {
+                    client->_link_lost = true;
+                    pthread_exit(nullptr);
+                }
+                uint16_t message_length = ntohs(*(uint16_t*)(buffer + 4));
+                if (conn.read(buffer, 4 + 2 + message_length, io_timeout_us) != wttool::io_ok) {
+                    client->_link_lost = true;
+                    pthread_exit(nullptr);
+                }
+                uint32_t hash_id = ntohl(*(uint32_t*)buffer);
+                LogNotify back;
+                if (client->_callback_fun.find_and_remove(hash_id, &back) == false) {
                     // No such hash_id waitting for callback.
                 }
                 
@@ -264,26 +1519,39 @@ void* WTLogClient::_monitor_return(void* args) {
                 CallBackInfo cbinfo;
                 cbinfo.status = CallBackStat::success;
                 
-                // Read the message and save the message to CallBackInfo.
-                uint16_t message_length;
-                wttool::safe_read(client->_socket, &message_length, sizeof(uint16_t));
-                message_length = ntohs(message_length);
+                // Save the message to CallBackInfo.
                 if (message_length != 0) {
-                    wttool::safe_read(client->_socket, buffer, message_length);
-                    cbinfo.message = string(buffer, message_length);
+                    cbinfo.message = string(buffer + 4 + 2, message_length);
                 }
                 
                 if (debug_mode) {
                     toscreen << "The reply message length: " << message_length << ".\n";
                 }
                 
-                // Call the callback function.
-                if (back_fun != nullptr) {
-                    back_fun(cbinfo);
-                }
+                // Call the callback function, or set the result.
+                client->_notify(back, cbinfo);
 
                 break;
             }
+            case h_set_level : {
+                // The log server changes the min level.
+                uint16_t level = 0;
+                if (conn.read(&level, sizeof(uint16_t), io_timeout_us) != wttool::io_ok) {
+                    client->_link_lost = true;
+                    pthread_exit(nullptr);
+                }
+                level = ntohs(level);
+                if (level >= log_level_num) {
+                    toscreen << "Unsupported level from server: " << level << ".\n";
+                    break;
+                }
+                client->set_min_level((LogLevel)level);
+                
+                if (debug_mode) {
+                    toscreen << "Log server set the min level: " << level << ".\n";
+                }
+                break;
+            }
             default : {
                 toscreen << "Undefined reply head from server: " << head << ".\n";
                 break;
@@ -14,9 +14,33 @@
 #include <arpa/inet.h>
 #include <cstring>
 #include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <endian.h>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 #include "wtatomqueue.hpp"
 #include "netprotocol.h"
 #include "wtlogtools.h"
+#include "wtexpiremap.h"
+#include "wtsnapshotmap.h"
+#include "wtlogsocket.h"
+#include "wtlogformat.h"
+#include "wtlogfields.h"
+#include "wtclock.h"
+#include "wtlogcodec.h"
+#include "wtspill.h"
+#include "wtlimit.h"
+#include "wtlogfuture.h"
+
+/**
+ * Logs below this level are removed at compile time by WTLOG and WTLOG_FMT,
+ * e.g. -DWTLOG_MIN_LEVEL=wtlog::LogLevel::warning.
+ */
+#ifndef WTLOG_MIN_LEVEL
+#define WTLOG_MIN_LEVEL wtlog::LogLevel::debug
+#endif
 
 using std::string;
 
@@ -33,39 +57,124 @@ private:
     string _info;
 };
 
+/**
+ * What tolog does when the print queue reaches its limit.
+ */
+enum OverloadPolicy {
+    block = 0,        // Wait until there is space. Drop the new log after timeout.
+    drop_newest = 1,  // Drop the new log.
+    drop_oldest = 2,  // Drop the oldest logs in the queue to make space.
+    drop_by_level = 3 // Drop debug and info logs. Warning and error logs wait like block.
+};
+
 class WTLogClient {
 private:
     struct PrintRequest {
-        PrintRequest() {}
-        PrintRequest(const PrintRequest& in) : 
-            p_time(in.p_time), content(in.content), level(in.level), callback(in.callback) {}
-        PrintRequest(const string& c_in, 
-            uint32_t t_in, 
+        PrintRequest() : flags(0) {}
+        PrintRequest(string c_in, 
+            uint64_t t_in, 
             LogLevel l_in, 
-            void (*ca_in)(const CallBackInfo&)) : 
-            p_time(t_in), content(c_in), 
-            level(l_in), callback(ca_in) {}
-        PrintRequest& operator=(const PrintRequest& in) {
-            content = in.content;
-            p_time = in.p_time;
-            level = in.level;
-            callback = in.callback;
-        }
+            LogNotify ca_in, 
+            uint16_t f_in = 0) : 
+            p_time(t_in), content(std::move(c_in)), 
+            level(l_in), callback(ca_in), flags(f_in) {}
         
-        uint32_t p_time; // Time of the log. Prevent time lap of different machine and network delay.
+        uint64_t p_time; // Ticks when the log is made, converted to ns when sent. Prevent time lap of different machine and network delay.
         string content; // Content can be binary data. If it is string, last '\0' won't be sent.
         LogLevel level;
-        void (*callback)(const CallBackInfo&);
+        LogNotify callback;
+        uint16_t flags; // Bits of level_flags sent with the level, they tell how the content is encoded.
+    };
+    
+    /**
+     * A callback function to be run by _run_callbacks.
+     */
+    struct CallbackTask {
+        CallbackTask() : fn(nullptr) {}
+        CallbackTask(void (*f_in)(const CallBackInfo&), const CallBackInfo& i_in) : fn(f_in), info(i_in) {}
+        
+        void (*fn)(const CallBackInfo&);
+        CallBackInfo info;
+    };
+    
+    /**
+     * Encoded frames of one thread calling tolog. The thread reserves and commits frames,
+     * _handle_print_queue sends them from where they are, then releases the space.
+     * Frames don't wrap. If a frame doesn't fit before the end, it starts from the beginning,
+     * and the space left is marked by a zero head, or skipped if shorter than log_head_size.
+     * It is shared by the thread and the client, either may go first.
+     */
+    struct StagingRing {
+        StagingRing(size_t capacity);
+        ~StagingRing();
+        
+        /**
+         * Reserve space for a frame. Only the owner thread calls it.
+         * @return nullptr: Not enough space, wait for _handle_print_queue.
+         */
+        char* reserve(size_t frame_size);
+        
+        char* buf;
+        size_t capacity; // Power of 2.
+        
+        // Written by the owner thread.
+        char _pad0[wtatom::cache_line_size];
+        uint64_t reserved;    // End of the reserved space.
+        uint64_t committed;   // End of the committed frames.
+        uint64_t unpublished; // Frames committed but not published.
+        uint64_t head_cache;  // Last seen head.
+        std::atomic<uint64_t> tail;   // End of the published frames.
+        std::atomic<uint64_t> pushed; // Frames published since created.
+        std::atomic<bool> orphaned;   // The owner thread exited, no more frames.
+        
+        // Written by _handle_print_queue.
+        char _pad1[wtatom::cache_line_size];
+        uint64_t read;    // End of the frames taken into the batch.
+        bool in_batch;    // Some frames are in the batch.
+        std::atomic<uint64_t> head; // End of the released space.
+        char _pad2[wtatom::cache_line_size];
+    };
+    
+    /**
+     * Rings of the current thread, one for each client it logged to.
+     * Marks them orphaned when the thread exits.
+     */
+    struct ThreadStaging {
+        ~ThreadStaging() {
+            for (size_t i = 0; i < rings.size(); ++i) {
+                rings[i].second->orphaned.store(true, std::memory_order_release);
+            }
+        }
+        
+        std::vector<std::pair<uint64_t, std::shared_ptr<StagingRing> > > rings; // Key is the client id.
     };
 
 public:
     friend class wtatom::AtomQueue<PrintRequest>;
+    friend class wtatom::AtomQueue<CallbackTask, wtatom::Producers::Multi, wtatom::Consumers::Multi>;
+    
+    /**
+     * Space of a log given by reserve. Write the content to data, then commit it.
+     */
+    struct LogSpan {
+        LogSpan() : data(nullptr), size(0), _ring(nullptr), _request(nullptr) {}
+        
+        char* data;  // nullptr means the log is dropped, commit does nothing.
+        size_t size; // Size of the content.
+        StagingRing* _ring;     // Where the frame is reserved.
+        PrintRequest* _request; // Or the log waitting for the queue limit.
+    };
 
     /**
      * Construction function.
      */
     WTLogClient();
     
+    /**
+     * Destruction function.
+     */
+    ~WTLogClient();
+    
     /**
      * Initialize. Connect the target router server.
      * @return true: You can start to print log.
@@ -76,11 +185,14 @@ public:
     /**
      * Stop to use this client. 
      * It will wait for all requests in queue, and then disconnect with the log server.
+     * Spilled logs wait for the server to come back, at most spill_drain_timeout_us.
      */
     void disconnect();
     
     /**
      * Send the log to log server.
+     * Without queue limit, the log is appended to a ring owned by the calling thread,
+     * threads never contend with each other. It waits only if the ring is full.
      * @param content: The string to be printed in log.
      * @param level: The log level.
      * @param callback: If you want to check the return of 
@@ -89,18 +201,595 @@ public:
     void tolog(const string& content, 
         LogLevel level = LogLevel::info, 
         void (*callback)(const CallBackInfo&) = nullptr);
+    
+    /**
+     * Same as above, but the content is moved instead of copied.
+     */
+    void tolog(string&& content, 
+        LogLevel level = LogLevel::info, 
+        void (*callback)(const CallBackInfo&) = nullptr);
+    
+    /**
+     * Same as above, without building a string.
+     */
+    void tolog(const char* content, 
+        LogLevel level = LogLevel::info, 
+        void (*callback)(const CallBackInfo&) = nullptr);
+    
+#if __cplusplus >= 201703L
+    void tolog(std::string_view content, 
+        LogLevel level = LogLevel::info, 
+        void (*callback)(const CallBackInfo&) = nullptr);
+#endif
+    
+    /**
+     * Send the logs in [first, last). The elements need data() and size(), e.g. string.
+     * Threads waitting for logs are waken up once.
+     */
+    template <typename Iter>
+    void tolog_many(Iter first, Iter last, LogLevel level = LogLevel::info);
+    
+    /**
+     * Send a log limited by its key, e.g. a user id or format_id("request failed").
+     * Keys are hashed into key_limit_slots limiters, keys sharing one share its rate.
+     * See set_key_rate_limit.
+     */
+    void tolog_keyed(uint64_t key, const string& content, 
+        LogLevel level = LogLevel::info, 
+        void (*callback)(const CallBackInfo&) = nullptr);
+    
+    /**
+     * Send a log after suppressed ones, e.g. by your own limiter. The count is shown with the log.
+     * WTLOG_RATE uses it.
+     */
+    void tolog_after_suppressed(uint32_t suppressed, const string& content, 
+        LogLevel level = LogLevel::info, 
+        void (*callback)(const CallBackInfo&) = nullptr);
+    
+    /**
+     * Send a log, its result is given by the future instead of a callback function.
+     * The future gets ready when the lander has written the log, or the log failed or timed out.
+     * Nothing runs on the threads of the client, the caller waits or checks ready().
+     */
+    LogFuture tolog_async(const string& content, LogLevel level = LogLevel::info);
+    
+    /**
+     * Send a log, its result is pushed to the completion ring with the tag, see set_completion_ring.
+     * The tag tells the application which log it is, e.g. a request id or a pointer.
+     */
+    void tolog_tagged(uint64_t tag, const string& content, LogLevel level = LogLevel::info);
+    
+    /**
+     * Send a log formatted by the lander, e.g. tolog_fmt(LogLevel::info, "id: %d, name: %s", id, name).
+     * Only the arguments are copied, the format string is sent once per connection.
+     * Arguments can be integers, enums, floating numbers, pointers, C strings and strings.
+     * The format is found by its address, prefer WTLOG_FMT which keeps the id in the call site.
+     */
+    template <typename... Args>
+    void tolog_fmt(LogLevel level, const char* fmt, const Args&... args);
+    
+    /**
+     * Same as above, the format is given by the id from register_format.
+     */
+    template <typename... Args>
+    void tolog_fmt(LogLevel level, uint64_t format_id, const Args&... args);
+    
+    /**
+     * Send a message with typed fields, e.g. tolog_fields(LogLevel::info, "login", {{"user", id}, {"latency_us", 123}}).
+     * Fields are int64, double, bool or string. They are encoded in binary, nothing is formatted,
+     * the lander keeps them for filtering, see FieldFilter.
+     * Keys and string values are copied before it returns. At most max_field_num fields are sent.
+     */
+    void tolog_fields(LogLevel level, const char* msg, std::initializer_list<LogField> fields, 
+        void (*callback)(const CallBackInfo&) = nullptr);
+    
+    void tolog_fields(LogLevel level, const string& msg, std::initializer_list<LogField> fields, 
+        void (*callback)(const CallBackInfo&) = nullptr);
+    
+    /**
+     * Remember a format for tolog_fmt. The format must live as long as the clients.
+     * @return The format_id, same for the same string.
+     */
+    static uint64_t register_format(const char* fmt);
+    
+    /**
+     * Reserve a log of size bytes, the content is written in place.
+     * Without queue limit, data points to the frame to be sent, no memory is allocated.
+     * The log is not sent until commit. A thread can have only one reservation of a client.
+     * @return data == nullptr: The log is dropped by the queue limit, or longer than max_log_size.
+     */
+    LogSpan reserve(size_t size, 
+        LogLevel level = LogLevel::info, 
+        void (*callback)(const CallBackInfo&) = nullptr);
+    
+    /**
+     * Send the log reserved. The span is reset.
+     */
+    void commit(LogSpan& span);
+    
+    /**
+     * Limit the logs waitting in the print queue. Unlimited by default.
+     * Limits are checked before pushing, concurrent callers may exceed them slightly.
+     * Limited logs share one queue instead of the rings of each thread.
+     * A dropped log calls its callback with CallBackStat::failed.
+     * @param max_logs: Max number of logs. 0 means unlimited.
+     * @param max_bytes: Max total content size. 0 means unlimited.
+     * @param policy: What to do when the limit is reached.
+     * @param block_timeout_us: Max waitting time of OverloadPolicy::block and drop_by_level.
+     */
+    void set_queue_limit(size_t max_logs, size_t max_bytes, 
+        OverloadPolicy policy = OverloadPolicy::block, 
+        int64_t block_timeout_us = 1e5);
+    
+    /**
+     * Set how logs are coalesced before sending, many logs are sent by one syscall.
+     * The batch is sent when it reaches max_bytes, or when its first log has waited linger_us.
+     * Default is 64KB and 1ms.
+     * @param linger_us: 0 means send as soon as the print queue is empty.
+     */
+    void set_batch(size_t max_bytes, int64_t linger_us);
+    
+    /**
+     * Set how batches are compressed. Default is default_codec(), codec_raw if no codec is compiled in.
+     * A batch is sent uncompressed if it is small or doesn't get smaller.
+     * @return false: The codec is not compiled in, nothing changed.
+     */
+    bool set_compression(Codec codec);
+    
+    /**
+     * Keep logs in a local file while the log server is unreachable, they are sent in order
+     * after reconnecting. Without it such logs are dropped. Call it before connect.
+     * @param path: The file is created or truncated, and mapped to memory.
+     * @param max_bytes: Size of the file. Logs are dropped when it is full.
+     * @return false: The file can't be created.
+     */
+    bool set_spill(const string& path, size_t max_bytes);
+    
+    /**
+     * Limit the rate of logs of the level, by a token bucket. Unlimited by default.
+     * Suppressed logs are counted, the count is sent with the next log of the level.
+     * A suppressed log calls its callback with CallBackStat::failed.
+     * @param logs_per_sec: 0 means unlimited.
+     * @param burst: Logs allowed at once after being idle.
+     */
+    void set_rate_limit(LogLevel level, double logs_per_sec, double burst);
+    
+    /**
+     * Keep one of every one_in_n logs of the level, meant for debug and info. 
+     * Sampling comes before the rate limit. Suppressed logs are counted as set_rate_limit.
+     * @param one_in_n: 1 keeps all logs, the default.
+     * @param random: If true each log is kept with probability 1 / one_in_n, 
+     *      otherwise exactly every one_in_n-th.
+     */
+    void set_sampling(LogLevel level, uint32_t one_in_n, bool random = false);
+    
+    /**
+     * Limit the rate of each key of tolog_keyed. Unlimited by default.
+     * Same parameters as set_rate_limit.
+     */
+    void set_key_rate_limit(double logs_per_sec, double burst);
+    
+    /**
+     * Create the ring of results of tolog_tagged. Call it before connect.
+     * Results are pushed without lock and never wait, they are lost if the ring is full.
+     * @param capacity: Max results waitting to be polled, rounded up to a power of 2.
+     */
+    void set_completion_ring(size_t capacity);
+    
+    /**
+     * Take at most max results from the completion ring. Only one thread polls at a time.
+     * @param out: Array with at least max elements.
+     * @param timeout_us: Max waitting time if the ring is empty. 0 means return at once.
+     * @return The number of results written to out.
+     */
+    size_t poll_completions(LogCompletion* out, size_t max, int64_t timeout_us = 0);
+    
+    /**
+     * Number of results of tolog_tagged lost, because the ring was full or not created.
+     */
+    uint64_t completions_lost();
+    
+    /**
+     * Run callback functions on num threads, instead of the thread reading replies from the socket.
+     * A slow callback then doesn't delay the replies of other logs. Call it before connect.
+     * 0, the default, runs them where the result is known. Futures and the completion ring don't need it.
+     */
+    void set_callback_threads(size_t num);
+    
+    /**
+     * Set how long a callback waits for the reply of its log.
+     * After that the callback is called with CallBackStat::timeout.
+     * Only affects logs sent later. Default is reply_timeout_us.
+     */
+    void set_reply_timeout(int64_t timeout_us);
+    
+    /**
+     * Don't send logs below min_level, tolog discards them. Default is LogLevel::debug.
+     * The log server may change it at any time, e.g. turn off debug logs of all clients.
+     */
+    void set_min_level(LogLevel min_level);
+    
+    /**
+     * Whether logs of the level are sent. WTLOG checks it before evaluating the content.
+     */
+    bool level_enabled(LogLevel level) const {
+        return level_rank(level) >= _min_rank.load(std::memory_order_relaxed);
+    }
+    
+    /**
+     * Number of logs dropped by the queue limit since connected.
+     * It is also reported to the log server before the next log.
+     */
+    uint64_t dropped(LogLevel level);
+    
+    /**
+     * Number of logs suppressed by the rate limits and sampling since created.
+     * Logs suppressed by WTLOG_RATE are only counted in the log sent after them.
+     */
+    uint64_t suppressed(LogLevel level);
 
 private:
+    /**
+     * Logs taken but not written to the socket yet.
+     * Frames in the rings are sent from the rings. For logs from the print queue,
+     * heads and small contents are copied into buf, a large content is sent from held.
+     */
+    struct SendBatch {
+        enum Source {
+            in_buf = 0,  // index is the offset in buf.
+            in_held = 1, // index is in held.
+            in_ring = 2  // data points to a ring, or the spill file.
+        };
+        struct Piece {
+            Source source;
+            size_t index;
+            size_t size;
+            const char* data;
+        };
+        
+        SendBatch() : bytes(0), logs(0), first_us(0), ring_full(false), relay(true), 
+            first_seq(0), sequenced(false), replay(false) {}
+        
+        std::vector<char> buf;
+        std::vector<string> held;
+        std::vector<std::shared_ptr<StagingRing> > rings; // Rings released after sending.
+        std::vector<Piece> pieces; // Pieces to be sent in order.
+        std::vector<iovec> iov;
+        std::vector<uint64_t> formats; // Formats used by the logs.
+        std::vector<char> raw;    // Pieces gathered for compression.
+        std::vector<char> packed; // The compressed batch frame.
+        size_t bytes;     // Total size of the pieces.
+        size_t logs;      // Number of logs.
+        int64_t first_us; // When the first log was added.
+        bool ring_full;   // A ring is half occupied by the batch, send it soon.
+        bool relay;       // No log needs reply and no format is defined, the server relays it as is.
+        uint64_t first_seq; // Sequence number of the first log.
+        bool sequenced;   // first_seq is assigned, it is kept when the batch is spilled.
+        bool replay;      // The logs are a record of the spill file.
+        char mark[2 + sizeof(uint64_t)]; // The h_seq_mark frame sent before the batch.
+    };
+    
+
     bool          _connected; // If true, this class is connected to log server.
     sockaddr_in   _svr_addr; // The address of the log server. Used for reconnecting by unexpected disconnection.
-    int           _socket; // Socket with the log server.
+    int           _socket; // Socket with the log server. -1 when closed by _handle_print_queue.
+    std::atomic<bool> _online;    // The socket works. When false, _handle_print_queue spills logs and reconnects.
+    std::atomic<bool> _link_lost; // _monitor_return found the socket broken.
+    int64_t       _retry_us;   // When to reconnect next time. Only _handle_print_queue uses it.
+    int64_t       _backoff_us; // Wait before the next reconnecting, doubled after each failure.
+    uint64_t      _session;    // Random id sent in each connection, the server discards the logs seen by it.
+    uint64_t      _next_seq;   // Sequence number of the next log flushed. Only _handle_print_queue uses it.
+    SpillFile     _spill;      // Logs flushed while offline, in order. Only _handle_print_queue uses it after connect.
+    std::atomic<uint64_t> _spill_logs; // Logs in _spill.
     pthread_t     _hpq_t; // Thread number of _handle_print_queue.
     pthread_t     _mr_t; // Thread number of _monitor_return.
     
-    wtatom::AtomQueue<PrintRequest> _print_queue; // Infos in this queue are to be sent to log server.
-    wtatom::AtomMap<uint32_t, void (*)(const CallBackInfo&)> _callback_fun; // The callback functions waitting to be called.
+    uint64_t      _id; // Unique among clients, the key of the rings in ThreadStaging.
+    wtatom::AtomQueue<PrintRequest> _print_queue; // Logs admitted by the queue limit, to be sent to log server.
+    wtatom::SnapshotMap<uint64_t, std::shared_ptr<StagingRing> > _staging; // Rings of the threads calling tolog. Key is the order of creation.
+    std::atomic<uint64_t> _ring_num;   // Rings ever created.
+    std::atomic<bool>     _sender_parked; // _handle_print_queue is waitting for _wakeup.
+    wtatom::AtomQueue<char, wtatom::Producers::Multi, wtatom::Consumers::Single> 
+                          _wakeup;     // Pushed by tolog to wake up _handle_print_queue.
+    wtatom::ExpireSlab<LogNotify> _callback_fun; // Where the results of logs waitting for reply go. Key is the hash_id.
+    int64_t       _reply_timeout_us; // Life of an element in _callback_fun.
+    std::unique_ptr<wtatom::AtomQueue<LogCompletion, wtatom::Producers::Multi, wtatom::Consumers::Single> > 
+                          _completions;      // Results of tolog_tagged, polled by the application.
+    std::atomic<uint64_t> _completions_lost; // Results not pushed to _completions.
+    wtatom::AtomQueue<CallbackTask, wtatom::Producers::Multi, wtatom::Consumers::Multi> 
+                          _callback_tasks;   // Callback functions waitting for _run_callbacks.
+    std::vector<pthread_t> _callback_t;      // Thread numbers of _run_callbacks.
+    size_t                _callback_thread_num; // Threads started by connect.
+    std::atomic<bool>     _callbacks_async;  // Callback functions go to _callback_tasks.
+    
+    size_t                _max_logs;     // Limit of _print_queue size. 0 means unlimited.
+    size_t                _max_bytes;    // Limit of _queued_bytes. 0 means unlimited.
+    OverloadPolicy        _policy;       // What to do when reaching the limit.
+    int64_t               _block_timeout_us; // Max waitting time of blocking policies.
+    std::atomic<size_t>   _queued_bytes; // Total content size in _print_queue.
+    std::atomic<uint32_t> _admit_waiters; // Producers parked in _admit.
+    pthread_mutex_t       _admit_lock;
+    pthread_cond_t        _admit_cond;   // Signaled when _handle_print_queue takes logs from _print_queue.
+    std::atomic<uint64_t> _dropped[log_level_num];  // Dropped logs of each level.
+    std::atomic<uint32_t> _unreported[log_level_num]; // Dropped logs not yet reported to server.
+    
+    std::atomic<uint16_t> _min_rank;     // level_rank of the min level sent.
+    
+    std::atomic<bool>     _throttling;   // Some rate limit or sampling is set.
+    RateLimiter           _level_limits[log_level_num]; // Rate limit of each level.
+    Sampler               _samplers[log_level_num];     // Sampling of each level.
+    RateLimiter           _key_limits[key_limit_slots]; // Rate limits of tolog_keyed, by the hash of the key.
+    std::atomic<uint64_t> _suppressed[log_level_num];   // Logs suppressed of each level.
+    
+    Codec                 _codec;       // Codec of batches. codec_raw sends them uncompressed.
+    wttool::TickClock     _clock;       // Converts the ticks of logs to ns. Only _handle_print_queue uses it.
+    
+    size_t                _batch_bytes; // Send the batch when it reaches this size.
+    int64_t               _linger_us;   // Max waitting time of a log in the batch.
+    
+    /**
+     * Logs accepted but not written or dropped yet are the pushed ones minus _done.
+     * Only _handle_print_queue writes _done and _retired_pushed.
+     */
+    std::atomic<uint64_t> _shared_pushed;  // Logs pushed to _print_queue, minus the ones dropped from it.
+    std::atomic<uint64_t> _retired_pushed; // Logs pushed to the rings removed from _staging.
+    std::atomic<uint64_t> _done;           // Logs written or ignored by _handle_print_queue.
+    
+    static std::atomic<uint64_t> _client_num; // Clients ever created.
+    
+    std::unordered_set<uint64_t> _sent_formats; // Formats sent in this connection. Only _handle_print_queue uses it.
+    static pthread_mutex_t _format_lock;
+    static std::unordered_map<uint64_t, const char*> _formats; // All formats registered. Key is the format_id.
     
 private:
+    /**
+     * Check the queue limit before pushing a log, apply the overload policy.
+     * @return false: The new log should be dropped.
+     */
+    bool _admit(LogLevel level, size_t bytes);
+    
+    /**
+     * Whether pushing a log of bytes size will exceed the queue limit.
+     */
+    bool _over_limit(size_t bytes);
+    
+    /**
+     * Count a dropped log, tell its callback.
+     */
+    void _drop(LogLevel level, const LogNotify& callback);
+    
+    /**
+     * Discard a log below the min level, tell its callback.
+     * @return true: The log is discarded.
+     */
+    bool _filtered(LogLevel level, const LogNotify& callback);
+    
+    /**
+     * Apply the sampling and rate limit of the level.
+     * @param count: In: logs suppressed before this one elsewhere. 
+     *      Out: logs suppressed before this one, to be sent with it.
+     * @return true: The log is suppressed, its callback is told, count is kept by the limiter.
+     */
+    bool _throttled(LogLevel level, const LogNotify& callback, uint32_t* count);
+    
+    /**
+     * Count a log suppressed, tell its callback.
+     */
+    void _suppress(LogLevel level, const LogNotify& callback);
+    
+    /**
+     * Give the result of a log to where it goes. Callback functions go to the callback threads if started.
+     */
+    void _notify(const LogNotify& notify, const CallBackInfo& cbinfo);
+    
+    /**
+     * Start the callback threads.
+     * @return false: Failed to create a thread, none is left running.
+     */
+    bool _start_callbacks();
+    
+    /**
+     * Stop the callback threads after running the callbacks waitting.
+     */
+    void _stop_callbacks();
+    
+    /**
+     * Send the drop counters to log server if they changed since last report.
+     * @return false: Write to socket failed.
+     */
+    bool _report_drops();
+
+    /**
+     * Push a log admitted by the queue limit to _print_queue.
+     */
+    void _push_shared(PrintRequest&& pr);
+    
+    /**
+     * Get the ring of the calling thread, create it at the first time.
+     */
+    StagingRing* _thread_ring();
+    
+    /**
+     * Reserve a log, the head is written.
+     * Frames committed but not published are published before waitting for space.
+     * @param flags: level_fmt_flag or level_fields_flag if the content is encoded so, otherwise 0.
+     * @param suppressed: Logs suppressed before this one elsewhere, e.g. by the key limit.
+     */
+    LogSpan _reserve(size_t size, LogLevel level, 
+        const LogNotify& callback, uint16_t flags = 0, uint32_t suppressed = 0);
+    
+    /**
+     * Commit the log reserved.
+     * @param publish: If false, the frame is not visible until _publish.
+     */
+    void _commit(LogSpan& span, bool publish);
+    
+    /**
+     * Make the committed frames visible to _handle_print_queue.
+     */
+    void _publish(StagingRing* ring);
+    
+    /**
+     * Reserve and commit a copy of the content.
+     */
+    void _log_bytes(const char* content, size_t size, 
+        LogLevel level, const LogNotify& callback, uint32_t suppressed = 0);
+    
+    /**
+     * Reserve and commit a structured log.
+     */
+    void _log_fields(LogLevel level, const char* msg, size_t msg_size, 
+        std::initializer_list<LogField> fields, const LogNotify& callback);
+    
+    /**
+     * Wake up _handle_print_queue if it is waitting for logs.
+     */
+    void _wake_sender();
+    
+    /**
+     * Wake up the producers parked in _admit, after the queue is lowered.
+     */
+    void _wake_admitted();
+    
+    /**
+     * Add the published frames of the rings to the batch, starting from the ring after
+     * the last visited one, until the batch reaches _batch_bytes. Remove the released
+     * rings of exited threads.
+     * Only _handle_print_queue calls it.
+     * @param next_ring: Where to start, updated for the next call.
+     * @return The number of logs added.
+     */
+    size_t _take_frames(SendBatch& batch, uint64_t& next_ring);
+    
+    /**
+     * Whether some frame is published but not taken, or _print_queue is not empty.
+     */
+    bool _has_logs();
+    
+    /**
+     * Wait at most timeout_us until tolog pushes a log.
+     */
+    void _wait_logs(int64_t timeout_us);
+    
+    /**
+     * Number of logs accepted but not written or dropped yet.
+     */
+    uint64_t _pending();
+    
+    /**
+     * Drop all logs waitting to be sent, without callback.
+     * Only _handle_print_queue calls it.
+     */
+    void _discard_logs();
+    
+    /**
+     * Find the format_id of a format by its address, register it at the first time.
+     */
+    static uint64_t _intern_format(const char* fmt);
+    
+    /**
+     * Remember the batch uses a format. Add its definition to the batch, if not sent in this connection.
+     * Only _handle_print_queue calls it.
+     */
+    void _define_format(SendBatch& batch, uint64_t format_id);
+    
+    /**
+     * Write the head of a log frame.
+     * @param p_time: Ticks of the log, kept in the frame until _stamp.
+     * @param level: The LogLevel, with the level_flags of the content.
+     */
+    static void _encode_head(char* frame, uint16_t head, uint64_t p_time, 
+        uint16_t level, uint32_t hash_id, size_t size);
+    
+    /**
+     * Convert the ticks in a frame to the time sent, in ns.
+     * Only _handle_print_queue calls it, once for each frame.
+     */
+    void _stamp(char* frame);
+    
+    /**
+     * Add a piece to the batch, merged with the last one if contiguous.
+     */
+    static void _add_piece(SendBatch& batch, SendBatch::Source source, 
+        size_t index, size_t size, const char* data = nullptr);
+
+    /**
+     * Encode a log and add it to the batch. The content may be moved into the batch.
+     */
+    void _append_log(SendBatch& batch, PrintRequest& pr);
+    
+    /**
+     * Write the batch with one writev after its h_seq_mark, release the space of the rings, then empty it.
+     * If offline, or older logs are in the spill file, the batch is kept by _keep.
+     * @return false: Not written, the batch is kept.
+     */
+    bool _flush(SendBatch& batch);
+    
+    /**
+     * Compress the pieces of the batch into one frame, the iov is replaced by it.
+     * @return false: It doesn't get smaller, the iov is kept.
+     */
+    bool _pack(SendBatch& batch);
+    
+    /**
+     * Release the space of the rings in the batch, then empty it.
+     */
+    void _release(SendBatch& batch);
+    
+    /**
+     * Call the callbacks whose reply is too late with CallBackStat::timeout.
+     */
+    void _expire_callbacks();
+
+    /**
+     * Keep a batch which is not sent, empty it. Its logs go to the spill file, or are dropped.
+     * A replayed batch is only emptied, its record stays in the spill file.
+     * If the spill is full while older logs in it are being sent, the batch is left to wait.
+     */
+    void _keep(SendBatch& batch);
+    
+    /**
+     * Where the bytes of a piece are.
+     */
+    static const char* _piece_data(const SendBatch& batch, const SendBatch::Piece& piece);
+    
+    /**
+     * Copy the pieces of the batch into batch.raw.
+     */
+    static void _gather(SendBatch& batch);
+    
+    /**
+     * Count the logs in the frames as dropped.
+     */
+    void _drop_frames(const char* frames, size_t size);
+    
+    /**
+     * Send the oldest record of the spill file, remove it if written.
+     * @return false: Write to socket failed.
+     */
+    bool _replay(SendBatch& batch);
+    
+    /**
+     * Connect to _svr_addr, handshake and tell the session. _socket is set if succeeded.
+     * @param timeout_us: Max time of connecting and each step of the handshake.
+     */
+    bool _open_link(int64_t timeout_us);
+    
+    /**
+     * Stop using the socket after a failure, schedule reconnecting.
+     */
+    void _link_down();
+    
+    /**
+     * Wait for _monitor_return of the socket to exit, close the socket.
+     */
+    void _close_link();
+    
+    /**
+     * Try to connect again. Wait longer before the next try if failed.
+     */
+    void _reconnect();
+
     /**
      * Send controll information to log server.
      */
@@ -116,10 +805,109 @@ private:
      */
     static void* _monitor_return(void* args);
     
+    /**
+     * Run the callback functions in _callback_tasks.
+     */
+    static void* _run_callbacks(void* args);
+    
 }; // End class WTLogClient.    
+
+template <typename Iter>
+void WTLogClient::tolog_many(Iter first, Iter last, LogLevel level) {
+    StagingRing* ring = nullptr;
+    for (; first != last; ++first) {
+        LogSpan span = _reserve(first->size(), level, nullptr, 0);
+        if (span.data == nullptr) {
+            continue;
+        }
+        memcpy(span.data, first->data(), span.size);
+        if (span._ring != nullptr) {
+            ring = span._ring;
+        }
+        _commit(span, false);
+    }
+    if (ring != nullptr) {
+        _publish(ring);
+    }
+}
+
+template <typename... Args>
+void WTLogClient::tolog_fmt(LogLevel level, const char* fmt, const Args&... args) {
+    tolog_fmt(level, _intern_format(fmt), args...);
+}
+
+template <typename... Args>
+void WTLogClient::tolog_fmt(LogLevel level, uint64_t format_id, const Args&... args) {
+    LogSpan span = _reserve(sizeof(uint64_t) + format_args_size(args...), level, nullptr, level_fmt_flag);
+    if (span.data == nullptr) {
+        return;
+    }
+    memcpy(span.data, &format_id, sizeof(uint64_t));
+    char* pos = span.data + sizeof(uint64_t);
+    format_args_put(pos, args...);
+    _commit(span, true);
+}
+    
     
+/**
+ * Whether logs of the level are compiled, see WTLOG_MIN_LEVEL.
+ */
+constexpr bool level_compiled(LogLevel level) {
+    return level_rank(level) >= level_rank(WTLOG_MIN_LEVEL);
+}
     
 } // End namespace wtlog.
 
+/**
+ * Send a log if its level is enabled, otherwise the content is not evaluated.
+ * Usage: WTLOG(client, wtlog::LogLevel::debug, "value: " + std::to_string(value));
+ */
+#define WTLOG(client, level, content, ...) \
+    do { \
+        if (wtlog::level_compiled(level) && (client).level_enabled(level)) { \
+            (client).tolog(content, level, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+/**
+ * Send a log if its level is enabled and the rate of this call site allows.
+ * The content is not evaluated if suppressed, the next log sent here shows how many were.
+ * Usage: WTLOG_RATE(client, wtlog::LogLevel::warning, 10, 20, "slow request: " + url);
+ */
+#define WTLOG_RATE(client, level, logs_per_sec, burst, content, ...) \
+    do { \
+        if (wtlog::level_compiled(level) && (client).level_enabled(level)) { \
+            static wtlog::RateLimiter _wtlog_limiter(logs_per_sec, burst); \
+            uint32_t _wtlog_suppressed = 0; \
+            if (_wtlog_limiter.admit(&_wtlog_suppressed) == true) { \
+                (client).tolog_after_suppressed(_wtlog_suppressed, content, level, ##__VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+/**
+ * Send a structured log if its level is enabled, otherwise the fields are not evaluated.
+ * Usage: WTLOG_FIELDS(client, wtlog::LogLevel::info, "login", {{"user", id}, {"latency_us", cost}});
+ */
+#define WTLOG_FIELDS(client, level, msg, ...) \
+    do { \
+        if (wtlog::level_compiled(level) && (client).level_enabled(level)) { \
+            (client).tolog_fields(level, msg, __VA_ARGS__); \
+        } \
+    } while (0)
+
+/**
+ * Send a log formatted by the lander. The format_id is computed once in each call site.
+ * The arguments are not evaluated if the level is disabled.
+ * Usage: WTLOG_FMT(client, wtlog::LogLevel::info, "id: %d, name: %s", id, name);
+ */
+#define WTLOG_FMT(client, level, fmt, ...) \
+    do { \
+        if (wtlog::level_compiled(level) && (client).level_enabled(level)) { \
+            static const uint64_t _wtlog_format_id = wtlog::WTLogClient::register_format(fmt); \
+            (client).tolog_fmt(level, _wtlog_format_id, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
 
 #endif // End ifdef _WTLOG_CLIENT_H_.
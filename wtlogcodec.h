@@ -0,0 +1,134 @@
+/**
+ * Compression of log batches.
+ * Codecs are compiled in by WTLOG_WITH_LZ4(link liblz4) and WTLOG_WITH_ZSTD(link libzstd).
+ * Without them only codec_raw exists, and logs are sent uncompressed.
+ * Author: LiWentan.
+ * Date: 2019/7/20.
+ */
+
+#ifndef _WTLOG_CODEC_H_
+#define _WTLOG_CODEC_H_
+
+#include <stdint.h>
+#include <cstring>
+#ifdef WTLOG_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef WTLOG_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace wtlog {
+
+/**
+ * How a batch is compressed. Sent in the batch, keep the values.
+ */
+enum Codec {
+    codec_raw = 0,  // Not compressed.
+    codec_lz4 = 1,  // LZ4 block, fast.
+    codec_zstd = 2  // Zstandard level 1, smaller.
+};
+
+/**
+ * Whether the codec is compiled in.
+ */
+static bool codec_supported(uint8_t codec) {
+    switch (codec) {
+        case codec_raw : return true;
+#ifdef WTLOG_WITH_LZ4
+        case codec_lz4 : return true;
+#endif
+#ifdef WTLOG_WITH_ZSTD
+        case codec_zstd : return true;
+#endif
+        default : return false;
+    }
+}
+
+/**
+ * The fastest codec compiled in, codec_raw if none.
+ */
+static Codec default_codec() {
+#if defined(WTLOG_WITH_LZ4)
+    return codec_lz4;
+#elif defined(WTLOG_WITH_ZSTD)
+    return codec_zstd;
+#else
+    return codec_raw;
+#endif
+}
+
+/**
+ * Max compressed size of size bytes.
+ */
+static size_t compress_bound(Codec codec, size_t size) {
+    switch (codec) {
+#ifdef WTLOG_WITH_LZ4
+        case codec_lz4 : return LZ4_compressBound((int)size);
+#endif
+#ifdef WTLOG_WITH_ZSTD
+        case codec_zstd : return ZSTD_compressBound(size);
+#endif
+        default : return size;
+    }
+}
+
+/**
+ * Compress src into dst, which has compress_bound bytes.
+ * @return The compressed size, 0 if failed or the codec is not compiled in.
+ */
+static size_t compress_block(Codec codec, const char* src, size_t size, char* dst, size_t capacity) {
+    switch (codec) {
+        case codec_raw : {
+            if (capacity < size) {
+                return 0;
+            }
+            memcpy(dst, src, size);
+            return size;
+        }
+#ifdef WTLOG_WITH_LZ4
+        case codec_lz4 : {
+            int ret = LZ4_compress_default(src, dst, (int)size, (int)capacity);
+            return ret <= 0 ? 0 : (size_t)ret;
+        }
+#endif
+#ifdef WTLOG_WITH_ZSTD
+        case codec_zstd : {
+            size_t ret = ZSTD_compress(dst, capacity, src, size, 1);
+            return ZSTD_isError(ret) ? 0 : ret;
+        }
+#endif
+        default : return 0;
+    }
+}
+
+/**
+ * Decompress src into dst of exactly raw_size bytes.
+ * @return false: Broken data, or the codec is not compiled in.
+ */
+static bool decompress_block(uint8_t codec, const char* src, size_t size, char* dst, size_t raw_size) {
+    switch (codec) {
+        case codec_raw : {
+            if (size != raw_size) {
+                return false;
+            }
+            memcpy(dst, src, size);
+            return true;
+        }
+#ifdef WTLOG_WITH_LZ4
+        case codec_lz4 : {
+            return LZ4_decompress_safe(src, dst, (int)size, (int)raw_size) == (int)raw_size;
+        }
+#endif
+#ifdef WTLOG_WITH_ZSTD
+        case codec_zstd : {
+            return ZSTD_decompress(dst, raw_size, src, size) == raw_size;
+        }
+#endif
+        default : return false;
+    }
+}
+
+} // End namespace wtlog.
+
+#endif // End ifdef _WTLOG_CODEC_H_.
@@ -0,0 +1,397 @@
+/**
+ * Structured logs: a message with typed key/value fields.
+ * The client encodes the fields in binary, the lander keeps them as they are
+ * and filters logs by them without parsing text.
+ * Content of such a log: [msg_size(16)][msg][field_num(8)][field_1][field_2]...
+ * Each field: [type(8)][key_size(8)][key][value].
+ *     int64: zigzag varint, 1 to 10 bytes. double: 8 bytes. bool: 1 byte. string: [size(16)][bytes].
+ * Sizes and doubles are in the byte order of the client.
+ * Author: LiWentan.
+ * Date: 2019/7/23.
+ */
+
+#ifndef _WTLOG_FIELDS_H_
+#define _WTLOG_FIELDS_H_
+
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include <initializer_list>
+#include <stdint.h>
+#include <stdio.h>
+
+using std::string;
+
+namespace wtlog {
+
+/**
+ * Type of a field.
+ */
+enum FieldType {
+    field_i64 = 1,
+    field_f64 = 2,
+    field_str = 3,
+    field_bool = 4
+};
+
+static const size_t max_field_num = UINT8_MAX;  // More fields of a log are ignored.
+static const size_t max_field_key = UINT8_MAX;  // Longer keys are cut.
+static const size_t max_field_str = UINT16_MAX; // Longer strings are cut.
+
+/**
+ * A field given to tolog_fields, e.g. {"user", id}.
+ * It points to the key and the string value, they must live until tolog_fields returns.
+ */
+class LogField {
+public:
+    template <typename T, typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, int>::type = 0>
+    LogField(const char* key, T val) : _type(field_i64), _key(key), _i64((int64_t)val) {}
+
+    LogField(const char* key, bool val) : _type(field_bool), _key(key), _i64(val ? 1 : 0) {}
+
+    LogField(const char* key, double val) : _type(field_f64), _key(key), _f64(val) {}
+
+    LogField(const char* key, const char* val) : _type(field_str), _key(key), _str(val),
+        _str_size(val == nullptr ? 0 : strlen(val)) {}
+
+    LogField(const char* key, const string& val) : _type(field_str), _key(key), _str(val.data()),
+        _str_size(val.size()) {}
+
+    /**
+     * Encoded size.
+     */
+    size_t size() const {
+        size_t size = 1 + 1 + _key_size();
+        if (_type == field_i64) {
+            size += _varint_size(_zigzag());
+        } else if (_type == field_f64) {
+            size += sizeof(double);
+        } else if (_type == field_bool) {
+            size += 1;
+        } else {
+            size += 2 + (_str_size > max_field_str ? max_field_str : _str_size);
+        }
+        return size;
+    }
+
+    /**
+     * Encode at pos, pos is moved to the end.
+     */
+    void put(char*& pos) const {
+        uint8_t key_size = (uint8_t)_key_size();
+        *pos++ = (char)_type;
+        *pos++ = (char)key_size;
+        memcpy(pos, _key, key_size);
+        pos += key_size;
+        if (_type == field_i64) {
+            uint64_t raw = _zigzag();
+            while (raw >= 0x80) {
+                *pos++ = (char)(raw | 0x80);
+                raw >>= 7;
+            }
+            *pos++ = (char)raw;
+        } else if (_type == field_f64) {
+            memcpy(pos, &_f64, sizeof(double));
+            pos += sizeof(double);
+        } else if (_type == field_bool) {
+            *pos++ = (char)_i64;
+        } else {
+            uint16_t str_size = (uint16_t)(_str_size > max_field_str ? max_field_str : _str_size);
+            memcpy(pos, &str_size, sizeof(uint16_t));
+            if (str_size != 0) {
+                memcpy(pos + 2, _str, str_size);
+            }
+            pos += 2 + str_size;
+        }
+    }
+
+private:
+    size_t _key_size() const {
+        size_t size = (_key == nullptr) ? 0 : strlen(_key);
+        return size > max_field_key ? max_field_key : size;
+    }
+
+    uint64_t _zigzag() const {
+        return ((uint64_t)_i64 << 1) ^ (uint64_t)(_i64 >> 63);
+    }
+
+    static size_t _varint_size(uint64_t raw) {
+        size_t size = 1;
+        while (raw >= 0x80) {
+            raw >>= 7;
+            ++size;
+        }
+        return size;
+    }
+
+    FieldType   _type;
+    const char* _key;
+    union {
+        int64_t _i64;
+        double  _f64;
+        const char* _str;
+    };
+    size_t      _str_size = 0;
+};
+
+/**
+ * Encoded size of a structured log.
+ */
+static size_t fields_size(size_t msg_size, std::initializer_list<LogField> fields) {
+    size_t size = 2 + (msg_size > max_field_str ? max_field_str : msg_size) + 1;
+    size_t num = 0;
+    for (const LogField& field : fields) {
+        if (num++ == max_field_num) {
+            break;
+        }
+        size += field.size();
+    }
+    return size;
+}
+
+/**
+ * Encode a structured log at pos, the space is given by fields_size.
+ */
+static void fields_put(char* pos, const char* msg, size_t msg_size, std::initializer_list<LogField> fields) {
+    uint16_t msg_sent = (uint16_t)(msg_size > max_field_str ? max_field_str : msg_size);
+    memcpy(pos, &msg_sent, sizeof(uint16_t));
+    memcpy(pos + 2, msg, msg_sent);
+    pos += 2 + msg_sent;
+    uint8_t num = (uint8_t)(fields.size() > max_field_num ? max_field_num : fields.size());
+    *pos++ = (char)num;
+    const LogField* field = fields.begin();
+    for (uint8_t i = 0; i < num; ++i, ++field) {
+        field->put(pos);
+    }
+}
+
+/**
+ * A field read back by the lander.
+ */
+struct FieldValue {
+    FieldValue() : type(field_bool), i64(0), f64(0) {}
+
+    template <typename T, typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, int>::type = 0>
+    FieldValue(T val) : type(field_i64), i64((int64_t)val), f64(0) {}
+
+    FieldValue(bool val) : type(field_bool), i64(val ? 1 : 0), f64(0) {}
+    FieldValue(double val) : type(field_f64), i64(0), f64(val) {}
+    FieldValue(const char* val) : type(field_str), i64(0), f64(0), str(val) {}
+    FieldValue(const string& val) : type(field_str), i64(0), f64(0), str(val) {}
+
+    /**
+     * Text shown in exported logs. Strings are quoted.
+     */
+    string text() const {
+        char buffer[32];
+        if (type == field_i64) {
+            snprintf(buffer, sizeof(buffer), "%lld", (long long)i64);
+        } else if (type == field_f64) {
+            snprintf(buffer, sizeof(buffer), "%g", f64);
+        } else if (type == field_bool) {
+            return i64 != 0 ? "true" : "false";
+        } else {
+            return "\"" + str + "\"";
+        }
+        return buffer;
+    }
+
+    FieldType type;
+    int64_t   i64; // Also the bool.
+    double    f64;
+    string    str;
+};
+
+/**
+ * Read a structured log.
+ * @param msg: Out, the message.
+ * @param keys: Out, keys of the fields. May be nullptr with values, to take only the message.
+ * @param values: Out, same order as keys.
+ * @return false: Broken content, the fields before are taken.
+ */
+static bool fields_read(const char* content, size_t size, string* msg,
+    std::vector<string>* keys, std::vector<FieldValue>* values) {
+    const char* pos = content;
+    const char* end = content + size;
+    uint16_t msg_size = 0;
+    if (end - pos < 2) {
+        return false;
+    }
+    memcpy(&msg_size, pos, sizeof(uint16_t));
+    pos += 2;
+    if ((size_t)(end - pos) < (size_t)msg_size + 1) {
+        return false;
+    }
+    msg->assign(pos, msg_size);
+    pos += msg_size;
+    uint8_t num = (uint8_t)*pos++;
+    if (keys == nullptr || values == nullptr) {
+        return true;
+    }
+    for (uint8_t i = 0; i < num; ++i) {
+        if (end - pos < 2) {
+            return false;
+        }
+        FieldValue value;
+        value.type = (FieldType)(uint8_t)pos[0];
+        uint8_t key_size = (uint8_t)pos[1];
+        pos += 2;
+        if (end - pos < key_size) {
+            return false;
+        }
+        string key(pos, key_size);
+        pos += key_size;
+        if (value.type == field_i64) {
+            uint64_t raw = 0;
+            int shift = 0;
+            while (true) {
+                if (pos == end || shift > 63) {
+                    return false;
+                }
+                uint8_t byte = (uint8_t)*pos++;
+                raw |= (uint64_t)(byte & 0x7f) << shift;
+                shift += 7;
+                if ((byte & 0x80) == 0) {
+                    break;
+                }
+            }
+            value.i64 = (int64_t)(raw >> 1) ^ -(int64_t)(raw & 1);
+        } else if (value.type == field_f64) {
+            if ((size_t)(end - pos) < sizeof(double)) {
+                return false;
+            }
+            memcpy(&value.f64, pos, sizeof(double));
+            pos += sizeof(double);
+        } else if (value.type == field_bool) {
+            if (pos == end) {
+                return false;
+            }
+            value.i64 = (*pos++ != 0) ? 1 : 0;
+        } else if (value.type == field_str) {
+            uint16_t str_size = 0;
+            if (end - pos < 2) {
+                return false;
+            }
+            memcpy(&str_size, pos, sizeof(uint16_t));
+            pos += 2;
+            if (end - pos < str_size) {
+                return false;
+            }
+            value.str.assign(pos, str_size);
+            pos += str_size;
+        } else {
+            return false;
+        }
+        keys->push_back(std::move(key));
+        values->push_back(std::move(value));
+    }
+    return pos == end;
+}
+
+/**
+ * Comparison of a FieldFilter.
+ */
+enum FieldOp {
+    field_has = 0, // The field exists, the value is not compared.
+    field_eq = 1,
+    field_ne = 2,
+    field_lt = 3,
+    field_le = 4,
+    field_gt = 5,
+    field_ge = 6
+};
+
+/**
+ * Condition on a field of structured logs, e.g. FieldFilter("latency_us", field_gt, 1000).
+ * Integers and doubles are compared as numbers, strings by bytes, bools only by field_eq and field_ne.
+ * A log without the field, or whose value has another type, doesn't pass.
+ */
+struct FieldFilter {
+    FieldFilter() : op(field_has) {}
+    FieldFilter(const string& k_in, FieldOp o_in = field_has, FieldValue v_in = FieldValue()) :
+        key(k_in), op(o_in), value(std::move(v_in)) {}
+
+    /**
+     * Whether a value of the field passes.
+     */
+    bool pass(const FieldValue& val) const {
+        if (op == field_has) {
+            return true;
+        }
+        int order = 0; // Sign of val - value.
+        bool numeric = (val.type == field_i64 || val.type == field_f64) &&
+            (value.type == field_i64 || value.type == field_f64);
+        if (numeric == true) {
+            if (val.type == field_i64 && value.type == field_i64) {
+                order = (val.i64 > value.i64) - (val.i64 < value.i64);
+            } else {
+                double lhs = (val.type == field_i64) ? (double)val.i64 : val.f64;
+                double rhs = (value.type == field_i64) ? (double)value.i64 : value.f64;
+                order = (lhs > rhs) - (lhs < rhs);
+            }
+        } else if (val.type != value.type) {
+            return false;
+        } else if (val.type == field_str) {
+            int cmp = val.str.compare(value.str);
+            order = (cmp > 0) - (cmp < 0);
+        } else if (val.type == field_bool) {
+            if (op != field_eq && op != field_ne) {
+                return false;
+            }
+            order = (val.i64 != value.i64) ? 1 : 0;
+        }
+        switch (op) {
+            case field_eq : return order == 0;
+            case field_ne : return order != 0;
+            case field_lt : return order < 0;
+            case field_le : return order <= 0;
+            case field_gt : return order > 0;
+            case field_ge : return order >= 0;
+            default : return false;
+        }
+    }
+
+    /**
+     * Parse a filter given as text, e.g. "latency_us", ">", "1000".
+     * op is one of has, =, !=, <, <=, >, >=. The value is a bool if true or false,
+     * a number if it parses as one, otherwise a string.
+     * @return false: Unknown op.
+     */
+    static bool parse(const string& key, const string& op, const string& value, FieldFilter* out) {
+        const char* op_text[] = {"has", "=", "!=", "<", "<=", ">", ">="};
+        size_t i = 0;
+        while (i < sizeof(op_text) / sizeof(op_text[0]) && op != op_text[i]) {
+            ++i;
+        }
+        if (i == sizeof(op_text) / sizeof(op_text[0])) {
+            return false;
+        }
+        out->key = key;
+        out->op = (FieldOp)i;
+        char* end = nullptr;
+        long long i64 = strtoll(value.c_str(), &end, 10);
+        if (value == "true" || value == "false") {
+            out->value = FieldValue(value == "true");
+        } else if (value.empty() == false && *end == '\0') {
+            out->value = FieldValue(i64);
+        } else {
+            double f64 = strtod(value.c_str(), &end);
+            if (value.empty() == false && *end == '\0') {
+                out->value = FieldValue(f64);
+            } else {
+                out->value = FieldValue(value);
+            }
+        }
+        return true;
+    }
+
+    string     key;
+    FieldOp    op;
+    FieldValue value;
+};
+
+} // End namespace wtlog.
+
+#endif // End ifdef _WTLOG_FIELDS_H_.
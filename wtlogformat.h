@@ -0,0 +1,262 @@
+/**
+ * Deferred formatting of logs.
+ * The client sends the id of a printf style format and the raw arguments,
+ * the lander formats them when the log is read.
+ * Content of such a log: [format_id(64)][arg_1][arg_2]...
+ * Each arg: [type(8)][value], value is 4 or 8 bytes, or [size(16)][bytes] for a string.
+ * Format ids and values are in the byte order of the client.
+ * Author: LiWentan.
+ * Date: 2019/7/19.
+ */
+
+#ifndef _WTLOG_FORMAT_H_
+#define _WTLOG_FORMAT_H_
+
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <stdint.h>
+#include <stdio.h>
+
+using std::string;
+
+namespace wtlog {
+
+/**
+ * Type of an argument.
+ */
+enum FormatArgType {
+    fmt_i32 = 1,
+    fmt_u32 = 2,
+    fmt_i64 = 3,
+    fmt_u64 = 4,
+    fmt_f64 = 5,
+    fmt_str = 6
+};
+
+/**
+ * Id of a format, FNV-1a hash of the string. The same format has the same id in all clients.
+ */
+constexpr uint64_t format_id(const char* fmt, uint64_t hash = 14695981039346656037ULL) {
+    return *fmt == '\0' ? hash : format_id(fmt + 1, (hash ^ (uint8_t)*fmt) * 1099511628211ULL);
+}
+
+/**
+ * Encoded size of an argument.
+ */
+template <typename T>
+static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, size_t>::type
+format_arg_size(T) {
+    return 1 + (sizeof(T) > 4 ? 8 : 4);
+}
+
+static size_t format_arg_size(double) {
+    return 1 + 8;
+}
+
+static size_t format_arg_size(const void*) {
+    return 1 + 8;
+}
+
+static size_t format_arg_size(const char* val) {
+    size_t size = (val == nullptr) ? 0 : strlen(val);
+    return 1 + 2 + (size > UINT16_MAX ? UINT16_MAX : size);
+}
+
+static size_t format_arg_size(const string& val) {
+    return 1 + 2 + (val.size() > UINT16_MAX ? UINT16_MAX : val.size());
+}
+
+/**
+ * Encode an argument at pos, pos is moved to the end.
+ */
+template <typename T>
+static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+format_arg_put(char*& pos, T val) {
+    bool is_signed = std::is_signed<typename std::conditional<std::is_enum<T>::value, int, T>::type>::value;
+    if (sizeof(T) > 4) {
+        *pos = is_signed ? fmt_i64 : fmt_u64;
+        uint64_t raw = (uint64_t)val;
+        memcpy(pos + 1, &raw, sizeof(uint64_t));
+        pos += 1 + sizeof(uint64_t);
+    } else {
+        *pos = is_signed ? fmt_i32 : fmt_u32;
+        uint32_t raw = (uint32_t)val;
+        memcpy(pos + 1, &raw, sizeof(uint32_t));
+        pos += 1 + sizeof(uint32_t);
+    }
+}
+
+static void format_arg_put(char*& pos, double val) {
+    *pos = fmt_f64;
+    memcpy(pos + 1, &val, sizeof(double));
+    pos += 1 + sizeof(double);
+}
+
+static void format_arg_put(char*& pos, const void* val) {
+    *pos = fmt_u64;
+    uint64_t raw = (uint64_t)(uintptr_t)val;
+    memcpy(pos + 1, &raw, sizeof(uint64_t));
+    pos += 1 + sizeof(uint64_t);
+}
+
+static void format_str_put(char*& pos, const char* val, size_t size) {
+    uint16_t size_sent = (uint16_t)(size > UINT16_MAX ? UINT16_MAX : size);
+    *pos = fmt_str;
+    memcpy(pos + 1, &size_sent, sizeof(uint16_t));
+    if (size_sent != 0) {
+        memcpy(pos + 1 + 2, val, size_sent);
+    }
+    pos += 1 + 2 + size_sent;
+}
+
+static void format_arg_put(char*& pos, const char* val) {
+    format_str_put(pos, val, (val == nullptr) ? 0 : strlen(val));
+}
+
+static void format_arg_put(char*& pos, const string& val) {
+    format_str_put(pos, val.data(), val.size());
+}
+
+static size_t format_args_size() {
+    return 0;
+}
+
+template <typename T, typename... Rest>
+static size_t format_args_size(const T& first, const Rest&... rest) {
+    return format_arg_size(first) + format_args_size(rest...);
+}
+
+static void format_args_put(char*&) {}
+
+template <typename T, typename... Rest>
+static void format_args_put(char*& pos, const T& first, const Rest&... rest) {
+    format_arg_put(pos, first);
+    format_args_put(pos, rest...);
+}
+
+/**
+ * Format the arguments by a printf style format.
+ * Each conversion takes the next argument, the length modifier is chosen by the argument type.
+ * Width and precision given by * are not supported.
+ * @param args: Encoded arguments, after the format_id.
+ * @return false: The arguments are broken, out has the part formatted.
+ */
+static bool format_log(const string& fmt, const char* args, size_t size, string* out) {
+    const char* end = args + size;
+    char spec[32];
+    char value[512];
+    size_t i = 0;
+    while (i < fmt.size()) {
+        if (fmt[i] != '%') {
+            out->push_back(fmt[i++]);
+            continue;
+        }
+        if (i + 1 < fmt.size() && fmt[i + 1] == '%') {
+            out->push_back('%');
+            i += 2;
+            continue;
+        }
+
+        // Flags, width and precision are kept, length modifiers are dropped.
+        size_t spec_len = 0;
+        spec[spec_len++] = fmt[i++];
+        while (i < fmt.size() && strchr("-+ #0123456789.", fmt[i]) != nullptr && spec_len < 16) {
+            spec[spec_len++] = fmt[i++];
+        }
+        while (i < fmt.size() && strchr("hljztL", fmt[i]) != nullptr) {
+            ++i;
+        }
+        if (i == fmt.size()) {
+            break;
+        }
+        char conv = fmt[i++];
+
+        if (args == end) {
+            out->append("<missing>");
+            continue;
+        }
+        char type = *args++;
+        int written = 0;
+        if (type == fmt_str) {
+            uint16_t str_size = 0;
+            if (end - args < 2) {
+                return false;
+            }
+            memcpy(&str_size, args, sizeof(uint16_t));
+            args += 2;
+            if (end - args < str_size) {
+                return false;
+            }
+            string str(args, str_size);
+            args += str_size;
+            if (spec_len == 1) {
+                // Plain %s, no length limit.
+                out->append(str);
+                continue;
+            }
+            spec[spec_len++] = 's';
+            spec[spec_len] = '\0';
+            written = snprintf(value, sizeof(value), spec, str.c_str());
+        } else if (type == fmt_f64) {
+            double val = 0;
+            if (end - args < 8) {
+                return false;
+            }
+            memcpy(&val, args, sizeof(double));
+            args += 8;
+            spec[spec_len++] = strchr("fFeEgGaA", conv) != nullptr ? conv : 'g';
+            spec[spec_len] = '\0';
+            written = snprintf(value, sizeof(value), spec, val);
+        } else if (type >= fmt_i32 && type <= fmt_u64) {
+            bool wide = (type == fmt_i64 || type == fmt_u64);
+            bool is_signed = (type == fmt_i32 || type == fmt_i64);
+            if (end - args < (wide ? 8 : 4)) {
+                return false;
+            }
+            long long val = 0;
+            if (wide) {
+                uint64_t raw = 0;
+                memcpy(&raw, args, sizeof(uint64_t));
+                val = (long long)raw;
+            } else {
+                uint32_t raw = 0;
+                memcpy(&raw, args, sizeof(uint32_t));
+                val = is_signed ? (long long)(int32_t)raw : (long long)raw;
+            }
+            args += wide ? 8 : 4;
+            if (strchr("fFeEgGaA", conv) != nullptr) {
+                spec[spec_len++] = conv;
+                spec[spec_len] = '\0';
+                written = snprintf(value, sizeof(value), spec, (double)val);
+            } else if (conv == 'c') {
+                spec[spec_len++] = 'c';
+                spec[spec_len] = '\0';
+                written = snprintf(value, sizeof(value), spec, (int)val);
+            } else {
+                if (conv == 'p') {
+                    out->append("0x");
+                    conv = 'x';
+                }
+                if (strchr("diouxX", conv) == nullptr) {
+                    conv = is_signed ? 'd' : 'u';
+                }
+                spec[spec_len++] = 'l';
+                spec[spec_len++] = 'l';
+                spec[spec_len++] = conv;
+                spec[spec_len] = '\0';
+                written = snprintf(value, sizeof(value), spec, val);
+            }
+        } else {
+            return false;
+        }
+        if (written > 0) {
+            out->append(value, (size_t)written < sizeof(value) ? written : sizeof(value) - 1);
+        }
+    }
+    return true;
+}
+
+} // End namespace wtlog.
+
+#endif // End ifdef _WTLOG_FORMAT_H_.
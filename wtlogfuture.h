@@ -0,0 +1,310 @@
+/**
+ * Ways to learn the result of a log besides a callback function:
+ * a future waited by the caller, or a completion polled from a ring with a tag.
+ * Author: LiWentan.
+ * Date: 2019/7/24.
+ */
+
+#ifndef _WTLOG_FUTURE_H_
+#define _WTLOG_FUTURE_H_
+
+#include <atomic>
+#include <string>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "netprotocol.h"
+
+using std::string;
+
+namespace wtlog {
+
+/**
+ * Result of a log pushed to the completion ring of a client.
+ */
+struct LogCompletion {
+    LogCompletion() : tag(0), status(CallBackStat::success) {}
+    LogCompletion(uint64_t t_in, const CallBackInfo& info) : tag(t_in), status(info.status), message(info.message) {}
+
+    uint64_t tag; // Given to tolog_tagged, e.g. a request id or a pointer.
+    CallBackStat status;
+    string message;
+};
+
+/**
+ * Result of a log given by tolog_async. One allocation shared with the client.
+ * Setting the result takes no lock unless a thread is waitting for it.
+ * If the client drops the log without a result, e.g. discarded at disconnect, it fails.
+ */
+class LogFuture {
+public:
+    LogFuture() : _state(nullptr) {}
+
+    LogFuture(const LogFuture& rhs) : _state(rhs._state) {
+        if (_state != nullptr) {
+            _state->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    LogFuture(LogFuture&& rhs) : _state(rhs._state) {
+        rhs._state = nullptr;
+    }
+
+    LogFuture& operator=(LogFuture rhs) {
+        std::swap(_state, rhs._state);
+        return *this;
+    }
+
+    ~LogFuture() {
+        _release(_state);
+    }
+
+    /**
+     * False for a default constructed future, it never gets ready.
+     */
+    bool valid() const {
+        return _state != nullptr;
+    }
+
+    /**
+     * Whether the result is set. Never blocks.
+     */
+    bool ready() const {
+        return _state != nullptr && _state->stage.load(std::memory_order_acquire) == set;
+    }
+
+    /**
+     * Wait for the result. Yield a little, then sleep until the result is set.
+     * @param timeout_us: Max waitting time. Negative means wait forever.
+     * @return false: Not ready after timeout, or not valid.
+     */
+    bool wait(int64_t timeout_us = -1) const {
+        if (_state == nullptr) {
+            return false;
+        }
+        for (size_t i = 0; i < 16; ++i) {
+            if (ready() == true) {
+                return true;
+            }
+            sched_yield();
+        }
+        
+        timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        if (timeout_us >= 0) {
+            int64_t nsec = deadline.tv_nsec + (timeout_us % 1000000) * 1000;
+            deadline.tv_sec += timeout_us / 1000000 + nsec / 1000000000;
+            deadline.tv_nsec = nsec % 1000000000;
+        }
+        
+        // Park. Register as waitting before the last check, so _fulfill 
+        // setting the result after the check will find this thread and wake it up.
+        bool res = false;
+        pthread_mutex_lock(&_state->park_lock);
+        _state->waiters.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (true) {
+            if (ready() == true) {
+                res = true;
+                break;
+            }
+            int ret = 0;
+            if (timeout_us >= 0) {
+                ret = pthread_cond_timedwait(&_state->park_cond, &_state->park_lock, &deadline);
+            } else {
+                ret = pthread_cond_wait(&_state->park_cond, &_state->park_lock);
+            }
+            if (ret == ETIMEDOUT) {
+                res = ready();
+                break;
+            }
+        }
+        _state->waiters.fetch_sub(1, std::memory_order_relaxed);
+        pthread_mutex_unlock(&_state->park_lock);
+        return res;
+    }
+
+    /**
+     * Wait for the result, then get it. Valid until the future is destroyed.
+     * Not valid futures get CallBackStat::failed.
+     */
+    const CallBackInfo& get() const {
+        static const CallBackInfo no_state = {CallBackStat::failed, "No log of this future."};
+        if (wait() == false) {
+            return no_state;
+        }
+        return _state->info;
+    }
+
+private:
+    friend class LogNotify;
+
+    enum Stage {
+        pending = 0,
+        setting = 1, // Taken by one writer, info is being written.
+        set = 2
+    };
+
+    struct State {
+        State() : stage(pending), refs(2), promises(1), waiters(0) {
+            pthread_mutex_init(&park_lock, nullptr);
+            pthread_condattr_t cond_attr;
+            pthread_condattr_init(&cond_attr);
+            pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&park_cond, &cond_attr);
+            pthread_condattr_destroy(&cond_attr);
+        }
+        ~State() {
+            pthread_cond_destroy(&park_cond);
+            pthread_mutex_destroy(&park_lock);
+        }
+
+        std::atomic<int> stage;
+        std::atomic<uint32_t> refs;     // LogFuture and LogNotify holding it.
+        std::atomic<uint32_t> promises; // LogNotify holding it, it fails when the last one goes without a result.
+        std::atomic<uint32_t> waiters;  // Threads parked in wait.
+        pthread_mutex_t park_lock;
+        pthread_cond_t park_cond;
+        CallBackInfo info;
+    };
+
+    explicit LogFuture(State* state) : _state(state) {}
+
+    /**
+     * Set the result if not set yet.
+     */
+    static void _fulfill(State* state, const CallBackInfo& info) {
+        int expected = pending;
+        if (state->stage.compare_exchange_strong(expected, setting, std::memory_order_acquire) == false) {
+            return;
+        }
+        state->info = info;
+        state->stage.store(set, std::memory_order_release);
+        
+        // Pairs with the fence in wait, one of them must see the other.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (state->waiters.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+        pthread_mutex_lock(&state->park_lock);
+        pthread_cond_broadcast(&state->park_cond);
+        pthread_mutex_unlock(&state->park_lock);
+    }
+
+    static void _release(State* state) {
+        if (state != nullptr && state->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete state;
+        }
+    }
+
+    State* _state;
+};
+
+/**
+ * Where the result of a log goes: a callback function, a future, or the completion ring.
+ * Copies share the future. Converted from a callback function, so it is passed where callbacks were.
+ */
+class LogNotify {
+public:
+    enum Kind {
+        none = 0,
+        callback = 1,
+        future = 2,
+        tagged = 3
+    };
+
+    LogNotify(void (*fn)(const CallBackInfo&) = nullptr) : _kind(fn == nullptr ? none : callback) {
+        _fn = fn;
+    }
+
+    /**
+     * A new future, out is the other end.
+     */
+    static LogNotify make_future(LogFuture* out) {
+        LogNotify notify;
+        notify._kind = future;
+        notify._state = new LogFuture::State();
+        *out = LogFuture(notify._state);
+        return notify;
+    }
+
+    /**
+     * The result goes to the completion ring with the tag.
+     */
+    static LogNotify make_tagged(uint64_t tag) {
+        LogNotify notify;
+        notify._kind = tagged;
+        notify._tag = tag;
+        return notify;
+    }
+
+    LogNotify(const LogNotify& rhs) : _kind(rhs._kind) {
+        _tag = rhs._tag;
+        if (_kind == future) {
+            _state->refs.fetch_add(1, std::memory_order_relaxed);
+            _state->promises.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    LogNotify(LogNotify&& rhs) : _kind(rhs._kind) {
+        _tag = rhs._tag;
+        rhs._kind = none;
+    }
+
+    LogNotify& operator=(LogNotify rhs) {
+        std::swap(_kind, rhs._kind);
+        std::swap(_tag, rhs._tag);
+        return *this;
+    }
+
+    ~LogNotify() {
+        if (_kind != future) {
+            return;
+        }
+        if (_state->promises.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            CallBackInfo info;
+            info.status = CallBackStat::failed;
+            info.message = "The log is discarded.";
+            LogFuture::_fulfill(_state, info);
+        }
+        LogFuture::_release(_state);
+    }
+
+    bool empty() const {
+        return _kind == none;
+    }
+
+    Kind kind() const {
+        return _kind;
+    }
+
+    void (*fn() const)(const CallBackInfo&) {
+        return _kind == callback ? _fn : nullptr;
+    }
+
+    uint64_t tag() const {
+        return _tag;
+    }
+
+    /**
+     * Set the result of the future. Only the first result is kept.
+     */
+    void fulfill(const CallBackInfo& info) const {
+        if (_kind == future) {
+            LogFuture::_fulfill(_state, info);
+        }
+    }
+
+private:
+    Kind _kind;
+    union {
+        void (*_fn)(const CallBackInfo&);
+        LogFuture::State* _state;
+        uint64_t _tag; // Also copies the others.
+    };
+};
+
+} // End namespace wtlog.
+
+#endif // End ifdef _WTLOG_FUTURE_H_.
@@ -9,8 +9,14 @@
 
 namespace wtlog {
     
-WTLogLander::WTLogLander(const string& path) : _path(path) {
+WTLogLander::WTLogLander(const string& path) : _path(path), 
+    _print_queue(65536, wtatom::QueueMode::ring), 
+    _search_queue(1024, wtatom::QueueMode::segment), 
+    _send_queue(65536, wtatom::QueueMode::ring), 
+    _reply_map(reply_timeout_us) {
     _write = _read = nullptr;
+    _format_file = nullptr;
+    _load_formats();
     _on_recv = false;
     _send_queue_on_append = false;
 }
@@ -32,6 +38,16 @@ bool WTLogLander::connect(const string& ip, short port) {
         return false;
     }
     
+    if (_format_file == nullptr) {
+        _format_file = fopen((_path + "formats").c_str(), "ab");
+    }
+    if (_format_file == nullptr) {
+        toscreen << "Cannot open the format file: " << _path + "formats" << ".\n";
+        fclose(_write);
+        fclose(_read);
+        return false;
+    }
+    
     // Initialize thread lock.
     pthread_rwlock_init(&_file_lock, nullptr);
     
@@ -62,8 +78,7 @@ bool WTLogLander::connect(const string& ip, short port) {
     
     // Handshake with the server, check whether remote server is correct type.
     uint16_t handshake_info_buffer = htons(h_handshake_info);
-    ret = write(_socket, &handshake_info_buffer, sizeof(uint16_t));
-    if (ret != sizeof(uint16_t)) {
+    if (wttool::write_all(_socket, &handshake_info_buffer, sizeof(uint16_t), io_timeout_us) != wttool::io_ok) {
         toscreen << "Write handshake_info to server error. Try to connect again.\n";
         close(_socket);
         fclose(_write);
@@ -71,10 +86,10 @@ bool WTLogLander::connect(const string& ip, short port) {
         pthread_rwlock_destroy(&_file_lock);
         return false;
     }
-    uint16_t handshake_ret_buffer;
-    ret = read(_socket, &handshake_ret_buffer, sizeof(uint16_t));
+    uint16_t handshake_ret_buffer = 0;
+    wttool::IoStat st = wttool::read_all(_socket, &handshake_ret_buffer, sizeof(uint16_t), io_timeout_us);
     handshake_ret_buffer = ntohs(handshake_ret_buffer);
-    if (ret != sizeof(uint16_t) || handshake_ret_buffer != h_handshake_ret) {
+    if (st != wttool::io_ok || handshake_ret_buffer != h_handshake_ret) {
         toscreen << "Remote server may not a correct wtlogserver. Try again.\n";
         close(_socket);
         fclose(_write);
@@ -83,6 +98,8 @@ bool WTLogLander::connect(const string& ip, short port) {
         return false;
     }
     
+    _conn.attach(_socket);
+    
     // Set flag. Tell other thread that they can receive and send message with log server.
     _send_queue_on_append = true;
     _on_recv = true;
@@ -191,14 +208,252 @@ void WTLogLander::disconnect() {
     return;
 }
 
+LanderStatInfo WTLogLander::status() {
+    LanderStatInfo res;
+    res.queue_name.push_back("_print_queue");
+    res.queue_stat.push_back(_print_queue.stat());
+    res.queue_name.push_back("_search_queue");
+    res.queue_stat.push_back(_search_queue.stat());
+    res.queue_name.push_back("_send_queue");
+    res.queue_stat.push_back(_send_queue.stat());
+    return res;
+}
+
+size_t WTLogLander::export_text(const string& date, const string& out_path, 
+    const std::vector<FieldFilter>& filters) {
+    const char* level_name[log_level_num] = {"info", "debug", "warning", "error"};
+    FILE* in = fopen((_path + date).c_str(), "rb");
+    if (in == nullptr) {
+        toscreen << "Cannot open the log file: " << _path + date << ".\n";
+        return 0;
+    }
+    FILE* out = fopen(out_path.c_str(), "w");
+    if (out == nullptr) {
+        toscreen << "Cannot open the export file: " << out_path << ".\n";
+        fclose(in);
+        return 0;
+    }
+    
+    // Records: [head_tag][time(64)][level(16)][content_size(16)][content][tail_tag].
+    // Read the file into a window twice the longest record, instead of loading it all.
+    // The partial record at the end of the window is moved to the front for the next read.
+    const size_t fixed_size = 1 + 8 + 2 + 2 + 1;
+    std::vector<char> data(2 * (fixed_size + 65535));
+    size_t len = 0;
+    bool eof = false;
+    size_t exported = 0;
+    size_t pos = 0;
+    while (eof == false) {
+        memmove(&data[0], &data[pos], len - pos);
+        len -= pos;
+        pos = 0;
+        size_t read_size = fread(&data[len], 1, data.size() - len, in);
+        len += read_size;
+        eof = (read_size == 0);
+        while (pos + fixed_size <= len) {
+            uint64_t p_time = 0;
+            uint16_t level = 0;
+            uint16_t content_size = 0;
+            memcpy(&p_time, &data[pos + 1], sizeof(uint64_t));
+            memcpy(&level, &data[pos + 1 + 8], sizeof(uint16_t));
+            memcpy(&content_size, &data[pos + 1 + 8 + 2], sizeof(uint16_t));
+            size_t end = pos + fixed_size + content_size;
+            if (data[pos] == log_disk_head_tag && end > len && eof == false) {
+                // The rest of the record is not read yet.
+                break;
+            }
+            if (data[pos] != log_disk_head_tag || end > len || data[end - 1] != log_disk_tail_tag) {
+                // Broken record, look for the next head tag.
+                ++pos;
+                continue;
+            }
+            if (filters.empty() == false && _match(level, &data[pos + fixed_size - 1], content_size, filters) == false) {
+                pos = end;
+                continue;
+            }
+            
+            time_t t = p_time / 1000000000;
+            tm local;
+            localtime_r(&t, &local);
+            char time_str[48];
+            size_t time_len = strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &local);
+            snprintf(time_str + time_len, sizeof(time_str) - time_len, ".%09llu", 
+                (unsigned long long)(p_time % 1000000000));
+            uint16_t plain_level = level & ~level_flags;
+            string text = _render(level, string(&data[pos + fixed_size - 1], content_size));
+            fprintf(out, "[%s] [%s] %s\n", time_str, 
+                plain_level < log_level_num ? level_name[plain_level] : "unknown", text.c_str());
+            ++exported;
+            pos = end;
+        }
+    }
+    fclose(in);
+    fclose(out);
+    return exported;
+}
+
+void WTLogLander::_load_formats() {
+    FILE* in = fopen((_path + "formats").c_str(), "rb");
+    if (in == nullptr) {
+        // No format received yet.
+        return;
+    }
+    uint64_t format_id = 0;
+    uint16_t fmt_size = 0;
+    char buffer[65536];
+    while (fread(&format_id, sizeof(uint64_t), 1, in) == 1 && 
+        fread(&fmt_size, sizeof(uint16_t), 1, in) == 1 && 
+        fread(buffer, 1, fmt_size, in) == fmt_size) {
+        _formats.insert(std::make_pair(format_id, string(buffer, fmt_size)));
+    }
+    fclose(in);
+}
+
+void WTLogLander::_add_format(uint64_t format_id, const string& fmt) {
+    if (_formats.find(format_id) == true) {
+        return;
+    }
+    _formats.insert(std::make_pair(format_id, fmt));
+    uint16_t fmt_size = fmt.size();
+    fwrite(&format_id, sizeof(uint64_t), 1, _format_file);
+    fwrite(&fmt_size, sizeof(uint16_t), 1, _format_file);
+    fwrite(fmt.c_str(), 1, fmt_size, _format_file);
+    fflush(_format_file);
+    
+    if (debug_mode) {
+        toscreen << "Received format " << format_id << ": " << fmt << ".\n";
+    }
+}
+
+bool WTLogLander::_take_batch(const char* frames, size_t size) {
+    size_t pos = 0;
+    while (pos + sizeof(uint16_t) <= size) {
+        uint16_t head = ntohs(*(uint16_t*)(frames + pos));
+        const char* frame = frames + pos + sizeof(uint16_t);
+        size_t left = size - pos - sizeof(uint16_t);
+        if (head == h_send_log || head == h_send_log_need_reply) {
+            if (left < log_meta_size) {
+                return false;
+            }
+            uint64_t p_time = be64toh(*(uint64_t*)(frame + log_time_pos));
+            uint16_t level = ntohs(*(uint16_t*)(frame + log_level_pos));
+            uint32_t hash_id = ntohl(*(uint32_t*)(frame + log_hash_pos));
+            uint16_t content_size = ntohs(*(uint16_t*)(frame + log_size_pos));
+            if (left < log_meta_size + content_size) {
+                return false;
+            }
+            if (head == h_send_log_need_reply) {
+                _reply_map.insert(std::make_pair(hash_id, (char)0));
+            }
+            _print_queue.push(LogInfo(string(frame + log_meta_size, content_size), p_time, level, hash_id));
+            pos += sizeof(uint16_t) + log_meta_size + content_size;
+        } else if (head == h_format_def) {
+            if (left < 8 + 2) {
+                return false;
+            }
+            uint16_t fmt_size = ntohs(*(uint16_t*)(frame + 8));
+            if (left < (size_t)8 + 2 + fmt_size) {
+                return false;
+            }
+            _add_format(*(uint64_t*)frame, string(frame + 8 + 2, fmt_size));
+            pos += sizeof(uint16_t) + 8 + 2 + fmt_size;
+        } else {
+            return false;
+        }
+    }
+    return pos == size;
+}
+
+string WTLogLander::_render(uint16_t level, const string& content) {
+    if ((level & level_suppressed_flag) != 0) {
+        // The client suppressed some logs before this one.
+        if (content.size() < sizeof(uint32_t)) {
+            return "[broken suppressed count]";
+        }
+        uint32_t suppressed = 0;
+        memcpy(&suppressed, content.c_str() + content.size() - sizeof(uint32_t), sizeof(uint32_t));
+        return _render(level & ~level_suppressed_flag, content.substr(0, content.size() - sizeof(uint32_t))) + 
+            " [" + std::to_string(ntohl(suppressed)) + " suppressed]";
+    }
+    if ((level & level_fields_flag) != 0) {
+        string msg;
+        std::vector<string> keys;
+        std::vector<FieldValue> values;
+        bool intact = fields_read(content.c_str(), content.size(), &msg, &keys, &values);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            msg.append(" " + keys[i] + "=" + values[i].text());
+        }
+        if (intact == false) {
+            msg.append(" [broken fields]");
+        }
+        return msg;
+    }
+    if ((level & level_fmt_flag) == 0) {
+        return content;
+    }
+    if (content.size() < sizeof(uint64_t)) {
+        return "[broken formatted log]";
+    }
+    uint64_t format_id = 0;
+    memcpy(&format_id, content.c_str(), sizeof(uint64_t));
+    string fmt;
+    if (_formats.find(format_id, &fmt) == false) {
+        return "[unknown format " + std::to_string(format_id) + "]";
+    }
+    string res;
+    if (format_log(fmt, content.c_str() + sizeof(uint64_t), content.size() - sizeof(uint64_t), &res) == false) {
+        res.append(" [broken arguments]");
+    }
+    return res;
+}
+
+bool WTLogLander::_match(uint16_t level, const char* content, size_t size, 
+    const std::vector<FieldFilter>& filters) {
+    if ((level & level_fields_flag) == 0) {
+        return false;
+    }
+    if ((level & level_suppressed_flag) != 0) {
+        // Skip the suppressed count.
+        if (size < sizeof(uint32_t)) {
+            return false;
+        }
+        size -= sizeof(uint32_t);
+    }
+    string msg;
+    std::vector<string> keys;
+    std::vector<FieldValue> values;
+    fields_read(content, size, &msg, &keys, &values);
+    for (size_t i = 0; i < filters.size(); ++i) {
+        size_t j = 0;
+        while (j < keys.size() && (keys[j] != filters[i].key || filters[i].pass(values[j]) == false)) {
+            ++j;
+        }
+        if (j == keys.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void* WTLogLander::_monitor(void* args) {
     WTLogLander* lander = (WTLogLander*)args;
     char buffer[10240];
+    string packed; // Compressed part of a batch.
+    string frames; // Unpacked batch.
+    wttool::BufferedConn& conn = lander->_conn;
     while (lander->_on_recv == true) {
-        // Receive head.
+        // Receive head. Wake up sometimes to check _on_recv.
         uint16_t head_recv;
         bool reply = false;
-        wttool::safe_read(lander->_socket, &head_recv, sizeof(uint16_t));
+        wttool::IoStat st = conn.read(&head_recv, sizeof(uint16_t), 2e5);
+        if (st == wttool::io_timeout) {
+            continue;
+        }
+        if (st != wttool::io_ok) {
+            toscreen << "[ERROR]Lost the connection with the server.\n";
+            lander->_on_recv = false;
+            break;
+        }
         head_recv = ntohs(head_recv);
         
         // Unify log print request.
@@ -210,56 +465,110 @@ void* WTLogLander::_monitor(void* args) {
         // Handle according to head_type.
         switch(head_recv) {
             case (h_send_log) : {
-                // Read log package, construct LogInfo.
-                LogLevel level;
-                uint32_t p_time;
-                uint32_t hash_id;
-                uint16_t content_size;
-                wttool::safe_read(lander->_socket, buffer, sizeof(uint32_t));
-                p_time = (uint32_t)ntohs(*(uint32_t*)buffer);
-                wttool::safe_read(lander->_socket, buffer, sizeof(uint16_t));
-                level = (LogLevel)ntohs(*(uint16_t*)buffer);
-                wttool::safe_read(lander->_socket, &hash_id, sizeof(uint32_t));
-                hash_id = ntohl(hash_id);
-                wttool::safe_read(lander->_socket, &content_size, sizeof(uint16_t));
-                content_size = ntohs(content_size);
-                wttool::safe_read(lander->_socket, buffer, content_size);
-                LogInfo info = LogInfo(string(buffer, content_size), p_time, level, hash_id);
+                // Read log package: time, level, hash_id, content_size, then content.
+                if (conn.read(buffer, log_meta_size, io_timeout_us) != wttool::io_ok) {
+                    toscreen << "[ERROR]Cannot read the rest of a log.\n";
+                    lander->_on_recv = false;
+                    break;
+                }
+                uint64_t p_time = be64toh(*(uint64_t*)(buffer + log_time_pos));
+                uint16_t level = ntohs(*(uint16_t*)(buffer + log_level_pos));
+                uint32_t hash_id = ntohl(*(uint32_t*)(buffer + log_hash_pos));
+                uint16_t content_size = ntohs(*(uint16_t*)(buffer + log_size_pos));
+                if (conn.read(buffer, content_size, io_timeout_us) != wttool::io_ok) {
+                    toscreen << "[ERROR]Cannot read the rest of a log.\n";
+                    lander->_on_recv = false;
+                    break;
+                }
+                
+                // Construct LogInfo.
+                LogInfo info(string(buffer, content_size), p_time, level, hash_id);
                 
                 // Push LogInfo to queue.
                 if (lander->_on_recv != false) {
-                    lander->_print_queue.push(info);
-                    // If this log need reply, push it to reply map.
+                    // If this log need reply, push it to reply map before it can be printed.
                     if (reply == true) {
-                        lander->_reply_map[hash_id] = 0;
+                        lander->_reply_map.insert(std::make_pair(hash_id, (char)0));
                     }
+                    lander->_print_queue.push(std::move(info));
                 }
 
                 break;
             }
+            case (h_send_batch) : {
+                // Read batch package: meta, format_ids, then the compressed logs.
+                if (conn.read(buffer, batch_meta_size, io_timeout_us) != wttool::io_ok) {
+                    toscreen << "[ERROR]Cannot read the rest of a batch.\n";
+                    lander->_on_recv = false;
+                    break;
+                }
+                uint8_t codec = (uint8_t)buffer[0];
+                uint16_t format_num = ntohs(*(uint16_t*)(buffer + 2));
+                uint32_t raw_size = ntohl(*(uint32_t*)(buffer + 8));
+                uint32_t packed_size = ntohl(*(uint32_t*)(buffer + 12));
+                if (raw_size > max_batch_size || packed_size > max_batch_size) {
+                    toscreen << "[ERROR]A batch is too large: " << raw_size << ".\n";
+                    lander->_on_recv = false;
+                    break;
+                }
+                // The formats are defined before by the server.
+                size_t ids_size = format_num * sizeof(uint64_t);
+                packed.resize(ids_size + packed_size);
+                if (conn.read_direct(&packed[0], packed.size(), io_timeout_us) != wttool::io_ok) {
+                    toscreen << "[ERROR]Cannot read the rest of a batch.\n";
+                    lander->_on_recv = false;
+                    break;
+                }
+                frames.resize(raw_size);
+                if (decompress_block(codec, &packed[ids_size], packed_size, &frames[0], raw_size) == false) {
+                    toscreen << "[ERROR]Cannot unpack a batch, codec: " << (int)codec 
+                        << ". Compile the lander with the codec of clients.\n";
+                    break;
+                }
+                if (lander->_take_batch(&frames[0], raw_size) == false) {
+                    toscreen << "[ERROR]A broken batch, some logs are lost.\n";
+                }
+                break;
+            }
+            case (h_format_def) : {
+                // Read format package: format_id, format_size, then format.
+                if (conn.read(buffer, 8 + 2, io_timeout_us) != wttool::io_ok) {
+                    toscreen << "[ERROR]Cannot read the rest of a format.\n";
+                    lander->_on_recv = false;
+                    break;
+                }
+                uint64_t format_id = *(uint64_t*)buffer;
+                uint16_t fmt_size = ntohs(*(uint16_t*)(buffer + 8));
+                if (conn.read(buffer, fmt_size, io_timeout_us) != wttool::io_ok) {
+                    toscreen << "[ERROR]Cannot read the rest of a format.\n";
+                    lander->_on_recv = false;
+                    break;
+                }
+                lander->_add_format(format_id, string(buffer, fmt_size));
+                break;
+            }
             case (h_search_request) : {
-                // Read search package, construct SearchInfo.
-                LogLevel level;
-                uint32_t hash_id;
-                uint32_t start_time;
-                uint32_t end_time;
-                uint16_t content_size;
-                wttool::safe_read(lander->_socket, buffer, sizeof(uint16_t));
-                level = (LogLevel)ntohs(*(uint16_t*)buffer);
-                wttool::safe_read(lander->_socket, &hash_id, sizeof(uint32_t));
-                hash_id = ntohl(hash_id);
-                wttool::safe_read(lander->_socket, &start_time, sizeof(uint32_t));
-                start_time = ntohl(start_time);
-                wttool::safe_read(lander->_socket, &end_time, sizeof(uint32_t));
-                end_time = ntohl(end_time);
-                wttool::safe_read(lander->_socket, &content_size, sizeof(uint16_t));
-                content_size = ntohs(content_size);
-                wttool::safe_read(lander->_socket, buffer, content_size);
+                // Read search package: level, hash_id, start_time, end_time, content_size, then content.
+                if (conn.read(buffer, 2 + 4 + 4 + 4 + 2, io_timeout_us) != wttool::io_ok) {
+                    toscreen << "[ERROR]Cannot read the rest of a search request.\n";
+                    lander->_on_recv = false;
+                    break;
+                }
+                LogLevel level = (LogLevel)ntohs(*(uint16_t*)buffer);
+                uint32_t hash_id = ntohl(*(uint32_t*)(buffer + 2));
+                uint32_t start_time = ntohl(*(uint32_t*)(buffer + 2 + 4));
+                uint32_t end_time = ntohl(*(uint32_t*)(buffer + 2 + 4 + 4));
+                uint16_t content_size = ntohs(*(uint16_t*)(buffer + 2 + 4 + 4 + 4));
+                if (conn.read(buffer, content_size, io_timeout_us) != wttool::io_ok) {
+                    toscreen << "[ERROR]Cannot read the rest of a search request.\n";
+                    lander->_on_recv = false;
+                    break;
+                }
                 SearchInfo info(string(buffer, content_size), level, hash_id, start_time, end_time);
                 
                 // Push SearchInfo to queue.
                 if (lander->_on_recv != false) {
-                    lander->_search_queue.push(info);
+                    lander->_search_queue.push(std::move(info));
                 }
 
                 break;
@@ -288,55 +597,55 @@ void* WTLogLander::_monitor(void* args) {
 
 void* WTLogLander::_handle_print_queue(void* args) {
     WTLogLander* lander = (WTLogLander*)args;
-    int empty_times = 0;
-    LogInfo loginfo;
-    char buffer[10240];
+    const size_t batch_size = 64; // Max logs written to disk at once.
+    std::vector<LogInfo> loginfo(batch_size);
+    std::vector<char> buffer(batch_size * 10240);
     while (lander->_on_recv == true || lander->_print_queue.size() != 0) {
-        if (empty_times >= 20) {
-            usleep(2e5);
-        }
+        // Forget the replies of logs which never come.
+        lander->_reply_map.expire();
         
-        if (lander->_print_queue.get(loginfo) == false) {
+        size_t log_num = lander->_print_queue.get_batch_wait(&loginfo[0], batch_size, 2e5);
+        if (log_num == 0) {
             // No log is waitting to be sent.
-            ++empty_times;
             continue;
         }
         
         size_t next_addr = 0;
+        for (size_t i = 0; i < log_num; ++i) {
+            // Write log head tag.
+            memcpy(&buffer[next_addr], &log_disk_head_tag, sizeof(char));
+            next_addr += sizeof(char);
+            
+            // Write time.
+            uint64_t cur_time = loginfo[i].p_time;
+            memcpy(&buffer[next_addr], &cur_time, sizeof(uint64_t));
+            next_addr += sizeof(uint64_t);
+            
+            // Write level.
+            uint16_t level = (uint16_t)loginfo[i].level;
+            memcpy(&buffer[next_addr], &level, sizeof(uint16_t));
+            next_addr += sizeof(uint16_t);
+            
+            // Write content size.
+            uint16_t content_size = (uint16_t)loginfo[i].content.size();
+            memcpy(&buffer[next_addr], &content_size, sizeof(uint16_t));
+            next_addr += sizeof(uint16_t);
+            
+            // Write content.
+            memcpy(&buffer[next_addr], loginfo[i].content.c_str(), content_size);
+            next_addr += content_size;
+            
+            // Add log tail tag.
+            memcpy(&buffer[next_addr], &log_disk_tail_tag, sizeof(char));
+            next_addr += sizeof(char);
+        }
         
-        // Write log head tag.
-        memcpy(buffer + next_addr, &log_disk_head_tag, sizeof(char));
-        next_addr += sizeof(char);
-        
-        // Write time.
-        uint32_t cur_time = loginfo.p_time;
-        memcpy(buffer + next_addr, &cur_time, sizeof(uint32_t));
-        next_addr += sizeof(uint32_t);
-        
-        // Write level.
-        uint16_t level = (uint16_t)loginfo.level;
-        memcpy(buffer + next_addr, &level, sizeof(uint16_t));
-        next_addr += sizeof(uint16_t);
-        
-        // Write content size.
-        uint16_t content_size = (uint16_t)loginfo.content.size();
-        memcpy(buffer + next_addr, &content_size, sizeof(uint16_t));
-        next_addr += sizeof(uint16_t);
-        
-        // Write content.
-        memcpy(buffer + next_addr, loginfo.content.c_str(), content_size);
-        next_addr += content_size;
-        
-        // Add log tail tag.
-        memcpy(buffer + next_addr, &log_disk_tail_tag, sizeof(char));
-        next_addr += sizeof(char);
-        
-        // Write to disk.
+        // Write the whole batch to disk.
         wtatom::lockr(lander->_file_lock);
-        int ret = fwrite(buffer, next_addr, 1, lander->_write);
+        int ret = fwrite(&buffer[0], next_addr, 1, lander->_write);
         if (ret != 1) {
             // Write failed. Manully write a log_disk_tail_tag to avoid pollution.
-            toscreen << "[ERROR]Write log to disk failed. Log size: " << next_addr << ".\n";
+            toscreen << "[ERROR]Write log to disk failed. Batch size: " << next_addr << ".\n";
             ret = fwrite(&log_disk_tail_tag, 1, 1, lander->_write);
             int try_times = 0;
             while (ret != 1 && try_times < 5) {
@@ -350,9 +659,11 @@ void* WTLogLander::_handle_print_queue(void* args) {
         wtatom::unlock(lander->_file_lock);
         
         // Send success info to server (if doing not need reply, it won't send network package).
-        void* ret_hash_id = malloc(sizeof(uint32_t));
-        memcpy(ret_hash_id, &loginfo.hash_id, sizeof(uint32_t));
-        lander->_send_command(Command::write_log_ret, ret_hash_id);
+        for (size_t i = 0; i < log_num; ++i) {
+            void* ret_hash_id = malloc(sizeof(uint32_t));
+            memcpy(ret_hash_id, &loginfo[i].hash_id, sizeof(uint32_t));
+            lander->_send_command(Command::write_log_ret, ret_hash_id);
+        }
     }
     
     pthread_exit(nullptr);
@@ -360,16 +671,10 @@ void* WTLogLander::_handle_print_queue(void* args) {
 
 void* WTLogLander::_handle_search_queue(void* args) {
     WTLogLander* lander = (WTLogLander*)args;
-    int empty_times = 0;
     SearchInfo sinfo;
     while (lander->_on_recv == true || lander->_search_queue.size() != 0) {
-        if (empty_times >= 20) {
-            usleep(2e5);
-        }
-        
-        if (lander->_search_queue.get(sinfo) == false) {
+        if (lander->_search_queue.get_wait(&sinfo, 2e5) == false) {
             // No log is waitting to be sent.
-            ++empty_times;
             continue;
         }
         
@@ -387,7 +692,7 @@ void WTLogLander::_send_command(Command comm, void* content) {
             toscreen << "Start to send h_stop_send_log to server.\n";
         }
         
-        _send_queue.push(info);
+        _send_queue.push(std::move(info));
         
         if (debug_mode) {
             toscreen << "Waitting for _on_recv to close.\n";
@@ -412,10 +717,10 @@ void WTLogLander::_send_command(Command comm, void* content) {
         
         // Tell server this lander won't send any message. Wait the reply.
         uint16_t no_send_head = htons(h_close_with_lander);
-        write(_socket, &no_send_head, sizeof(uint16_t));
-        uint16_t no_send_reply;
+        _conn.write(&no_send_head, sizeof(uint16_t), io_timeout_us);
+        uint16_t no_send_reply = 0;
         toscreen << "Send h_close_with_lander, waitting for reply...\n";
-        wttool::safe_read(_socket, &no_send_reply, sizeof(uint16_t));
+        _conn.read(&no_send_reply, sizeof(uint16_t), io_timeout_us);
         no_send_reply = ntohs(no_send_reply);
         if (no_send_reply != h_close_with_lander_reply) {
             toscreen << "Send h_close_with_lander but got wrong reply.\n";
@@ -430,12 +735,12 @@ void WTLogLander::_send_command(Command comm, void* content) {
         uint32_t& hash_id = *(uint32_t*)content;
         if (_reply_map.find_and_remove(hash_id) == true) {
             // This hash_id reflects a log which need reply.
-            SendInfo info(h_log_receive_success, string((char*)&hash_id));
-            _send_queue.push(info);
+            SendInfo info(h_log_receive_success, string((char*)&hash_id, sizeof(uint32_t)));
+            _send_queue.push(std::move(info));
         }
     } else if (comm == Command::stop_immediately) {
         uint16_t no_send_head = htons(h_close_with_lander);
-        write(_socket, &no_send_head, sizeof(uint16_t));
+        _conn.write(&no_send_head, sizeof(uint16_t), io_timeout_us);
     }
     if (content != nullptr) {
         free(content);
@@ -444,17 +749,11 @@ void WTLogLander::_send_command(Command comm, void* content) {
 
 void* WTLogLander::_handle_send_queue(void* args) {
     WTLogLander* lander = (WTLogLander*)args;
-    int empty_times = 0;
     SendInfo sinfo;
-    char buffer[10240];
+    char buffer[2 + 4 + 2]; // Head of a reply, the content is sent from sinfo.
     while (lander->_send_queue_on_append == true || lander->_send_queue.size() != 0) {
-        if (empty_times >= 20) {
-            usleep(2e5);
-        }
-        
-        if (lander->_send_queue.get(sinfo) == false) {
+        if (lander->_send_queue.get_wait(&sinfo, 2e5) == false) {
             // No message is waitting to be sent.
-            ++empty_times;
             continue;
         }
 
@@ -478,12 +777,13 @@ void* WTLogLander::_handle_send_queue(void* args) {
             memcpy(buffer + next_addr, &con_size, sizeof(uint16_t));
             next_addr += sizeof(uint16_t);
             
-            // Write content.
-            memcpy(buffer + next_addr, sinfo.content.c_str() + sizeof(uint32_t), sinfo.content.size() - sizeof(uint32_t));
-            next_addr += (sinfo.content.size() - sizeof(uint32_t));
-            
-            // Send.
-            write(lander->_socket, buffer, next_addr);
+            // Send with the content.
+            iovec iov[2];
+            iov[0].iov_base = buffer;
+            iov[0].iov_len = next_addr;
+            iov[1].iov_base = const_cast<char*>(sinfo.content.c_str() + sizeof(uint32_t));
+            iov[1].iov_len = sinfo.content.size() - sizeof(uint32_t);
+            lander->_conn.write(iov, 2, io_timeout_us);
         } else if (sinfo.head == h_search_fin) {
             
         } else if (sinfo.head == h_stop_send_log) {
@@ -492,7 +792,7 @@ void* WTLogLander::_handle_send_queue(void* args) {
                 toscreen << "Start to send h_stop_send_log to server.\n";
             }
             uint16_t s_head = htons(h_stop_send_log);
-            write(lander->_socket, &s_head, sizeof(uint16_t));
+            lander->_conn.write(&s_head, sizeof(uint16_t), io_timeout_us);
             if (debug_mode) {
                 toscreen << "Writing send h_stop_send_log to server finished.\n";
             }
@@ -9,13 +9,24 @@
 #define _WTLOG_LANDER_H_
 
 #include <pthread.h>
+#include <endian.h>
 #include "wtlogtools.h"
 #include "netprotocol.h"
 #include "wtatomqueue.hpp"
+#include "wtexpiremap.h"
+#include "wtlogsocket.h"
+#include "wtlogformat.h"
+#include "wtlogfields.h"
+#include "wtlogcodec.h"
 
 using std::string;
 
 namespace wtlog {
+
+struct LanderStatInfo {
+    std::vector<string> queue_name;
+    std::vector<wtatom::QueueStat> queue_stat; // Same order as queue_name.
+};
     
 class WTLogLander {
 private:
@@ -24,17 +35,8 @@ private:
      */
     struct LogInfo {
         LogInfo() {}
-        LogInfo(const string& c_in, uint32_t t_in, LogLevel l_in, uint32_t h_in) : 
-            content(c_in), p_time(t_in), level(l_in), hash_id(h_in) {}
-        LogInfo(const LogInfo& in) : 
-            content(in.content), p_time(in.p_time), level(in.level), hash_id(in.hash_id) {}
-        LogInfo& operator=(const LogInfo& in) {
-            content = in.content;
-            p_time = in.p_time;
-            level = in.level;
-            hash_id = in.hash_id;
-            return *this;
-        }
+        LogInfo(string c_in, uint64_t t_in, uint16_t l_in, uint32_t h_in) : 
+            content(std::move(c_in)), p_time(t_in), level(l_in), hash_id(h_in) {}
         bool operator==(const LogInfo& rhs) {
             if (content == rhs.content && 
                 p_time == rhs.p_time &&
@@ -45,8 +47,8 @@ private:
         }
         
         string content;
-        uint32_t p_time;
-        LogLevel level;
+        uint64_t p_time; // In nanosecond since epoch.
+        uint16_t level; // LogLevel, with the level_flags telling how the content is encoded.
         uint32_t hash_id;
     };
     
@@ -55,20 +57,9 @@ private:
      */
     struct SearchInfo {
         SearchInfo() {}
-        SearchInfo(const string& c_in, LogLevel l_in, uint32_t h_in, 
-            uint32_t s_in, uint32_t e_in) : content(c_in), level(l_in),
+        SearchInfo(string c_in, LogLevel l_in, uint32_t h_in, 
+            uint32_t s_in, uint32_t e_in) : content(std::move(c_in)), level(l_in),
             hash_id(h_in), start_time(s_in), end_time(e_in) {}
-        SearchInfo(const SearchInfo& in) : content(in.content), 
-            level(in.level), hash_id(in.hash_id), 
-            start_time(in.start_time), end_time(in.end_time) {}
-        SearchInfo& operator=(const SearchInfo& in) {
-            content = in.content;
-            level = in.level;
-            hash_id = in.hash_id;
-            start_time = in.start_time;
-            end_time = in.end_time;
-            return *this;
-        }
         
         string content;
         LogLevel level;
@@ -82,22 +73,16 @@ private:
      */
     struct SendInfo {
         SendInfo() {}
-        SendInfo(uint16_t h_in, const string& c_in = "") : head(h_in), content(c_in) {}
-        SendInfo(const SendInfo& in) : head(in.head), content(in.content) {}
-        SendInfo& operator=(const SendInfo& in) {
-            head = in.head;
-            content = in.content;
-            return *this;
-        }
+        SendInfo(uint16_t h_in, string c_in = "") : head(h_in), content(std::move(c_in)) {}
         
         uint16_t head;
         string content;
     };
     
 public:
-    friend class wtatom::AtomQueue<LogInfo>;
+    friend class wtatom::AtomQueue<LogInfo, wtatom::Producers::Single, wtatom::Consumers::Single>;
     friend class wtatom::AtomQueue<SearchInfo>;
-    friend class wtatom::AtomQueue<SendInfo>;
+    friend class wtatom::AtomQueue<SendInfo, wtatom::Producers::Multi, wtatom::Consumers::Single>;
 
     /**
      * Constructive function.
@@ -117,6 +102,22 @@ public:
      */
     void disconnect();
     
+    /**
+     * Show the status.
+     */
+    LanderStatInfo status();
+    
+    /**
+     * Write the logs of a date as text, formatted logs are formatted now.
+     * Each line: [time] [level] content. Fields of structured logs follow as key=value.
+     * @param date: Name of the log file, e.g. 20190719.
+     * @param filters: If given, only structured logs passing all of them are written.
+     *      Their binary fields are compared, nothing is rendered for the logs filtered out.
+     * @return The number of logs written. 
+     */
+    size_t export_text(const string& date, const string& out_path, 
+        const std::vector<FieldFilter>& filters = std::vector<FieldFilter>());
+    
 private:
     string  _path;   // Log file folder path.
     FILE*   _write;  // File pointer used to write data.
@@ -125,16 +126,21 @@ private:
     bool          _send_queue_on_append; // False means send queue won't have more elements, just need handle existing elements.
     bool          _on_recv;   // True means this lander is monitoring the request from server.
     int           _socket;    // Socket to the log server.
+    wttool::BufferedConn _conn; // Bytes received from the log server. Read by _monitor, then by disconnect.
     sockaddr_in   _svr_addr;  // Server addr.
     pthread_t     _hpq_t;     // Thread number of _handle_print_queue.
     pthread_t     _hsq_t;     // Thread number of _handle_search_queue.
     pthread_t     _sq_t;      // Thread number of _send_queue.
     pthread_t     _mon_t;     // Thread number of monitoring request from server.
     pthread_rwlock_t                _file_lock;    // Any outer modifications to log file need write lock.
-    wtatom::AtomQueue<LogInfo>      _print_queue;  // Logs to be printed.
+    wtatom::AtomQueue<LogInfo, wtatom::Producers::Single, wtatom::Consumers::Single> 
+                                    _print_queue;  // Logs to be printed. Only _monitor pushes.
     wtatom::AtomQueue<SearchInfo>   _search_queue; // Search requests.
-    wtatom::AtomQueue<SendInfo>     _send_queue; // Search requests.
-    wtatom::AtomMap<uint32_t, char> _reply_map;    // Request to be replied. Key is hash_id.
+    wtatom::AtomQueue<SendInfo, wtatom::Producers::Multi, wtatom::Consumers::Single> 
+                                    _send_queue;   // Packages to be sent. Only _handle_send_queue gets.
+    wtatom::ExpireMap<uint32_t, char> _reply_map;  // Request to be replied. Key is hash_id. Forgotten after reply_timeout_us.
+    wtatom::AtomMap<uint64_t, string> _formats;    // Formats of formatted logs. Key is the format_id.
+    FILE*   _format_file; // Formats received are appended: [format_id(64)][format_size(16)][format].
 
 private:
     /**
@@ -155,6 +161,33 @@ private:
      */
     void _send_command(Command comm, void* content = nullptr);
 
+    /**
+     * Load the formats received before from the format file.
+     */
+    void _load_formats();
+    
+    /**
+     * Remember a format received, append it to the format file.
+     */
+    void _add_format(uint64_t format_id, const string& fmt);
+    
+    /**
+     * Push the logs of an unpacked batch to _print_queue, keep its format definitions.
+     * Only _monitor calls it.
+     * @return false: Broken frames, the ones before are taken.
+     */
+    bool _take_batch(const char* frames, size_t size);
+    
+    /**
+     * Text of a log content. Formatted logs are formatted, fields and a suppressed count are appended.
+     */
+    string _render(uint16_t level, const string& content);
+    
+    /**
+     * Whether a log passes all the filters. Only structured logs may pass.
+     */
+    static bool _match(uint16_t level, const char* content, size_t size, const std::vector<FieldFilter>& filters);
+    
     /**
      * Handle the print queue.
      */
@@ -9,7 +9,22 @@
 
 namespace wtlog {
     
-WTLogServer::WTLogServer() {}
+WTLogServer::WTLogServer() : 
+    _send_to_client(65536, wtatom::QueueMode::ring), 
+    _send_to_lander(1024, wtatom::QueueMode::segment), 
+    _reply_route(reply_slot_num, reply_timeout_us), 
+    _control_to_client(64, wtatom::QueueMode::segment), 
+    _default_level(LogLevel::debug) {
+    pthread_mutex_init(&_level_lock, nullptr);
+}
+
+WTLogServer::~WTLogServer() {
+    pthread_mutex_destroy(&_level_lock);
+    QueueMap::ReadGuard queues = _lander_queue.read();
+    for (auto it = queues->begin(); it != queues->end(); ++it) {
+        delete it->second;
+    }
+}
 
 bool WTLogServer::start(short listen_port) {
     // Create _mon_socket.
@@ -100,12 +115,13 @@ bool WTLogServer::stop(bool soft) {
 
     if (_socket_info.size() != 0) {
         // Print uncorrect opposites info.
-        std::vector<string> _on_socket_info;
-        _socket_info.get_all(nullptr, &_on_socket_info);
         stringstream ss;
         ss << "Following clients or landers have not been correctly closed: \n";
-        for (size_t i = 0; i < _on_socket_info.size(); ++i) {
-            ss << i << ": " << _on_socket_info[i] << ".\n";
+        {
+            auto infos = _socket_info.read();
+            for (size_t i = 0; i < infos->size(); ++i) {
+                ss << i << ": " << (*infos)[i].second << ".\n";
+            }
         }
         toscreen << ss.str();
         
@@ -113,23 +129,29 @@ bool WTLogServer::stop(bool soft) {
             return false;
         }
         
-        // Clean the resources.
-        std::vector<int> _on_socket;
-        std::vector<pthread_t> listen_thread;
-        std::vector<pthread_t> send_thread;
-        std::vector<wtatom::AtomQueue<SendInfo>*> _queue;
-        _listen_t.get_all(&_on_socket, &listen_thread);
-        _send_t.get_all(nullptr, &send_thread);
-        for (size_t i = 0; i < _on_socket.size(); ++i) {
-            pthread_cancel(listen_thread[i]);
-            pthread_cancel(send_thread[i]);
-            close(_on_socket[i]);
+        // Clean the resources. Clients and landers have their own threads.
+        {
+            auto listen_thread = _listen_t.read();
+            for (auto it = listen_thread->begin(); it != listen_thread->end(); ++it) {
+                pthread_cancel(it->second);
+                close(it->first);
+            }
+            auto send_thread = _send_t.read();
+            for (auto it = send_thread->begin(); it != send_thread->end(); ++it) {
+                pthread_cancel(it->second);
+                close(it->first);
+            }
+            auto queues = _lander_queue.read();
+            for (auto it = queues->begin(); it != queues->end(); ++it) {
+                it->second->clear();
+            }
         }
         _socket_info.clear();
         _listen_t.clear();
         _send_t.clear();
         _send_to_client.clear();
         _send_to_lander.clear();
+        _sending_queue.clear();
     }
     
     toscreen << "Server stopped.\n";
@@ -137,20 +159,75 @@ bool WTLogServer::stop(bool soft) {
 }
 
 StatInfo WTLogServer::status() {
-    std::vector<string> o_info;
-    _socket_info.get_all(nullptr, &o_info);
     StatInfo res;
-    for (size_t i = 0; i < o_info.size(); ++i) {
-        if (o_info[i].find("[Client]") != std::string::npos) {
+    auto infos = _socket_info.read();
+    for (auto it = infos->begin(); it != infos->end(); ++it) {
+        if (it->second.find("[Client]") != std::string::npos) {
             // Is a client.
-            res.client_socket.push_back(o_info[i]);
+            DropCount dropped;
+            _client_dropped.find(it->first, &dropped);
+            LogLevel level = LogLevel::debug;
+            _client_level.find(it->first, &level);
+            res.client_socket.push_back(it->second);
+            res.client_fd.push_back(it->first);
+            res.client_dropped.push_back(dropped);
+            res.client_level.push_back(level);
         } else {
-            res.lander_socket.push_back(o_info[i]);
+            res.lander_socket.push_back(it->second);
+        }
+    }
+    
+    // Queues.
+    res.queue_name.push_back("_send_to_client");
+    res.queue_stat.push_back(_send_to_client.stat());
+    res.queue_name.push_back("_send_to_lander");
+    res.queue_stat.push_back(_send_to_lander.stat());
+    auto queues = _lander_queue.read();
+    for (auto it = queues->begin(); it != queues->end(); ++it) {
+        string name = "_lander_queue[" + wttool::num2str(it->first) + "]";
+        string info;
+        if (_socket_info.find(it->first, &info) == true) {
+            name += info;
         }
+        res.queue_name.push_back(name);
+        res.queue_stat.push_back(it->second->stat());
     }
     return res;
 }
 
+bool WTLogServer::set_client_level(LogLevel min_level, int socket) {
+    if ((size_t)min_level >= log_level_num) {
+        return false;
+    }
+    wtatom::lock(_level_lock);
+    if (socket >= 0) {
+        if (_client_level.find(socket) == false) {
+            wtatom::unlock(_level_lock);
+            return false;
+        }
+        _set_level_locked(socket, min_level);
+        wtatom::unlock(_level_lock);
+        return true;
+    }
+    _default_level = min_level;
+    std::vector<int> sockets;
+    _client_level.get_all(&sockets, nullptr);
+    for (size_t i = 0; i < sockets.size(); ++i) {
+        _set_level_locked(sockets[i], min_level);
+    }
+    wtatom::unlock(_level_lock);
+    return true;
+}
+
+void WTLogServer::_set_level_locked(int socket, LogLevel min_level) {
+    _client_level.insert(std::make_pair(socket, min_level));
+    char content[sizeof(int) + sizeof(uint16_t)];
+    uint16_t level = htons((uint16_t)min_level);
+    memcpy(content, &socket, sizeof(int));
+    memcpy(content + sizeof(int), &level, sizeof(uint16_t));
+    _control_to_client.emplace(h_set_level, string(content, sizeof(content)));
+}
+
 void* WTLogServer::_wait_new_connection(void* args) {
     WTLogServer* server = (WTLogServer*)args;
     while (server->_on_listen) {
@@ -194,8 +271,10 @@ void* WTLogServer::_listen_unknown_socket(void* args) {
         "[PORT: " + wttool::num2str(ntohs(sk_info.sin_port)) + "]";
     
     // Read the handshake information from tar_socket.
-    wttool::safe_read(tar_socket, buffer, sizeof(uint16_t));
-    uint16_t hand_info = ntohs(*(uint16_t*)buffer);
+    uint16_t hand_info = 0;
+    if (wttool::read_all(tar_socket, buffer, sizeof(uint16_t), io_timeout_us) == wttool::io_ok) {
+        hand_info = ntohs(*(uint16_t*)buffer);
+    }
     
     // Check the handshake information.
     if (hand_info == h_authorize_info) { // Is a client.
@@ -206,28 +285,33 @@ void* WTLogServer::_listen_unknown_socket(void* args) {
         int ret = pthread_create(&l_t, nullptr, _listen_client, param_t);
         if (ret != 0) {
             toscreen << "Creat listen thread for new client failed.\n";
-            write(tar_socket, "00", 2); // Send failed info to client.
+            wttool::write_all(tar_socket, "00", 2, io_timeout_us); // Send failed info to client.
             close(tar_socket);
             server->_lus_t.find_and_remove(self_t); // Delete this lus thread info from _lus_t.
             pthread_exit(nullptr);
         }
         
         // Add info to socket_info.
-        server->_socket_info[tar_socket] = "[Client]" + sk_info_str;
+        server->_socket_info.insert(std::make_pair(tar_socket, "[Client]" + sk_info_str));
         
         // Add listen thread to thread pool.
-        server->_listen_t[tar_socket] = l_t;
+        server->_listen_t.insert(std::make_pair(tar_socket, l_t));
         
-        // Send OK information to client.
-        uint16_t har = htons(h_authorize_ret);
-        write(tar_socket, &har, sizeof(uint16_t));
+        // Send OK information and the current min level to client.
+        // Changes after it are queued to _send_client, which writes them after this.
+        uint16_t har[3] = {htons(h_authorize_ret), htons(h_set_level), 0};
+        wtatom::lock(server->_level_lock);
+        har[2] = htons((uint16_t)server->_default_level);
+        server->_client_level.insert(std::make_pair(tar_socket, server->_default_level));
+        wttool::write_all(tar_socket, har, sizeof(har), io_timeout_us);
+        wtatom::unlock(server->_level_lock);
         
         toscreen << "Connected to " << "[Client]" << sk_info_str << ".\n";
         
     } else if (hand_info == h_handshake_info) { // Is a lander.
         // Send OK information to lander.
         uint16_t hhr = htons(h_handshake_ret);
-        write(tar_socket, &hhr, sizeof(uint16_t));
+        wttool::write_all(tar_socket, &hhr, sizeof(uint16_t), io_timeout_us);
         
         // Set lander socket as NONBLOCK.
         int flg = fcntl(tar_socket, F_GETFL, 0);
@@ -236,6 +320,14 @@ void* WTLogServer::_listen_unknown_socket(void* args) {
         // Set _on_send tag.
         server->_on_send[tar_socket] = true;
         
+        // Prepare the queue of this lander, then clients can push logs to it.
+        wtatom::AtomQueue<SendInfo>* queue = nullptr;
+        if (server->_lander_queue.find(tar_socket, &queue) == false) {
+            queue = new wtatom::AtomQueue<SendInfo>(1024, wtatom::QueueMode::segment);
+            server->_lander_queue.insert(std::make_pair(tar_socket, queue));
+        }
+        server->_sending_queue.insert(std::make_pair(tar_socket, queue));
+        
         // Create thread for sending.
         pthread_t s_t;
         void* param_t = malloc(sizeof(int) + sizeof(void*));
@@ -249,10 +341,10 @@ void* WTLogServer::_listen_unknown_socket(void* args) {
         }
         
         // Add info to socket_info.
-        server->_socket_info[tar_socket] = "[Lander]" + sk_info_str;
+        server->_socket_info.insert(std::make_pair(tar_socket, "[Lander]" + sk_info_str));
         
         // Add send thread to thread pool.
-        server->_send_t[tar_socket] = s_t;
+        server->_send_t.insert(std::make_pair(tar_socket, s_t));
         
         toscreen << "Connected to " << "[Lander]" << sk_info_str << ".\n";
     } else {
@@ -271,10 +363,23 @@ void* WTLogServer::_listen_client(void* args) {
     WTLogServer* server = *(WTLogServer**)(args + sizeof(int));
     free(args);
     char buffer[10240];
+    wttool::BufferedConn conn(l_socket);
+    
+    LanderQueues landers;
+    landers.version = server->_sending_queue.version() - 1;
+    SeqState seq;
+    string packed; // Compressed part of a batch.
+    string frames; // Unpacked batch.
     while (server->_on_listen == true) {
-        // Read head.
+        // Read head. Wake up sometimes to check _on_listen.
         uint16_t recv_head;
-        wttool::safe_read(l_socket, &recv_head, sizeof(uint16_t));
+        wttool::IoStat st = conn.read(&recv_head, sizeof(uint16_t), 2e5);
+        if (st == wttool::io_timeout) {
+            continue;
+        }
+        if (st != wttool::io_ok) {
+            break;
+        }
         recv_head = ntohs(recv_head);
         
         if (debug_mode) {
@@ -292,13 +397,19 @@ void* WTLogServer::_listen_client(void* args) {
             
             server->_socket_info.find_and_remove(l_socket);
             server->_listen_t.find_and_remove(l_socket);
+            server->_client_dropped.find_and_remove(l_socket);
+            server->_client_level.find_and_remove(l_socket);
+            if (seq.seen != nullptr) {
+                // The session ends, it won't reconnect.
+                server->_sessions.find_and_remove(seq.session);
+            }
             
             // There may be something in progress(_send_client is handling), give them 3 sec.
             sleep(3);
             
             // Send confirmation message to client.
             uint16_t reply_to_client = htons(h_close_ret);
-            write(l_socket, &reply_to_client, sizeof(uint16_t));
+            conn.write(&reply_to_client, sizeof(uint16_t), io_timeout_us);
             
             if (debug_mode) {
                 toscreen << "Have sent close comfirmation message to client.\n";
@@ -318,47 +429,279 @@ void* WTLogServer::_listen_client(void* args) {
             }
             
             // Read log.
-            wttool::safe_read(l_socket, buffer, 4 + 2 + 4 + 2);
-            uint16_t con_size = ntohs(*(uint16_t*)(buffer + 4 + 2 + 4));
-            wttool::safe_read(l_socket, buffer + 12, (size_t)con_size);
+            if (conn.read(buffer, log_meta_size, io_timeout_us) != wttool::io_ok) {
+                break;
+            }
+            uint16_t con_size = ntohs(*(uint16_t*)(buffer + log_size_pos));
+            if (con_size > sizeof(buffer) - log_meta_size) {
+                toscreen << "A log from client is too long: " << con_size << ".\n";
+                break;
+            }
+            if (conn.read(buffer + log_meta_size, (size_t)con_size, io_timeout_us) != wttool::io_ok) {
+                break;
+            }
             
             if (debug_mode) {
                 toscreen << "Log size: " << con_size << ".\n";
             }
             
-            // Construct SendInfo and push that to _send_to_lander queue.
-            SendInfo info(recv_head, string(buffer, con_size + 12));
-            server->_send_to_lander.push(info);
+            if (_claim(seq, 1) != 0) {
+                // Sent before reconnecting.
+                continue;
+            }
+            server->_route_log(l_socket, recv_head, buffer, con_size + log_meta_size, landers);
             
-            if (debug_mode) {
-                toscreen << "Send the log to queue successfully.\n";
+        } else if (recv_head == h_send_batch) {
+            // Compressed logs. Relay them if no log needs this server, otherwise handle them one by one.
+            if (conn.read(buffer, batch_meta_size, io_timeout_us) != wttool::io_ok) {
+                break;
+            }
+            uint8_t codec = (uint8_t)buffer[0];
+            uint8_t flags = (uint8_t)buffer[1];
+            uint16_t format_num = ntohs(*(uint16_t*)(buffer + 2));
+            uint32_t log_num = ntohl(*(uint32_t*)(buffer + 4));
+            uint32_t raw_size = ntohl(*(uint32_t*)(buffer + 8));
+            uint32_t packed_size = ntohl(*(uint32_t*)(buffer + 12));
+            if (raw_size > max_batch_size || packed_size > max_batch_size) {
+                toscreen << "A batch from client is too large: " << raw_size << ".\n";
+                break;
+            }
+            size_t ids_size = format_num * sizeof(uint64_t);
+            packed.resize(batch_meta_size + ids_size + packed_size);
+            memcpy(&packed[0], buffer, batch_meta_size);
+            if (conn.read_direct(&packed[batch_meta_size], ids_size + packed_size, io_timeout_us) != wttool::io_ok) {
+                break;
             }
             
-            // If need reply, establish mappings of hash_id and client_socket.
-            if (recv_head == h_send_log_need_reply) {
-                uint32_t hash_id = ntohl(*(uint32_t*)(buffer + 6));
-                server->_hash_socket[hash_id] = l_socket;
+            uint64_t seen = _claim(seq, log_num);
+            if (seen == log_num) {
+                if (debug_mode) {
+                    toscreen << "Discarded a batch of " << log_num << " logs sent before reconnecting.\n";
+                }
+                continue;
+            }
+            if ((flags & batch_relay) != 0 && seen == 0) {
+                server->_to_lander(l_socket, SendInfo(h_send_batch, packed), landers);
                 
                 if (debug_mode) {
-                    toscreen << "It is a log need reply. Saved hash_id: " << hash_id << ".\n";
+                    toscreen << "Relayed a batch of " << packed_size << " bytes to the lander queue.\n";
                 }
+                continue;
+            }
+            frames.resize(raw_size);
+            if (decompress_block(codec, &packed[batch_meta_size + ids_size], packed_size, &frames[0], raw_size) == false || 
+                server->_route_frames(l_socket, &frames[0], raw_size, seen, landers) == false) {
+                toscreen << "A broken batch from client, codec: " << (int)codec << ".\n";
+                break;
+            }
+            
+        } else if (recv_head == h_format_def) {
+            // A format for the following logs, kept for the landers.
+            if (conn.read(buffer, 8 + 2, io_timeout_us) != wttool::io_ok) {
+                break;
+            }
+            uint64_t format_id = *(uint64_t*)buffer;
+            uint16_t fmt_size = ntohs(*(uint16_t*)(buffer + 8));
+            if (fmt_size > sizeof(buffer)) {
+                toscreen << "A format from client is too long: " << fmt_size << ".\n";
+                break;
+            }
+            if (conn.read(buffer, fmt_size, io_timeout_us) != wttool::io_ok) {
+                break;
+            }
+            server->_formats.insert(std::make_pair(format_id, string(buffer, fmt_size)));
+            
+            if (debug_mode) {
+                toscreen << "Client defined format " << format_id << ".\n";
+            }
+        } else if (recv_head == h_client_id) {
+            // A reconnecting client has the same session, find what it sent before.
+            uint64_t session = 0;
+            if (conn.read(&session, sizeof(uint64_t), io_timeout_us) != wttool::io_ok) {
+                break;
+            }
+            seq.session = be64toh(session);
+            if (server->_sessions.find(seq.session, &seq.seen) == false) {
+                seq.seen = std::make_shared<std::atomic<uint64_t> >(0);
+                server->_sessions.insert(std::make_pair(seq.session, seq.seen));
             }
             
+            if (debug_mode) {
+                toscreen << "Client session: " << seq.session << ", logs seen: " << seq.seen->load() << ".\n";
+            }
+        } else if (recv_head == h_seq_mark) {
+            // Sequence number of the next log.
+            uint64_t next = 0;
+            if (conn.read(&next, sizeof(uint64_t), io_timeout_us) != wttool::io_ok) {
+                break;
+            }
+            seq.next = be64toh(next);
+        } else if (recv_head == h_drop_report) {
+            // Client dropped some logs because of its queue limit.
+            uint32_t delta[log_level_num];
+            if (conn.read(delta, sizeof(delta), io_timeout_us) != wttool::io_ok) {
+                break;
+            }
+            DropCount dropped;
+            server->_client_dropped.find(l_socket, &dropped);
+            for (size_t i = 0; i < log_level_num; ++i) {
+                dropped.count[i] += ntohl(delta[i]);
+            }
+            server->_client_dropped[l_socket] = dropped;
+            
+            if (debug_mode) {
+                toscreen << "Client dropped logs, info: " << ntohl(delta[LogLevel::info]) 
+                    << ", debug: " << ntohl(delta[LogLevel::debug]) 
+                    << ", warning: " << ntohl(delta[LogLevel::warning]) 
+                    << ", error: " << ntohl(delta[LogLevel::error]) << ".\n";
+            }
         } else {
             toscreen << "Unsupported head: " << recv_head << ".\n";
         }
     }
+    
+    if (server->_on_listen == true) {
+        // The client is lost without closing, or sent a broken message.
+        toscreen << "Lost the connection with the client.\n";
+        server->_socket_info.find_and_remove(l_socket);
+        server->_listen_t.find_and_remove(l_socket);
+        server->_client_dropped.find_and_remove(l_socket);
+        server->_client_level.find_and_remove(l_socket);
+        close(l_socket);
+    }
     pthread_exit(nullptr);
 }
 
+void WTLogServer::_to_lander(int l_socket, SendInfo&& info, LanderQueues& landers) {
+    uint64_t cur_version = _sending_queue.version();
+    if (cur_version != landers.version) {
+        landers.queues.clear();
+        _sending_queue.get_all(nullptr, &landers.queues);
+        landers.version = cur_version;
+    }
+    if (landers.queues.empty()) {
+        _send_to_lander.push(std::move(info));
+    } else {
+        landers.queues[l_socket % landers.queues.size()]->push(std::move(info));
+    }
+}
+
+void WTLogServer::_route_log(int l_socket, uint16_t head, char* log, size_t size, LanderQueues& landers) {
+    // If need reply, remember the client and its hash_id, give the log a hash_id of this server.
+    // Ids of different clients may be the same, the lander only sees the server ones.
+    // Do it before pushing, the reply may come back before this thread continues.
+    if (head == h_send_log_need_reply) {
+        uint32_t hash_id = ntohl(*(uint32_t*)(log + log_hash_pos));
+        uint32_t svr_hash_id = 0;
+        if (_reply_route.insert(ReplyRoute(l_socket, hash_id), &svr_hash_id) == false) {
+            // Too many pending replies. Land it, the client will time out.
+            toscreen << "Too many logs waitting for reply, the reply is discarded.\n";
+            head = h_send_log;
+        }
+        svr_hash_id = htonl(svr_hash_id);
+        memcpy(log + log_hash_pos, &svr_hash_id, sizeof(uint32_t));
+        
+        if (debug_mode) {
+            toscreen << "It is a log need reply. Client hash_id: " << hash_id 
+                << ", server hash_id: " << ntohl(svr_hash_id) << ".\n";
+        }
+    }
+    
+    _to_lander(l_socket, SendInfo(head, string(log, size)), landers);
+    
+    if (debug_mode) {
+        toscreen << "Send the log to queue successfully.\n";
+    }
+}
+
+uint64_t WTLogServer::_claim(SeqState& seq, uint64_t num) {
+    if (seq.seen == nullptr) {
+        return 0;
+    }
+    uint64_t first = seq.next;
+    seq.next += num;
+    
+    // Another connection of the session may be sending the same logs, whichever comes first lands them.
+    uint64_t seen = seq.seen->load(std::memory_order_acquire);
+    while (true) {
+        if (first + num <= seen) {
+            return num;
+        }
+        if (seq.seen->compare_exchange_weak(seen, first + num, std::memory_order_acq_rel) == true) {
+            return seen > first ? seen - first : 0;
+        }
+    }
+}
+
+bool WTLogServer::_route_frames(int l_socket, char* frames, size_t size, size_t skip, LanderQueues& landers) {
+    size_t pos = 0;
+    while (pos + sizeof(uint16_t) <= size) {
+        uint16_t head = ntohs(*(uint16_t*)(frames + pos));
+        char* frame = frames + pos + sizeof(uint16_t);
+        size_t left = size - pos - sizeof(uint16_t);
+        if (head == h_send_log || head == h_send_log_need_reply) {
+            if (left < log_meta_size) {
+                return false;
+            }
+            size_t log_size = log_meta_size + ntohs(*(uint16_t*)(frame + log_size_pos));
+            if (left < log_size) {
+                return false;
+            }
+            if (skip == 0) {
+                _route_log(l_socket, head, frame, log_size, landers);
+            } else {
+                --skip;
+            }
+            pos += sizeof(uint16_t) + log_size;
+        } else if (head == h_format_def) {
+            if (left < 8 + 2) {
+                return false;
+            }
+            uint64_t format_id = *(uint64_t*)frame;
+            uint16_t fmt_size = ntohs(*(uint16_t*)(frame + 8));
+            if (left < (size_t)8 + 2 + fmt_size) {
+                return false;
+            }
+            _formats.insert(std::make_pair(format_id, string(frame + 8 + 2, fmt_size)));
+            pos += sizeof(uint16_t) + 8 + 2 + fmt_size;
+        } else {
+            return false;
+        }
+    }
+    return pos == size;
+}
+
 void* WTLogServer::_send_client(void* args) {
-    char buffer[10240];
+    char buffer[2 + 4 + 2];
     SendInfo s_info;
     WTLogServer* server = (WTLogServer*)args;
     while (server->_on_listen == true || server->_send_to_client.size() != 0) {
-        if (server->_send_to_client.get(&s_info) == false) {
+        // Forget the logs whose reply is lost.
+        size_t expired = server->_reply_route.expire();
+        if (debug_mode && expired != 0) {
+            toscreen << expired << " replies are not received in time, forgot them.\n";
+        }
+        
+        // Level changes from set_client_level.
+        while (server->_control_to_client.get(&s_info) == true) {
+            int socket = *(const int*)s_info.content.c_str();
+            if (server->_client_level.find(socket) == false) {
+                // The client is gone.
+                continue;
+            }
+            char message[sizeof(uint16_t) * 2];
+            uint16_t h_sent = htons(s_info.head);
+            memcpy(message, &h_sent, sizeof(uint16_t));
+            memcpy(message + sizeof(uint16_t), s_info.content.c_str() + sizeof(int), sizeof(uint16_t));
+            wttool::write_all(socket, message, sizeof(message), io_timeout_us);
+            
+            if (debug_mode) {
+                toscreen << "Sent the min level to client " << socket << ".\n";
+            }
+        }
+        
+        if (server->_send_to_client.get_wait(&s_info, 1e5) == false) {
             // Nothing to be sent.
-            usleep(1e5);
             continue;
         }
         
@@ -372,7 +715,6 @@ void* WTLogServer::_send_client(void* args) {
             memcpy(buffer, &h_sent, sizeof(uint16_t));
             memcpy(buffer + sizeof(uint16_t), s_info.content.c_str(), 4 + 2);
             uint16_t rly_len = ntohs(*(uint16_t*)(s_info.content.c_str() + 4));
-            memcpy(buffer + 64, s_info.content.c_str() + 6, (size_t)rly_len);
             
             if (debug_mode) {
                 toscreen << "Reply message length: " << rly_len << ".\n";
@@ -380,19 +722,26 @@ void* WTLogServer::_send_client(void* args) {
             
             // Get the reply target client.
             uint32_t hash_id = ntohl(*(uint32_t*)s_info.content.c_str());
-            int c_socket;
-            if (server->_hash_socket.find_and_remove(hash_id, &c_socket) == false) {
-                // The link from this target client has been disconnected.
+            ReplyRoute route;
+            if (server->_reply_route.find_and_remove(hash_id, &route) == false) {
+                // Too late, or the link from this target client has been disconnected.
                 toscreen << "Cannot find the corresponding client, discard the reply.\n";
                 continue;
             }
             
             if (debug_mode) {
-                toscreen << "The reply hash_id: " << hash_id << ".\n";
+                toscreen << "The reply hash_id: " << hash_id << ", client hash_id: " << route.hash_id << ".\n";
             }
             
-            // Send to client.
-            write(c_socket, buffer, 2 + 4 + 2 + rly_len);
+            // Send to client with the hash_id of the client.
+            uint32_t c_hash_id = htonl(route.hash_id);
+            memcpy(buffer + sizeof(uint16_t), &c_hash_id, sizeof(uint32_t));
+            iovec iov[2];
+            iov[0].iov_base = buffer;
+            iov[0].iov_len = 2 + 4 + 2;
+            iov[1].iov_base = const_cast<char*>(s_info.content.c_str() + 6);
+            iov[1].iov_len = rly_len;
+            wttool::writev_all(route.socket, iov, 2, io_timeout_us);
             
             if (debug_mode) {
                 toscreen << "Successuflly sent the reply to client.\n";
@@ -408,36 +757,61 @@ void* WTLogServer::_send_client(void* args) {
 void* WTLogServer::_listen_lander(void* args) {
     char buffer[10240];
     WTLogServer* server = (WTLogServer*)args;
+    std::map<int, wttool::BufferedConn*> conns; // Received bytes of each lander.
+    std::vector<pollfd> pfds;
     while (server->_on_listen == true || server->_send_t.size() != 0) {
-        // Get all sockets to lander.
-        std::vector<int> alive_lander_socket;
-        server->_send_t.get_all(&alive_lander_socket, nullptr);
+        // Get all sockets to lander. The snapshot stays valid when landers are removed below.
+        auto alive_lander = server->_send_t.read();
         
-        // Looply check each lander.
+        // Looply check each lander. A message is handled when it has completely arrived.
+        bool handled = false;
         uint16_t recv_head;
-        for (size_t i = 0; i < alive_lander_socket.size(); ++i) {
+        for (auto it = alive_lander->begin(); it != alive_lander->end(); ++it) {
             // Try to read a message head.
-            int cur_s = alive_lander_socket[i];
-            int ret = read(cur_s, &recv_head, sizeof(uint16_t));
-            if (ret <= 0) {
+            int cur_s = it->first;
+            wttool::BufferedConn*& conn = conns[cur_s];
+            if (conn == nullptr) {
+                conn = new wttool::BufferedConn(cur_s);
+            }
+            wttool::IoStat st = conn->peek(&recv_head, sizeof(uint16_t), 0);
+            if (st == wttool::io_timeout) {
                 // No message. Check next lander.
                 continue;
             }
+            if (st != wttool::io_ok) {
+                // The lander is lost without closing. Its queue will be stolen by other landers.
+                toscreen << "Lost the connection with a lander.\n";
+                server->_sending_queue.find_and_remove(cur_s);
+                server->_send_t.find_and_remove(cur_s, nullptr);
+                server->_on_send.erase(cur_s);
+                server->_socket_info.find_and_remove(cur_s, nullptr);
+                delete conn;
+                conns.erase(cur_s);
+                close(cur_s);
+                continue;
+            }
+            
             // Have message, read and handle.
             recv_head = ntohs(recv_head);
             if (recv_head == h_log_receive_success) {
+                // Is a success reply to client. Wait until the whole reply has arrived.
+                if (conn->peek(buffer, 2 + 4 + 2, 0) != wttool::io_ok) {
+                    continue;
+                }
+                uint16_t rly_len = ntohs(*(uint16_t*)(buffer + 2 + 4));
+                if (conn->read(buffer, 2 + 4 + 2 + rly_len, 0) != wttool::io_ok) {
+                    continue;
+                }
+                handled = true;
+                
                 if (debug_mode) {
                     toscreen << "From TCP, received a reply message.\n";
                 }
                 
-                // Is a success reply to client.
-                // Read the reply message. Construct the SendInfo.
+                // Construct the SendInfo.
                 SendInfo s_inf;
                 s_inf.head = recv_head;
-                wttool::safe_read(cur_s, buffer, 4 + 2);
-                uint16_t rly_len = ntohs(*(uint16_t*)(buffer + 4));
-                wttool::safe_read(cur_s, buffer + 6, rly_len);
-                s_inf.content = string(buffer, 6 + rly_len);
+                s_inf.content = string(buffer + 2, 4 + 2 + rly_len);
                 
                 if (debug_mode) {
                     uint32_t rly_hash_id = ntohl(*(uint32_t*)s_inf.content.c_str());
@@ -445,34 +819,36 @@ void* WTLogServer::_listen_lander(void* args) {
                 }
                 
                 // Push SendInfo to _send_to_client queue.
-                server->_send_to_client.push(s_inf);
+                server->_send_to_client.push(std::move(s_inf));
                 
                 if (debug_mode) {
                     toscreen << "Pushed this message to _send_to_client queue.\n";
                 }
                 
                 continue;
-            } else if (recv_head == h_stop_send_log) {
+            } 
+            
+            conn->read(&recv_head, sizeof(uint16_t), 0);
+            handled = true;
+            recv_head = ntohs(recv_head);
+            if (recv_head == h_stop_send_log) {
                 // Lander told the server not to send log to it.
                 if (debug_mode) {
                     toscreen << "Received the lander's not sending log request.\n";
                 }
+                // Stop pushing logs to its queue, the remaining logs will be stolen by other landers.
+                server->_sending_queue.find_and_remove(cur_s);
                 server->_on_send[cur_s] = false;
                 
                 // Waitting the _send_lander thread to close.
-                pthread_t st;
-                if (server->_send_t.find(cur_s, &st) == false) {
-                    toscreen << "[ERROR]Cannot find the thread id of a lander.\n";
-                    continue;
-                }
-                pthread_join(st, nullptr);
+                pthread_join(it->second, nullptr);
                 if (debug_mode) {
                     toscreen << "The _send_lander thread is closed.\n";
                 }
                 
                 // Send feedback.
                 uint16_t s_head = htons(h_stop_send_log_reply);
-                write(cur_s, &s_head, sizeof(uint16_t));
+                conn->write(&s_head, sizeof(uint16_t), io_timeout_us);
                 
                 if (debug_mode) {
                     toscreen << "Sent h_stop_send_log_reply.\n";
@@ -484,15 +860,18 @@ void* WTLogServer::_listen_lander(void* args) {
                 }
                 
                 // Clean the resources for this lander.
+                server->_sending_queue.find_and_remove(cur_s);
                 server->_send_t.find_and_remove(cur_s, nullptr);
                 server->_on_send.erase(cur_s);
                 server->_socket_info.find_and_remove(cur_s, nullptr);
                 
                 // Send reply.
                 uint16_t s_head = htons(h_close_with_lander_reply);
-                write(cur_s, &s_head, sizeof(uint16_t));
+                conn->write(&s_head, sizeof(uint16_t), io_timeout_us);
                 
                 // Close.
+                delete conn;
+                conns.erase(cur_s);
                 close(cur_s);
                 if (debug_mode) {
                     toscreen << "Closed the socket, finish all connection with the lander.\n";
@@ -501,6 +880,25 @@ void* WTLogServer::_listen_lander(void* args) {
                 toscreen << "Listen from lander find unknown head: " << recv_head << ".\n";
             }
         }
+        
+        if (handled == false) {
+            // Nothing complete arrived, wait until some lander has new bytes.
+            pfds.clear();
+            for (auto it = alive_lander->begin(); it != alive_lander->end(); ++it) {
+                if (conns.find(it->first) == conns.end()) {
+                    continue;
+                }
+                pollfd pfd;
+                pfd.fd = it->first;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                pfds.push_back(pfd);
+            }
+            poll(pfds.empty() ? nullptr : &pfds[0], pfds.size(), 20);
+        }
+    }
+    for (auto it = conns.begin(); it != conns.end(); ++it) {
+        delete it->second;
     }
     pthread_exit(nullptr);
 }
@@ -509,9 +907,16 @@ void* WTLogServer::_send_lander(void* args) {
     int l_socket = *(int*)args;
     WTLogServer* server = *(WTLogServer**)(args + sizeof(int));
     free(args);
-    char buffer[10240];
-    SendInfo s_info;
-    while (server->_on_listen == true || server->_send_to_lander.size() != 0) {
+    const size_t batch_size = 64; // Max messages sent to lander at once.
+    std::vector<SendInfo> s_info(batch_size);
+    std::vector<uint16_t> heads(batch_size);
+    std::vector<iovec> iov(batch_size * 3); // Head and the rest of each message, maybe after formats.
+    std::deque<string> defs; // Formats sent with the batch, not moved when more are added.
+    std::unordered_set<uint64_t> sent_formats; // Formats this lander has got.
+    wtatom::AtomQueue<SendInfo>* queue = nullptr;
+    server->_lander_queue.find(l_socket, &queue);
+    
+    while (server->_on_listen == true || queue->size() != 0) {
         // Check the local tag.
         if (server->_on_send[l_socket] == false) {
             // The lander has told this server not send log to it.
@@ -519,39 +924,119 @@ void* WTLogServer::_send_lander(void* args) {
             pthread_exit(nullptr);
         }
         
-        // Get a new message to lander.
-        if (server->_send_to_lander.get(&s_info) == false) {
+        // Get new messages to lander. Steal if the own queue is empty.
+        size_t msg_num = queue->get_batch(&s_info[0], batch_size);
+        if (msg_num == 0) {
+            auto queues = server->_lander_queue.read();
+            msg_num = server->_steal(queue, *queues, &s_info[0], batch_size);
+        }
+        if (msg_num == 0) {
+            // Wait shortly, then look at other queues again.
+            msg_num = queue->get_batch_wait(&s_info[0], batch_size, 2e4);
+        }
+        if (msg_num == 0) {
             // No message.
-            usleep(2e5);
             continue;
         }
         
-        // Handle the message.
-        if (s_info.head == h_send_log || s_info.head == h_send_log_need_reply) {
-            // Is a log message.
-            uint16_t head_sent = htons(s_info.head);
-            memcpy(buffer, &head_sent, sizeof(uint16_t)); // Head.
-            memcpy(buffer + 2, s_info.content.c_str(), 4 + 2 + 4 + 2); // Time, Level, hash_id, content_size.
-            uint16_t log_len = ntohs(*(uint16_t*)(buffer + 12));
-            memcpy(buffer + 14, s_info.content.c_str() + 12, (size_t)log_len); // Log content.
-            
-            if (debug_mode) {
-                uint32_t sent_hash_id = ntohl(*(uint32_t*)(s_info.content.c_str() + 6));
-                toscreen << "Start to send a log to lander, hash_id: " << sent_hash_id 
-                    << ", content length: " << log_len << ".\n";
+        // Handle the messages. Content is already in the send format: 
+        // Time, Level, hash_id, content_size and log content. Only the head is added.
+        size_t iov_num = 0;
+        size_t total = 0;
+        defs.clear();
+        auto add = [&](const void* base, size_t len) {
+            if (iov_num == iov.size()) {
+                iov.resize(iov.size() * 2);
             }
-            
-            // Send to the lander.
-            wttool::safe_write(l_socket, buffer, 14 + log_len);
-            
-            if (debug_mode) {
-                toscreen << "Sent totally: " << 14 + log_len << " bytes.\n";
+            iov[iov_num].iov_base = const_cast<void*>(base);
+            iov[iov_num].iov_len = len;
+            ++iov_num;
+            total += len;
+        };
+        
+        // A formatted log needs its format first, once in this connection.
+        auto define = [&](uint64_t format_id) {
+            string fmt;
+            if (sent_formats.find(format_id) != sent_formats.end() || 
+                server->_formats.find(format_id, &fmt) == false) {
+                return;
             }
-        } else {
-            toscreen << "Send to lander find unknown head: " << s_info.head << ".\n";
+            sent_formats.insert(format_id);
+            uint16_t def_head = htons(h_format_def);
+            uint16_t fmt_size = htons((uint16_t)fmt.size());
+            defs.push_back(string((char*)&def_head, sizeof(uint16_t)));
+            defs.back().append((char*)&format_id, sizeof(uint64_t));
+            defs.back().append((char*)&fmt_size, sizeof(uint16_t));
+            defs.back().append(fmt);
+            add(defs.back().c_str(), defs.back().size());
+        };
+        
+        for (size_t i = 0; i < msg_num; ++i) {
+            const char* content = s_info[i].content.c_str();
+            if (s_info[i].head == h_send_batch) {
+                // Relayed as is. The formats it uses are listed after the meta.
+                uint16_t format_num = ntohs(*(uint16_t*)(content + 2));
+                for (uint16_t f = 0; f < format_num; ++f) {
+                    define(*(uint64_t*)(content + batch_meta_size + f * sizeof(uint64_t)));
+                }
+            } else if (s_info[i].head == h_send_log || s_info[i].head == h_send_log_need_reply) {
+                if ((ntohs(*(uint16_t*)(content + log_level_pos)) & level_fmt_flag) != 0 && 
+                    s_info[i].content.size() >= log_meta_size + sizeof(uint64_t)) {
+                    define(*(uint64_t*)(content + log_meta_size));
+                }
+                
+                if (debug_mode) {
+                    uint32_t sent_hash_id = ntohl(*(uint32_t*)(content + log_hash_pos));
+                    toscreen << "Start to send a log to lander, hash_id: " << sent_hash_id 
+                        << ", content length: " << s_info[i].content.size() - log_meta_size << ".\n";
+                }
+            } else {
+                toscreen << "Send to lander find unknown head: " << s_info[i].head << ".\n";
+                continue;
+            }
+            heads[i] = htons(s_info[i].head);
+            add(&heads[i], sizeof(uint16_t));
+            add(content, s_info[i].content.size());
+        }
+        
+        // Send the whole batch to the lander.
+        if (iov_num != 0 && wttool::writev_all(l_socket, &iov[0], iov_num) != wttool::io_ok) {
+            toscreen << "Write to lander failed, " << msg_num << " logs are lost.\n";
+        }
+        
+        if (debug_mode) {
+            toscreen << "Sent totally: " << total << " bytes.\n";
         }
     }
     pthread_exit(nullptr);
 }
 
+size_t WTLogServer::_steal(wtatom::AtomQueue<SendInfo>* self, 
+    const QueueMap::Snapshot& queues, SendInfo* out, size_t max) {
+    // Logs no lander has taken go first.
+    size_t num = _send_to_lander.get_batch(out, max);
+    if (num != 0) {
+        return num;
+    }
+    
+    // Find the longest queue.
+    wtatom::AtomQueue<SendInfo>* victim = nullptr;
+    size_t victim_size = 0;
+    for (size_t i = 0; i < queues.size(); ++i) {
+        if (queues[i].second == self) {
+            continue;
+        }
+        size_t cur_size = queues[i].second->size();
+        if (cur_size > victim_size) {
+            victim = queues[i].second;
+            victim_size = cur_size;
+        }
+    }
+    if (victim == nullptr) {
+        return 0;
+    }
+    size_t take = (victim_size + 1) / 2;
+    return victim->get_batch(out, take < max ? take : max);
+}
+
 } // End namespace wtlog.
@@ -8,40 +8,92 @@
 #ifndef _WTLOG_SERVER_H_
 #define _WTLOG_SERVER_H_
 
+#include <unordered_set>
+#include <deque>
+#include <memory>
 #include "netprotocol.h"
 #include "wtlogtools.h"
+#include "wtexpiremap.h"
+#include "wtsnapshotmap.h"
+#include "wtlogsocket.h"
+#include "wtlogcodec.h"
 
 using std::string;
 
 namespace wtlog {
 
+/**
+ * Number of logs dropped by a client, reported by the client.
+ */
+struct DropCount {
+    DropCount() {
+        memset(count, 0, sizeof(count));
+    }
+    uint64_t count[log_level_num]; // Index is the LogLevel.
+};
+
 struct StatInfo {
     std::vector<string> client_socket;
+    std::vector<int> client_fd;            // Same order as client_socket.
+    std::vector<DropCount> client_dropped; // Same order as client_socket.
+    std::vector<LogLevel> client_level;    // Same order as client_socket.
     std::vector<string> lander_socket;
+    std::vector<string> queue_name;
+    std::vector<wtatom::QueueStat> queue_stat; // Same order as queue_name.
 };
 
 class WTLogServer {
 private:
     struct SendInfo {
         SendInfo() {}
-        SendInfo(uint16_t h_in, const string& c_in) : head(h_in), content(c_in) {}
-        SendInfo(const SendInfo& in) : head(in.head), content(in.content) {}
-        SendInfo& operator=(const SendInfo& in) {
-            head = in.head;
-            content = in.content;
-        }
+        SendInfo(uint16_t h_in, string c_in) : head(h_in), content(std::move(c_in)) {}
         
         uint16_t head;
         string content;
     };
     
+    /**
+     * Where the reply of a log goes.
+     */
+    struct ReplyRoute {
+        ReplyRoute() : socket(-1), hash_id(0) {}
+        ReplyRoute(int s_in, uint32_t h_in) : socket(s_in), hash_id(h_in) {}
+        
+        int socket;       // Socket of the client.
+        uint32_t hash_id; // The hash_id given by the client.
+    };
+    typedef wtatom::SnapshotMap<int, wtatom::AtomQueue<SendInfo>*> QueueMap;
+    
+    /**
+     * Queues of sending landers seen by a client listener, refreshed when _sending_queue changes.
+     * Checking the version is a plain load, cheaper than entering a snapshot for each log.
+     */
+    struct LanderQueues {
+        LanderQueues() : version(0) {}
+        
+        std::vector<wtatom::AtomQueue<SendInfo>*> queues;
+        uint64_t version;
+    };
+    
+    /**
+     * Sequence numbers seen by a client listener, to discard the logs resent after reconnecting.
+     */
+    struct SeqState {
+        SeqState() : session(0), next(0) {}
+        
+        uint64_t session; // From h_client_id.
+        uint64_t next;    // Sequence number of the next log from this connection.
+        std::shared_ptr<std::atomic<uint64_t> > seen; // Logs below it are seen. Shared by the connections of the session, null before h_client_id.
+    };
+    
 public:
-    friend class wtatom::AtomMap<int, wtatom::AtomQueue<SendInfo>*>;
+    friend class wtatom::SnapshotMap<int, wtatom::AtomQueue<SendInfo>*>;
 
     /** 
-     * Constructive function.
+     * Constructive and destructive function.
      */
     WTLogServer();
+    ~WTLogServer();
     
     /** 
      * Start the server.
@@ -61,6 +113,14 @@ public:
      * Show the status.
      */
     StatInfo status();
+    
+    /**
+     * Tell clients not to send logs below min_level, they stop the logs before queueing them.
+     * @param socket: The client, see StatInfo::client_fd. -1 means all clients, 
+     *      including the ones connected later.
+     * @return false: No such client.
+     */
+    bool set_client_level(LogLevel min_level, int socket = -1);
 
 private:
     /**
@@ -68,14 +128,31 @@ private:
      * For each Lander, we have a send thread.
      * We have one thread listening to all Landers.
      * We have one thread sending info to all Clients.
+     * Connections rarely change but are iterated often, they are kept in snapshot maps.
      */
-    wtatom::AtomMap<int, string>    _socket_info;
-    wtatom::AtomMap<int, pthread_t> _listen_t; // Each client have a listen thread.
-    wtatom::AtomMap<int, pthread_t> _send_t; // Each lander have a send thread.
+    wtatom::SnapshotMap<int, string>    _socket_info;
+    wtatom::SnapshotMap<int, pthread_t> _listen_t; // Each client have a listen thread.
+    wtatom::SnapshotMap<int, pthread_t> _send_t; // Each lander have a send thread.
     wtatom::AtomMap<pthread_t, char> _lus_t; // Threads pids of _listen_unknown_socket.
-    wtatom::AtomQueue<SendInfo>     _send_to_client;
-    wtatom::AtomQueue<SendInfo>     _send_to_lander;
-    wtatom::AtomMap<uint32_t, int>  _hash_socket; // The departure of logs which need reply.
+    wtatom::AtomQueue<SendInfo, wtatom::Producers::Single, wtatom::Consumers::Single> 
+                                    _send_to_client; // From _listen_lander to _send_client.
+    wtatom::AtomQueue<SendInfo>     _send_to_lander; // Logs arrived when no lander is sending.
+    
+    /**
+     * Each lander has a queue, client listeners push logs to the queue of a sending lander.
+     * A lander with an empty queue steals from _send_to_lander and other landers' queues.
+     * Queues are only deleted when the server is destructed, a reused socket reuses its queue.
+     */
+    QueueMap _lander_queue;  // All queues ever created.
+    QueueMap _sending_queue; // Queues of landers accepting logs.
+    wtatom::ExpireSlab<ReplyRoute> _reply_route; // The departure of logs which need reply. Key is the hash_id sent to lander. Forgotten after reply_timeout_us.
+    wtatom::AtomMap<int, DropCount> _client_dropped; // Logs dropped by each client.
+    wtatom::AtomMap<uint64_t, string> _formats; // Format strings defined by clients. Key is the format_id.
+    wtatom::AtomMap<uint64_t, std::shared_ptr<std::atomic<uint64_t> > > _sessions; // SeqState::seen of each session, kept until it closes.
+    wtatom::SnapshotMap<int, LogLevel> _client_level; // Min level of each client.
+    wtatom::AtomQueue<SendInfo> _control_to_client; // Level changes, from set_client_level to _send_client.
+    LogLevel        _default_level; // Min level of clients connected later.
+    pthread_mutex_t _level_lock;    // Keep the messages in _control_to_client in the order of the changes.
     
     sockaddr_in   _svr_addr;   // Listen socket address(For new connection).
     pthread_t     _mon_t;      // Listen thread(For new connection).
@@ -118,6 +195,47 @@ private:
      */
     static void* _send_lander(void* args);
     
+    /**
+     * Push a message from a client to the queue of a lander.
+     * A client always uses the same lander, unless the landers change.
+     */
+    void _to_lander(int l_socket, SendInfo&& info, LanderQueues& landers);
+    
+    /**
+     * Push a log from a client to a lander. If it needs reply, 
+     * remember the client and give it a hash_id of this server.
+     * @param log: [time]...[content] of the log, hash_id may be replaced.
+     */
+    void _route_log(int l_socket, uint16_t head, char* log, size_t size, LanderQueues& landers);
+    
+    /**
+     * Handle the frames of an unpacked batch from a client: logs and format definitions.
+     * @param skip: Number of logs at the beginning which are seen before, only their formats are kept.
+     * @return false: Broken frames, the ones before are handled.
+     */
+    bool _route_frames(int l_socket, char* frames, size_t size, size_t skip, LanderQueues& landers);
+    
+    /**
+     * Take the sequence numbers of the next num logs from a client.
+     * Logs are numbered in order, so the ones seen before are at the beginning.
+     * @return The number of logs seen before, by this or an earlier connection of the session.
+     */
+    static uint64_t _claim(SeqState& seq, uint64_t num);
+    
+    /**
+     * Remember the min level of a client and queue the message to it. Hold _level_lock.
+     */
+    void _set_level_locked(int socket, LogLevel min_level);
+    
+    /**
+     * Get at most max logs from _send_to_lander or the longest queue of other landers.
+     * Take half of the victim queue, so the victim keeps the rest.
+     * @param queues: All lander queues.
+     * @return The number of logs written to out.
+     */
+    size_t _steal(wtatom::AtomQueue<SendInfo>* self, 
+        const QueueMap::Snapshot& queues, SendInfo* out, size_t max);
+    
 }; // End class WTLogServer.
     
 } // End namespace wtlog.
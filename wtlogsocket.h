@@ -0,0 +1,360 @@
+/**
+ * Socket I/O with deadlines.
+ * Reads go through a ring buffer filled by large recv calls, frames are parsed from memory.
+ * Writes gather the pieces of a frame with one sendmsg call.
+ * Author: LiWentan.
+ * Date: 2019/7/18.
+ */
+
+#ifndef _WTLOG_SOCKET_H_
+#define _WTLOG_SOCKET_H_
+
+#include <poll.h>
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include "wtlogtools.h"
+
+namespace wttool {
+
+/**
+ * Result of socket I/O.
+ */
+enum IoStat {
+    io_ok = 0,
+    io_timeout = 1,
+    io_closed = 2, // The remote closed the connection.
+    io_error = 3
+};
+
+/**
+ * Monotonic time, in microsecond.
+ */
+static int64_t mono_us() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Deadline of a timeout counted from now. Negative timeout means no deadline.
+ */
+static int64_t deadline_of(int64_t timeout_us) {
+    return timeout_us < 0 ? -1 : mono_us() + timeout_us;
+}
+
+/**
+ * Wait until the socket is readable(POLLIN) or writable(POLLOUT).
+ * Hang up and error also wake up, the following call reports them.
+ * @param deadline_us: Negative means wait forever.
+ */
+static IoStat wait_ready(int socket, short events, int64_t deadline_us) {
+    while (true) {
+        int wait_ms = -1;
+        if (deadline_us >= 0) {
+            int64_t left = deadline_us - mono_us();
+            if (left <= 0) {
+                return io_timeout;
+            }
+            wait_ms = (int)((left + 999) / 1000);
+        }
+        pollfd pfd;
+        pfd.fd = socket;
+        pfd.events = events;
+        pfd.revents = 0;
+        int ret = poll(&pfd, 1, wait_ms);
+        if (ret > 0) {
+            return io_ok;
+        }
+        if (ret < 0 && errno != EINTR) {
+            return io_error;
+        }
+    }
+}
+
+/**
+ * Write all pieces, works for both blocking and non-blocking sockets.
+ * The iov array is modified.
+ * @param timeout_us: Max waitting time. Negative means wait forever.
+ * @return io_timeout: Part of the data may have been sent.
+ */
+static IoStat writev_all(int socket, iovec* iov, int iov_num, int64_t timeout_us = -1) {
+    int64_t deadline = deadline_of(timeout_us);
+    msghdr msg;
+    memset(&msg, 0, sizeof(msghdr));
+    while (iov_num > 0) {
+        if (iov->iov_len == 0) {
+            ++iov;
+            --iov_num;
+            continue;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_num < IOV_MAX ? iov_num : IOV_MAX;
+        ssize_t ret = sendmsg(socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                IoStat st = wait_ready(socket, POLLOUT, deadline);
+                if (st != io_ok) {
+                    return st;
+                }
+                continue;
+            }
+            return (errno == EPIPE || errno == ECONNRESET) ? io_closed : io_error;
+        }
+
+        // Skip the pieces sent.
+        size_t done = ret;
+        while (iov_num > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            ++iov;
+            --iov_num;
+        }
+        if (done != 0) {
+            iov->iov_base = (char*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return io_ok;
+}
+
+/**
+ * Write all data. Same as writev_all.
+ */
+static IoStat write_all(int socket, const void* buffer, size_t size, int64_t timeout_us = -1) {
+    iovec iov;
+    iov.iov_base = const_cast<void*>(buffer);
+    iov.iov_len = size;
+    return writev_all(socket, &iov, 1, timeout_us);
+}
+
+/**
+ * Read exactly size bytes without buffering, for short exchanges like handshakes.
+ * @param timeout_us: Max waitting time. Negative means wait forever.
+ */
+static IoStat read_all(int socket, void* buffer, size_t size, int64_t timeout_us = -1) {
+    int64_t deadline = deadline_of(timeout_us);
+    size_t fin_size = 0;
+    while (fin_size < size) {
+        ssize_t ret = recv(socket, (char*)buffer + fin_size, size - fin_size, MSG_DONTWAIT);
+        if (ret > 0) {
+            fin_size += ret;
+            continue;
+        }
+        if (ret == 0) {
+            return io_closed;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            IoStat st = wait_ready(socket, POLLIN, deadline);
+            if (st != io_ok) {
+                return st;
+            }
+            continue;
+        }
+        return errno == ECONNRESET ? io_closed : io_error;
+    }
+    return io_ok;
+}
+
+/**
+ * Connect the socket, waitting at most timeout_us instead of the kernel SYN timeout.
+ * The socket is left blocking.
+ * @param timeout_us: Max waitting time. Negative means wait forever.
+ */
+static IoStat connect_within(int socket, const sockaddr* addr, socklen_t addr_len, int64_t timeout_us = -1) {
+    int64_t deadline = deadline_of(timeout_us);
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags < 0 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return io_error;
+    }
+    IoStat st = io_ok;
+    if (connect(socket, addr, addr_len) != 0) {
+        if (errno != EINPROGRESS) {
+            st = io_error;
+        } else {
+            st = wait_ready(socket, POLLOUT, deadline);
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            if (st == io_ok && (getsockopt(socket, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err != 0)) {
+                st = io_error;
+            }
+        }
+    }
+    if (fcntl(socket, F_SETFL, flags) < 0) {
+        return io_error;
+    }
+    return st;
+}
+
+/**
+ * Buffered connection. One thread reads it.
+ * A read which times out consumes nothing, so a partial frame waits in the buffer
+ * and the caller can come back later.
+ */
+class BufferedConn {
+public:
+    /**
+     * Construtive function.
+     * @param capacity: Size of the ring buffer, rounded up to power of 2. Max size of one read.
+     */
+    BufferedConn(int socket = -1, size_t capacity = 1 << 16) :
+        _socket(socket), _capacity(1), _head(0), _tail(0) {
+        while (_capacity < capacity) {
+            _capacity <<= 1;
+        }
+        _buf = new char[_capacity];
+    }
+
+    /**
+     * Distructive function. The socket is not closed.
+     */
+    ~BufferedConn() {
+        delete[] _buf;
+    }
+
+    /**
+     * Use another socket, data buffered from the old one is dropped.
+     */
+    void attach(int socket) {
+        _socket = socket;
+        _head = 0;
+        _tail = 0;
+    }
+
+    int socket() const {
+        return _socket;
+    }
+
+    /**
+     * Bytes received but not read yet.
+     */
+    size_t buffered() const {
+        return _tail - _head;
+    }
+
+    /**
+     * Copy size bytes out without consuming them.
+     * @param timeout_us: Max waitting time. 0 means only take what has arrived. Negative means wait forever.
+     */
+    IoStat peek(void* out, size_t size, int64_t timeout_us = -1) {
+        IoStat st = _fill(size, deadline_of(timeout_us));
+        if (st != io_ok) {
+            return st;
+        }
+        _copy_out(out, size);
+        return io_ok;
+    }
+
+    /**
+     * Read exactly size bytes. Nothing is consumed if it fails.
+     * @param timeout_us: Same as peek.
+     */
+    IoStat read(void* out, size_t size, int64_t timeout_us = -1) {
+        IoStat st = peek(out, size, timeout_us);
+        if (st == io_ok) {
+            _head += size;
+        }
+        return st;
+    }
+
+    /**
+     * Read exactly size bytes, which may exceed the capacity, e.g. a large payload.
+     * Take what is buffered, then receive the rest into out directly.
+     * Bytes are consumed even if it fails, so close the connection then.
+     * @param timeout_us: Same as peek.
+     */
+    IoStat read_direct(void* out, size_t size, int64_t timeout_us = -1) {
+        if (size <= _capacity) {
+            return read(out, size, timeout_us);
+        }
+        size_t taken = std::min(size, (size_t)(_tail - _head));
+        _copy_out(out, taken);
+        _head += taken;
+        return read_all(_socket, (char*)out + taken, size - taken, timeout_us);
+    }
+
+    /**
+     * Write pieces with one call. Writing is not buffered.
+     */
+    IoStat write(iovec* iov, int iov_num, int64_t timeout_us = -1) {
+        return writev_all(_socket, iov, iov_num, timeout_us);
+    }
+
+    IoStat write(const void* buffer, size_t size, int64_t timeout_us = -1) {
+        return write_all(_socket, buffer, size, timeout_us);
+    }
+
+private:
+    BufferedConn(const BufferedConn&);
+    BufferedConn& operator=(const BufferedConn&);
+
+    int _socket;
+    char* _buf;
+    size_t _capacity;
+    uint64_t _head; // Read position, only increases.
+    uint64_t _tail; // Write position, only increases.
+
+private:
+    /**
+     * Receive until at least size bytes are buffered. Receive as much as the free space.
+     */
+    IoStat _fill(size_t size, int64_t deadline_us) {
+        if (size > _capacity) {
+            return io_error;
+        }
+        while (_tail - _head < size) {
+            // The free space may wrap around the end of the ring.
+            size_t free_size = _capacity - (_tail - _head);
+            size_t pos = _tail & (_capacity - 1);
+            iovec iov[2];
+            iov[0].iov_base = _buf + pos;
+            iov[0].iov_len = std::min(free_size, _capacity - pos);
+            iov[1].iov_base = _buf;
+            iov[1].iov_len = free_size - iov[0].iov_len;
+            msghdr msg;
+            memset(&msg, 0, sizeof(msghdr));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = (iov[1].iov_len == 0) ? 1 : 2;
+            ssize_t ret = recvmsg(_socket, &msg, MSG_DONTWAIT);
+            if (ret > 0) {
+                _tail += ret;
+                continue;
+            }
+            if (ret == 0) {
+                return io_closed;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                IoStat st = wait_ready(_socket, POLLIN, deadline_us);
+                if (st != io_ok) {
+                    return st;
+                }
+                continue;
+            }
+            return errno == ECONNRESET ? io_closed : io_error;
+        }
+        return io_ok;
+    }
+
+    void _copy_out(void* out, size_t size) {
+        size_t pos = _head & (_capacity - 1);
+        size_t first = std::min(size, _capacity - pos);
+        memcpy(out, _buf + pos, first);
+        memcpy((char*)out + first, _buf, size - first);
+    }
+};
+
+} // End namespace wttool.
+
+#endif // End ifdef _WTLOG_SOCKET_H_.
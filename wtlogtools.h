@@ -86,17 +86,23 @@ static void unlock(pthread_rwlock_t& lock) {
     return;
 }
 
-template <typename KeyType, typename ValType>
+/**
+ * Thread safe hash map.
+ * Elements are spread into StripeNum stripes by the hash of the key, 
+ * each stripe has its own lock, so operations on different stripes never wait each other.
+ */
+template <typename KeyType, typename ValType, size_t StripeNum = 32>
 class AtomMap {
 public:
     template <typename K, typename V>
     class ElementPointer {
     public:
-        ElementPointer(AtomMap<K, V>* map, const K& key) : _map(map), _key(key) {}
+        ElementPointer(AtomMap<K, V, StripeNum>* map, const K& key) : _map(map), _key(key) {}
         ElementPointer(const ElementPointer<K, V>& content) : _map(content._map), _key(content._key) {}
         ElementPointer<K, V>& operator=(const ElementPointer<K, V>& content) {
             _map = content._map;
             _key = content._key;
+            return *this;
         }
         bool operator==(const ElementPointer<K, V>& content) {
             if (_map == content._map && _key == content._key) {
@@ -111,25 +117,42 @@ public:
         }
         ElementPointer<K, V>& operator=(const V& val) {
             _map->insert(std::make_pair(_key, val));
+            return *this;
         }
     
     private:
-        AtomMap<K, V>* _map;
+        AtomMap<K, V, StripeNum>* _map;
         K _key;
     };
 
+private:
+    /**
+     * A part of the map, owns its lock.
+     */
+    struct Stripe {
+        pthread_rwlock_t _lock;
+        std::unordered_map<KeyType, ValType> _data;
+        char _pad[wtatom::cache_line_size]; // Keep the lock away from the next stripe.
+    };
+
 public:
     /**
      * Construtive function.
      */
     AtomMap() {
-        pthread_rwlock_init(&_lock, nullptr);
+        for (size_t i = 0; i < StripeNum; ++i) {
+            pthread_rwlock_init(&_stripe[i]._lock, nullptr);
+        }
     }
     
     /**
      * Distructive function.
      */
-    virtual ~AtomMap() {}
+    virtual ~AtomMap() {
+        for (size_t i = 0; i < StripeNum; ++i) {
+            pthread_rwlock_destroy(&_stripe[i]._lock);
+        }
+    }
     
     /**
      * Insert elements.
@@ -137,16 +160,14 @@ public:
      * @return false: Already existing key. Overwrite the value.
      */
     bool insert(const std::pair<KeyType, ValType>& content) {
-        lockw(_lock);
-        auto it = _data.find(content.first);
-        if (it != _data.cend()) {
-            it->second = content.second;
-            unlock(_lock);
-            return false;
+        Stripe& st = _stripe_of(content.first);
+        lockw(st._lock);
+        auto res = st._data.insert(content);
+        if (res.second == false) {
+            res.first->second = content.second;
         }
-        _data.insert(content);
-        unlock(_lock);
-        return true;
+        unlock(st._lock);
+        return res.second;
     }
     
     /**
@@ -155,16 +176,17 @@ public:
      * @return false: Unexisting key.
      */
     bool find(const KeyType& key, ValType* val = nullptr) {
-        lockr(_lock);
-        auto it = _data.find(key);
-        if (it == _data.cend()) {
-            unlock(_lock);
+        Stripe& st = _stripe_of(key);
+        lockr(st._lock);
+        auto it = st._data.find(key);
+        if (it == st._data.cend()) {
+            unlock(st._lock);
             return false;
         }
         if (val != nullptr) {
             *val = it->second;
         }
-        unlock(_lock);
+        unlock(st._lock);
         return true;
     }
     
@@ -174,36 +196,41 @@ public:
      * @return false: Unexisting key.
      */
     bool find_and_remove(const KeyType& key, ValType* val = nullptr) {
-        lockw(_lock);
-        auto it = _data.find(key);
-        if (it == _data.cend()) {
-            unlock(_lock);
+        Stripe& st = _stripe_of(key);
+        lockw(st._lock);
+        auto it = st._data.find(key);
+        if (it == st._data.cend()) {
+            unlock(st._lock);
             return false;
         }
         if (val != nullptr) {
-            *val = it->second;
+            *val = std::move(it->second);
         }
-        _data.erase(it);
-        unlock(_lock);
+        st._data.erase(it);
+        unlock(st._lock);
         return true;
     }
     
     /** 
      * Get all elements.
+     * Stripes are locked one by one, it is not a snapshot of the whole map.
      */
     void get_all(std::vector<KeyType>* key, std::vector<ValType>* val) {
-        lockr(_lock);
-        auto it = _data.begin();
-        while (it != _data.end()) {
-            if (key != nullptr) {
-                key->push_back(it->first);
-            }
-            if (val != nullptr) {
-                val->push_back(it->second);
+        for (size_t i = 0; i < StripeNum; ++i) {
+            Stripe& st = _stripe[i];
+            lockr(st._lock);
+            auto it = st._data.begin();
+            while (it != st._data.end()) {
+                if (key != nullptr) {
+                    key->push_back(it->first);
+                }
+                if (val != nullptr) {
+                    val->push_back(it->second);
+                }
+                ++it;
             }
-            ++it;
+            unlock(st._lock);
         }
-        unlock(_lock);
     }
     
     /**
@@ -218,9 +245,12 @@ public:
      * Get the size.
      */
     size_t size() {
-        lockr(_lock);
-        size_t res = _data.size();
-        unlock(_lock);
+        size_t res = 0;
+        for (size_t i = 0; i < StripeNum; ++i) {
+            lockr(_stripe[i]._lock);
+            res += _stripe[i]._data.size();
+            unlock(_stripe[i]._lock);
+        }
         return res;
     }
     
@@ -228,14 +258,28 @@ public:
      * Clear.
      */
     void clear() {
-        lockw(_lock);
-        _data.clear();
-        unlock(_lock);
+        for (size_t i = 0; i < StripeNum; ++i) {
+            lockw(_stripe[i]._lock);
+            _stripe[i]._data.clear();
+            unlock(_stripe[i]._lock);
+        }
     }
     
 private:
-    std::unordered_map<KeyType, ValType> _data;
-    pthread_rwlock_t _lock;
+    Stripe _stripe[StripeNum];
+    
+private:
+    /**
+     * Find the stripe of the key. 
+     * Mix the hash, since the hash of an integer is itself.
+     */
+    Stripe& _stripe_of(const KeyType& key) {
+        uint64_t h = std::hash<KeyType>()(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return _stripe[h % StripeNum];
+    }
 };
 
 } // End namespace wtatom.
@@ -261,46 +305,6 @@ static uint32_t str2hash(const string& str, bool use_time = false) {
     return res;
 }
 
-/**
- * Read data blockingly until it is completely read.
- * @return 0: Read the correct size.
- * @return 1: Timeout.
- */
-static int safe_read(int socket, void* buffer, size_t size) {
-    size_t fin_size = 0;
-    while (fin_size < size) {
-        int ret = read(socket, buffer + fin_size, size - fin_size);
-        if (ret == size - fin_size) {
-            // Finish read.
-            return 0;
-        }
-        if (ret <= 0) {
-            // Read nothing.
-            continue;
-        }
-        fin_size += ret;
-    }
-    return 0;
-}
-
-/**
- * Write data to a non-blocking socket.
- */
-static int safe_write(int socket, void* buffer, size_t size) {
-    size_t fin_size = 0;
-    while (fin_size < size) {
-        int ret = write(socket, buffer + fin_size, size - fin_size);
-        if (ret == size - fin_size) {
-            return 0;
-        }
-        if (ret <= 0) {
-            continue;
-        }
-        fin_size += ret;
-    }
-    return 0;
-}
-
 /**
  * Get current date, yyyymmdd.
  */
@@ -340,6 +344,40 @@ static string cstr2str(const char* str) {
     return string(str);
 }
 
+/**
+ * Show the statistics of a queue in one line, used by the stat command.
+ * Rates are averaged from the construction of the queue.
+ */
+static string queue_stat2str(const string& name, const wtatom::QueueStat& st) {
+    stringstream ss;
+    ss << name << ": [depth: " << st.depth << "]";
+    if (st.enabled == false) {
+        ss << "[Compile with -DWTATOM_QUEUE_STAT for more.]";
+        return ss.str();
+    }
+    double sec = st.elapsed_us / 1e6;
+    if (sec <= 0) {
+        sec = 1e-6;
+    }
+    ss << "[high: " << st.high_watermark << "]"
+        << "[push: " << st.push_num << ", " << (uint64_t)(st.push_num / sec) << "/s]"
+        << "[get: " << st.get_num << ", " << (uint64_t)(st.get_num / sec) << "/s]"
+        << "[expansion: " << st.expansion_num << "][retry: " << st.retry_num << "]"
+        << "[queued us:";
+    for (size_t i = 0; i < wtatom::stat_bucket_num; ++i) {
+        if (st.queued_us[i] == 0) {
+            continue;
+        }
+        if (i == wtatom::stat_bucket_num - 1) {
+            ss << " >=" << ((uint64_t)1 << (i - 1)) << ": " << st.queued_us[i];
+        } else {
+            ss << " <" << ((uint64_t)1 << i) << ": " << st.queued_us[i];
+        }
+    }
+    ss << "]";
+    return ss.str();
+}
+
 } // End namespace wttool.
 
 #endif // End ifdef _WTLOG_TOOLS_H_.
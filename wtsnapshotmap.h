@@ -0,0 +1,267 @@
+/**
+ * Read-mostly thread safe map.
+ * Readers see an immutable snapshot without lock or allocation,
+ * writers copy the snapshot, modify it and publish the new one.
+ * Author: LiWentan.
+ * Date: 2019/7/16.
+ */
+
+#ifndef _WTLOG_SNAPSHOT_MAP_H_
+#define _WTLOG_SNAPSHOT_MAP_H_
+
+#include <algorithm>
+#include "wtlogtools.h"
+
+namespace wtatom {
+
+/**
+ * Old snapshots are freed when no reader may use them. Readers register
+ * in one of two counters chosen by the parity of the epoch, then load the snapshot.
+ * Each write replaces the snapshot, then flips the epoch. A reader of the replaced
+ * snapshot registered before the flip, but its parity may be either one: it may have
+ * registered after the write publishing that snapshot replaced, but before it flipped.
+ * So the snapshot is freed once each counter has been seen zero after the flip.
+ * Writers never wait for readers, a reader can modify the map while iterating.
+ * Suitable for small maps, e.g. connections, that are read far more than written.
+ */
+template <typename KeyType, typename ValType>
+class SnapshotMap {
+public:
+    typedef std::vector<std::pair<KeyType, ValType> > Snapshot; // Sorted by key.
+
+    /**
+     * Keeps a snapshot alive. Use * or -> to read it.
+     * Do not keep it for long, old snapshots can't be freed meanwhile.
+     */
+    class ReadGuard {
+    public:
+        ReadGuard(SnapshotMap<KeyType, ValType>* map) : _map(map) {
+            while (true) {
+                uint64_t epoch = _map->_epoch.load(std::memory_order_seq_cst);
+                _parity = epoch & 1;
+                _map->_readers[_parity].fetch_add(1, std::memory_order_seq_cst);
+                if (_map->_epoch.load(std::memory_order_seq_cst) == epoch) {
+                    break;
+                }
+                // A writer flipped the epoch meanwhile, register again.
+                _map->_readers[_parity].fetch_sub(1, std::memory_order_seq_cst);
+            }
+            _snap = _map->_snap.load(std::memory_order_seq_cst);
+        }
+        ReadGuard(ReadGuard&& rhs) : _map(rhs._map), _snap(rhs._snap), _parity(rhs._parity) {
+            rhs._map = nullptr;
+        }
+        ~ReadGuard() {
+            if (_map != nullptr) {
+                _map->_readers[_parity].fetch_sub(1, std::memory_order_seq_cst);
+            }
+        }
+        const Snapshot& operator*() const {
+            return *_snap;
+        }
+        const Snapshot* operator->() const {
+            return _snap;
+        }
+
+    private:
+        ReadGuard(const ReadGuard&);
+        ReadGuard& operator=(const ReadGuard&);
+
+        SnapshotMap<KeyType, ValType>* _map;
+        const Snapshot* _snap;
+        uint64_t _parity;
+    };
+
+public:
+    /**
+     * Construtive function.
+     */
+    SnapshotMap() : _snap(new Snapshot()), _epoch(0), _version(0) {
+        _readers[0].store(0);
+        _readers[1].store(0);
+        pthread_mutex_init(&_write_lock, nullptr);
+    }
+
+    /**
+     * Distructive function. No reader should be alive.
+     */
+    virtual ~SnapshotMap() {
+        delete _snap.load();
+        for (size_t i = 0; i < _retired.size(); ++i) {
+            delete _retired[i].snap;
+        }
+        pthread_mutex_destroy(&_write_lock);
+    }
+
+    /**
+     * Get the current snapshot.
+     */
+    ReadGuard read() {
+        return ReadGuard(this);
+    }
+
+    /**
+     * Increased by each write. Readers can check it to know whether their copy is stale.
+     */
+    uint64_t version() {
+        return _version.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Insert elements.
+     * @return true: Success.
+     * @return false: Already existing key. Overwrite the value.
+     */
+    bool insert(const std::pair<KeyType, ValType>& content) {
+        lock(_write_lock);
+        Snapshot* fresh = new Snapshot(*_snap.load(std::memory_order_relaxed));
+        auto it = _lower_bound(*fresh, content.first);
+        bool res = (it == fresh->end() || it->first != content.first);
+        if (res == true) {
+            fresh->insert(it, content);
+        } else {
+            it->second = content.second;
+        }
+        _publish(fresh);
+        unlock(_write_lock);
+        return res;
+    }
+
+    /**
+     * Get the value.
+     * @return true: Found key, write the parameter val as the correspond one.
+     * @return false: Unexisting key.
+     */
+    bool find(const KeyType& key, ValType* val = nullptr) {
+        ReadGuard guard(this);
+        auto it = _lower_bound(*guard, key);
+        if (it == guard->end() || it->first != key) {
+            return false;
+        }
+        if (val != nullptr) {
+            *val = it->second;
+        }
+        return true;
+    }
+
+    /**
+     * Get the value, then remove the element from the map.
+     * @return true: Success.
+     * @return false: Unexisting key.
+     */
+    bool find_and_remove(const KeyType& key, ValType* val = nullptr) {
+        lock(_write_lock);
+        const Snapshot* cur = _snap.load(std::memory_order_relaxed);
+        auto cur_it = _lower_bound(*cur, key);
+        if (cur_it == cur->end() || cur_it->first != key) {
+            unlock(_write_lock);
+            return false;
+        }
+        if (val != nullptr) {
+            *val = cur_it->second;
+        }
+        Snapshot* fresh = new Snapshot(*cur);
+        fresh->erase(fresh->begin() + (cur_it - cur->begin()));
+        _publish(fresh);
+        unlock(_write_lock);
+        return true;
+    }
+
+    /**
+     * Get all elements. Prefer read() to iterate without copying.
+     */
+    void get_all(std::vector<KeyType>* key, std::vector<ValType>* val) {
+        ReadGuard guard(this);
+        for (auto it = guard->begin(); it != guard->end(); ++it) {
+            if (key != nullptr) {
+                key->push_back(it->first);
+            }
+            if (val != nullptr) {
+                val->push_back(it->second);
+            }
+        }
+    }
+
+    /**
+     * Get the size.
+     */
+    size_t size() {
+        ReadGuard guard(this);
+        return guard->size();
+    }
+
+    /**
+     * Clear.
+     */
+    void clear() {
+        lock(_write_lock);
+        _publish(new Snapshot());
+        unlock(_write_lock);
+    }
+
+private:
+    std::atomic<const Snapshot*> _snap;   // Current snapshot.
+    std::atomic<uint64_t> _epoch;         // Increased by each write.
+    std::atomic<size_t> _readers[2];      // Readers registered in even and odd epochs.
+    std::atomic<uint64_t> _version;       // Same as _epoch, but published after the snapshot.
+    pthread_mutex_t _write_lock;          // Writers are serialized.
+    
+    /**
+     * A replaced snapshot waitting for its readers.
+     */
+    struct Retired {
+        const Snapshot* snap;
+        uint8_t drained; // Bit i is set once _readers[i] is seen zero after the snapshot is replaced.
+    };
+    std::vector<Retired> _retired; // Replaced snapshots. Only writers use it.
+
+private:
+    static typename Snapshot::const_iterator _lower_bound(const Snapshot& snap, const KeyType& key) {
+        return std::lower_bound(snap.begin(), snap.end(), key,
+            [](const std::pair<KeyType, ValType>& lhs, const KeyType& rhs) {
+                return lhs.first < rhs;
+            });
+    }
+    static typename Snapshot::iterator _lower_bound(Snapshot& snap, const KeyType& key) {
+        return std::lower_bound(snap.begin(), snap.end(), key,
+            [](const std::pair<KeyType, ValType>& lhs, const KeyType& rhs) {
+                return lhs.first < rhs;
+            });
+    }
+
+    /**
+     * Replace the snapshot, flip the epoch, then free the snapshots no reader can see.
+     * Called with _write_lock locked.
+     */
+    void _publish(Snapshot* fresh) {
+        const Snapshot* old = _snap.exchange(fresh, std::memory_order_seq_cst);
+        uint64_t epoch = _epoch.fetch_add(1, std::memory_order_seq_cst);
+        _version.store(epoch + 1, std::memory_order_release);
+        Retired retired = {old, 0};
+        _retired.push_back(retired);
+
+        // All readers of a retired snapshot registered before now. Readers registering
+        // meanwhile with a stale epoch retry, they never load a retired snapshot.
+        // A counter seen zero means the readers counted in it before have left.
+        uint8_t drained = 0;
+        for (uint8_t i = 0; i < 2; ++i) {
+            if (_readers[i].load(std::memory_order_seq_cst) == 0) {
+                drained |= 1 << i;
+            }
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < _retired.size(); ++i) {
+            _retired[i].drained |= drained;
+            if (_retired[i].drained == 3) {
+                delete _retired[i].snap;
+            } else {
+                _retired[kept++] = _retired[i];
+            }
+        }
+        _retired.resize(kept);
+    }
+};
+
+} // End namespace wtatom.
+
+#endif // End ifdef _WTLOG_SNAPSHOT_MAP_H_.
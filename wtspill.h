@@ -0,0 +1,168 @@
+/**
+ * Local file keeping logs while the log server is unreachable.
+ * Author: LiWentan.
+ * Date: 2019/7/21.
+ */
+
+#ifndef _WTLOG_SPILL_H_
+#define _WTLOG_SPILL_H_
+
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace wtlog {
+
+/**
+ * A bounded append-only file mapped to memory.
+ * Records are appended and consumed in order, the space is reused once all are consumed.
+ * The content is not kept across processes, the file is truncated when opened.
+ * Not thread safe, one thread owns it.
+ */
+class SpillFile {
+public:
+    /**
+     * Frames of a flushed batch. data points into the mapped file, valid until pop.
+     */
+    struct Record {
+        uint64_t first_seq; // Sequence number of the first log.
+        uint32_t log_num;
+        uint32_t size;
+        const char* data;
+    };
+
+    SpillFile() : _fd(-1), _base(nullptr), _capacity(0), _read(0), _write(0), _records(0), _logs(0) {}
+
+    ~SpillFile() {
+        close();
+    }
+
+    /**
+     * Create the file of capacity bytes and map it.
+     * @return false: Failed to create or map the file.
+     */
+    bool open(const std::string& path, size_t capacity) {
+        close();
+        if (capacity <= record_head_size) {
+            return false;
+        }
+        _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (_fd < 0) {
+            return false;
+        }
+        if (ftruncate(_fd, capacity) != 0) {
+            close();
+            return false;
+        }
+        void* base = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (base == MAP_FAILED) {
+            close();
+            return false;
+        }
+        _base = (char*)base;
+        _capacity = capacity;
+        return true;
+    }
+
+    void close() {
+        if (_base != nullptr) {
+            munmap(_base, _capacity);
+            _base = nullptr;
+        }
+        if (_fd >= 0) {
+            ::close(_fd);
+            _fd = -1;
+        }
+        _capacity = 0;
+        _read = 0;
+        _write = 0;
+        _records = 0;
+        _logs = 0;
+    }
+
+    bool is_open() const {
+        return _base != nullptr;
+    }
+
+    /**
+     * Append a record.
+     * @return false: Not open or no space left.
+     */
+    bool append(uint64_t first_seq, uint32_t log_num, const char* data, size_t size) {
+        if (_base == nullptr || size > _capacity - _write || _capacity - _write - size < record_head_size) {
+            return false;
+        }
+        char* pos = _base + _write;
+        memcpy(pos, &first_seq, sizeof(first_seq));
+        memcpy(pos + 8, &log_num, sizeof(log_num));
+        uint32_t size32 = size;
+        memcpy(pos + 12, &size32, sizeof(size32));
+        memcpy(pos + record_head_size, data, size);
+        _write += record_head_size + size;
+        ++_records;
+        _logs += log_num;
+        return true;
+    }
+
+    /**
+     * The oldest record.
+     * @return false: Empty.
+     */
+    bool front(Record* rec) const {
+        if (_records == 0) {
+            return false;
+        }
+        const char* pos = _base + _read;
+        memcpy(&rec->first_seq, pos, sizeof(rec->first_seq));
+        memcpy(&rec->log_num, pos + 8, sizeof(rec->log_num));
+        memcpy(&rec->size, pos + 12, sizeof(rec->size));
+        rec->data = pos + record_head_size;
+        return true;
+    }
+
+    /**
+     * Consume the oldest record.
+     */
+    void pop() {
+        Record rec;
+        if (front(&rec) == false) {
+            return;
+        }
+        _read += record_head_size + rec.size;
+        --_records;
+        _logs -= rec.log_num;
+        if (_records == 0) {
+            _read = 0;
+            _write = 0;
+        }
+    }
+
+    bool empty() const {
+        return _records == 0;
+    }
+
+    /**
+     * Number of logs in the records.
+     */
+    uint64_t logs() const {
+        return _logs;
+    }
+
+private:
+    static const size_t record_head_size = 16; // [first_seq(64)][log_num(32)][size(32)], in host order.
+
+    int      _fd;
+    char*    _base;
+    size_t   _capacity;
+    size_t   _read;    // Offset of the oldest record.
+    size_t   _write;   // Offset of the next record.
+    uint64_t _records;
+    uint64_t _logs;
+};
+
+} // End namespace wtlog.
+
+#endif // End ifdef _WTLOG_SPILL_H_.